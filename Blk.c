@@ -0,0 +1,256 @@
+/*
+ * blk.c - Asynchronous block I/O request queue
+ *
+ * Requests are kept sorted by LBA and dispatched in C-LOOK order: the
+ * card head position only sweeps upwards, wrapping to the lowest LBA.
+ * Queued requests that continue the dispatched one (same direction,
+ * adjacent LBAs) are merged into a single multi-block command, with each
+ * block scattered to its own request's buffer.
+ */
+
+#include "blk.h"
+#include "sd.h"
+#include "irq.h"
+#include "thread.h"
+#include "smp.h"
+#include "uart.h"
+
+static spinlock_t blk_lock = 0;         // Guards the queue from all cores
+static blk_request_t* queue = 0;        // Waiting, sorted by LBA
+static blk_request_t* active = 0;       // Merged into the command in flight
+static unsigned int head_pos = 0;       // LBA after the last dispatched block
+static unsigned int next_seq = 0;
+static unsigned char* merge_buffers[BLK_MAX_BLOCKS];
+
+// Statistics
+static unsigned int stat_requests = 0;
+static unsigned int stat_commands = 0;
+static unsigned int stat_merged = 0;
+static unsigned int stat_blocks = 0;
+static unsigned int stat_errors = 0;
+
+static void blk_dispatch(void);
+
+void blk_init(void) {
+    queue = 0;
+    active = 0;
+    head_pos = 0;
+}
+
+static int blk_overlaps(blk_request_t* a, blk_request_t* b) {
+    return a->lba < b->lba + b->count && b->lba < a->lba + a->count;
+}
+
+// A request must not overtake an earlier overlapping one if either writes
+static void blk_order(blk_request_t* req, blk_request_t* list) {
+    for (blk_request_t* r = list; r; r = r->next) {
+        if ((r->write || req->write) && blk_overlaps(r, req)) {
+            if (!req->after || r->seq > req->after->seq) {
+                req->after = r;
+            }
+        }
+    }
+}
+
+// Detach the requests of the finished command and release requests
+// ordered after them. blk_lock must be held.
+static blk_request_t* blk_detach_active(void) {
+    blk_request_t* done = active;
+    active = 0;
+    
+    for (blk_request_t* req = done; req; req = req->next) {
+        for (blk_request_t* r = queue; r; r = r->next) {
+            if (r->after == req) r->after = 0;
+        }
+    }
+    return done;
+}
+
+// Report completion without blk_lock held, so callbacks may submit
+static void blk_finish(blk_request_t* done, int status) {
+    while (done) {
+        blk_request_t* req = done;
+        done = done->next;
+        
+        req->next = 0;
+        req->status = status;
+        if (req->callback) {
+            req->callback(req);
+        }
+        thread_wake(req);
+    }
+}
+
+// Command completion, called from the SD interrupt
+static void blk_complete(int status, void* ctx) {
+    (void)ctx;
+    
+    spin_lock(&blk_lock);
+    if (status != SD_OK) stat_errors++;
+    blk_request_t* done = blk_detach_active();
+    spin_unlock(&blk_lock);
+    
+    blk_finish(done, status);
+    
+    spin_lock(&blk_lock);
+    blk_dispatch();
+    spin_unlock(&blk_lock);
+}
+
+static void blk_unlink(blk_request_t* req) {
+    blk_request_t** link = &queue;
+    while (*link != req) link = &(*link)->next;
+    *link = req->next;
+    req->next = 0;
+}
+
+// Start the next command if the card is idle. Interrupts must be masked
+// and blk_lock held.
+static void blk_dispatch(void) {
+    while (!active && queue) {
+        // C-LOOK: first ready request at or above the head, else the lowest
+        blk_request_t* pick = 0;
+        blk_request_t* lowest = 0;
+        for (blk_request_t* r = queue; r; r = r->next) {
+            if (r->after) continue;
+            if (!lowest) lowest = r;
+            if (r->lba >= head_pos) {
+                pick = r;
+                break;
+            }
+        }
+        if (!pick) pick = lowest;
+        if (!pick) return;
+        
+        blk_unlink(pick);
+        active = pick;
+        
+        // Merge queued requests that continue this one
+        blk_request_t* tail = pick;
+        unsigned int count = pick->count;
+        int merging = 1;
+        while (merging) {
+            merging = 0;
+            for (blk_request_t* r = queue; r; r = r->next) {
+                if (r->lba == pick->lba + count && r->write == pick->write &&
+                    !r->after && count + r->count <= BLK_MAX_BLOCKS) {
+                    blk_unlink(r);
+                    tail->next = r;
+                    tail = r;
+                    count += r->count;
+                    stat_merged++;
+                    merging = 1;
+                    break;
+                }
+            }
+        }
+        
+        unsigned int n = 0;
+        for (blk_request_t* r = active; r; r = r->next) {
+            for (unsigned int i = 0; i < r->count; i++) {
+                merge_buffers[n++] = r->buffer + i * BLK_SIZE;
+            }
+        }
+        
+        head_pos = pick->lba + count;
+        stat_commands++;
+        stat_blocks += count;
+        
+        int status = sd_transfer_async(pick->lba, count, pick->write,
+                                       merge_buffers, blk_complete, 0);
+        if (status != SD_OK) {
+            stat_errors++;
+            blk_request_t* done = blk_detach_active();
+            spin_unlock(&blk_lock);
+            blk_finish(done, status);
+            spin_lock(&blk_lock);
+        }
+    }
+}
+
+// Queue a request; its callback runs once it completes
+int blk_submit(blk_request_t* req) {
+    if (req->count == 0 || req->count > BLK_MAX_BLOCKS) return SD_ERROR;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&blk_lock);
+    
+    req->status = BLK_PENDING;
+    req->seq = next_seq++;
+    req->after = 0;
+    req->next = 0;
+    blk_order(req, active);
+    blk_order(req, queue);
+    
+    // Insert after any request with the same or lower LBA
+    blk_request_t** link = &queue;
+    while (*link && (*link)->lba <= req->lba) {
+        link = &(*link)->next;
+    }
+    req->next = *link;
+    *link = req;
+    
+    stat_requests++;
+    blk_dispatch();
+    
+    spin_unlock(&blk_lock);
+    irq_restore(flags);
+    return SD_OK;
+}
+
+int blk_wait(blk_request_t* req) {
+    unsigned int flags = irq_save();
+    while (req->status == BLK_PENDING) {
+        thread_wait(req);
+    }
+    irq_restore(flags);
+    return req->status;
+}
+
+static int blk_sync(unsigned int lba, unsigned int count, unsigned char* buffer, int write) {
+    blk_request_t req;
+    
+    while (count > 0) {
+        unsigned int chunk = count > BLK_MAX_BLOCKS ? BLK_MAX_BLOCKS : count;
+        
+        req.lba = lba;
+        req.count = chunk;
+        req.buffer = buffer;
+        req.write = write;
+        req.callback = 0;
+        req.ctx = 0;
+        
+        if (blk_submit(&req) != SD_OK) return SD_ERROR;
+        int status = blk_wait(&req);
+        if (status != SD_OK) return status;
+        
+        lba += chunk;
+        count -= chunk;
+        buffer += chunk * BLK_SIZE;
+    }
+    
+    return SD_OK;
+}
+
+int blk_read(unsigned int lba, unsigned int count, unsigned char* buffer) {
+    return blk_sync(lba, count, buffer, 0);
+}
+
+int blk_write(unsigned int lba, unsigned int count, const unsigned char* buffer) {
+    return blk_sync(lba, count, (unsigned char*)buffer, 1);
+}
+
+void blk_stats(void) {
+    uart_puts("Block I/O:\n");
+    uart_puts("  Requests: ");
+    uart_dec(stat_requests);
+    uart_puts("\n  Commands: ");
+    uart_dec(stat_commands);
+    uart_puts(" (");
+    uart_dec(stat_merged);
+    uart_puts(" merged)\n  Blocks: ");
+    uart_dec(stat_blocks);
+    uart_puts("\n  Errors: ");
+    uart_dec(stat_errors);
+    uart_puts("\n");
+}
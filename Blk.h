@@ -0,0 +1,37 @@
+/*
+ * blk.h - Asynchronous block I/O request queue header
+ */
+
+#ifndef BLK_H
+#define BLK_H
+
+#define BLK_SIZE        512
+#define BLK_MAX_BLOCKS  128     // Largest single command (64KB)
+#define BLK_PENDING     1       // Request status while queued or in flight
+
+typedef struct blk_request blk_request_t;
+typedef void (*blk_callback_t)(blk_request_t* req);
+
+struct blk_request {
+    unsigned int lba;
+    unsigned int count;             // 1..BLK_MAX_BLOCKS
+    unsigned char* buffer;          // count * 512 bytes, word aligned
+    int write;
+    blk_callback_t callback;        // Optional, runs in interrupt context
+    void* ctx;
+    
+    // Owned by the block layer
+    volatile int status;
+    unsigned int seq;
+    blk_request_t* after;           // Must complete before this one starts
+    blk_request_t* next;
+};
+
+void blk_init(void);
+int blk_submit(blk_request_t* req);
+int blk_wait(blk_request_t* req);
+int blk_read(unsigned int lba, unsigned int count, unsigned char* buffer);
+int blk_write(unsigned int lba, unsigned int count, const unsigned char* buffer);
+void blk_stats(void);
+
+#endif
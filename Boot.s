@@ -2,14 +2,55 @@
  * boot.S - Nib OS bootloader and initial setup for ARM
  */
 
+.arch_extension virt
+.arch_extension sec
+
+// Local peripherals (BCM2836/7): per-core mailbox 3 read/clear registers
+.equ LOCAL_MBOX3_RDCLR, 0x400000CC
+
+// Secondary cores get small boot stacks below core 0's
+.equ SECONDARY_STACK_TOP, 0xF00000
+.equ SECONDARY_STACK_SIZE, 0x10000
+
+// The firmware may enter in HYP mode; drop to SVC with IRQ/FIQ masked
+.macro drop_to_svc
+    mrs r0, cpsr
+    and r1, r0, #0x1F
+    cmp r1, #0x1A
+    bne 1f
+    bic r0, r0, #0x1F
+    orr r0, r0, #0xD3
+    msr spsr_cxsf, r0
+    adr r0, 1f
+    msr elr_hyp, r0
+    eret
+1:
+.endm
+
+// Enable VFP and install the exception vectors on this core
+.macro cpu_setup
+    mrc p15, 0, r0, c1, c0, 2
+    orr r0, r0, #0x300000
+    orr r0, r0, #0xC00000
+    mcr p15, 0, r0, c1, c0, 2
+    isb
+    mov r0, #0x40000000
+    vmsr fpexc, r0
+
+    ldr r0, =vectors
+    mcr p15, 0, r0, c12, c0, 0
+.endm
+
 .section ".text.boot"
 .global _start
 
 _start:
+    drop_to_svc
+
     // Get CPU ID - only CPU 0 should continue
     mrc p15, 0, r0, c0, c0, 5
     ands r0, r0, #3
-    bne halt
+    bne secondary_park
 
     // Set stack pointer to 16MB (increased for MicroPython)
     ldr sp, =0x1000000
@@ -25,27 +66,282 @@ clear_bss:
     b clear_bss
 
 clear_done:
-    // Enable VFP (Vector Floating Point)
-    mrc p15, 0, r0, c1, c0, 2
-    orr r0, r0, #0x300000
-    orr r0, r0, #0xC00000
-    mcr p15, 0, r0, c1, c0, 2
-    mov r0, #0x40000000
-    vmsr fpexc, r0
+    // Enable VFP (Vector Floating Point) and install exception vectors
+    cpu_setup
 
-    // Enable L1 Cache
-    mrc p15, 0, r0, c1, c0, 0
-    orr r0, r0, #(1 << 2)   // Data cache
-    orr r0, r0, #(1 << 12)  // Instruction cache
-    mcr p15, 0, r0, c1, c0, 0
+    // Caches are enabled together with the MMU in mmu_init()
 
     // Jump to kernel main
     bl kernel_main
 
 halt:
-    // If we return from kernel_main or we're not CPU 0, halt
+    // If we return from kernel_main, halt
     wfe
     b halt
 
+// Secondary cores wait here until smp_init() posts an entry address in
+// their mailbox 3 (the same protocol the firmware stub uses)
+secondary_park:
+    mrc p15, 0, r0, c0, c0, 5
+    and r0, r0, #3
+    ldr r1, =LOCAL_MBOX3_RDCLR
+    add r1, r1, r0, lsl #4
+1:
+    wfe
+    ldr r2, [r1]
+    cmp r2, #0
+    beq 1b
+    str r2, [r1]                // Clear the mailbox
+    bx r2
+
+// Entry point posted to secondary cores by smp_init()
+.global secondary_start
+secondary_start:
+    drop_to_svc
+
+    mrc p15, 0, r4, c0, c0, 5
+    and r4, r4, #3
+
+    // sp = SECONDARY_STACK_TOP - (core - 1) * SECONDARY_STACK_SIZE
+    ldr sp, =SECONDARY_STACK_TOP
+    sub r0, r4, #1
+    sub sp, sp, r0, lsl #16
+
+    cpu_setup
+
+    mov r0, r4
+    bl secondary_main
+    b halt
+
+// Exception vector table (VBAR needs 32-byte alignment)
+.section ".text"
+.balign 32
+vectors:
+    b _start            // Reset
+    b halt              // Undefined instruction
+    b halt              // SVC
+    b halt              // Prefetch abort
+    b abort_entry       // Data abort
+    b halt              // Unused
+    b irq_entry         // IRQ
+    b halt              // FIQ
+
+// IRQ entry: handle the interrupt on the interrupted SVC stack so the
+// IRQ-mode stack is never used
+irq_entry:
+    sub lr, lr, #4
+    srsdb sp!, #0x13            // Push return address and SPSR to SVC stack
+    cps #0x13
+    push {r0-r3, r12, lr}
+    vpush {d0-d7}               // Caller-saved VFP state
+    vmrs r0, fpscr
+    and r1, sp, #4              // Realign to 8 bytes for AAPCS
+    sub sp, sp, r1
+    push {r0, r1}
+    bl irq_handler
+    pop {r0, r1}
+    add sp, sp, r1
+    vmsr fpscr, r0
+    vpop {d0-d7}
+    pop {r0-r3, r12, lr}
+    rfeia sp!
+
+// Data abort entry: like irq_entry, but returns to the faulting
+// instruction, which is retried once mmu_data_abort() has mapped the page
+abort_entry:
+    sub lr, lr, #8
+    srsdb sp!, #0x13
+    cps #0x13
+    push {r0-r3, r12, lr}
+    ldr r2, [sp, #28]           // Interrupted CPSR (saved by srsdb)
+    vpush {d0-d7}
+    vmrs r0, fpscr
+    and r1, sp, #4
+    sub sp, sp, r1
+    push {r0, r1}
+    mrc p15, 0, r0, c6, c0, 0   // DFAR
+    mrc p15, 0, r1, c5, c0, 0   // DFSR
+    bl mmu_data_abort
+    pop {r0, r1}
+    add sp, sp, r1
+    vmsr fpscr, r0
+    vpop {d0-d7}
+    pop {r0-r3, r12, lr}
+    rfeia sp!
+
+// void thread_switch(unsigned long* old_sp, unsigned long new_sp)
+// Save the callee-saved context on the current stack, store sp to
+// *old_sp, then restore the context saved on new_sp and return into it
+.global thread_switch
+thread_switch:
+    push {r3-r11, lr}           // r3 keeps the frame 8-byte aligned
+    vpush {d8-d15}
+    vmrs r2, fpscr
+    push {r2, r3}
+    str sp, [r0]
+    mov sp, r1
+    pop {r2, r3}
+    vmsr fpscr, r2
+    vpop {d8-d15}
+    pop {r3-r11, lr}
+    bx lr
+
+// int exec_call(void* entry, const exec_sys_t* sys, int argc, char** argv,
+//               void* stack, unsigned long* saved_sp)
+// Run a loaded program on its own stack. The callee-saved registers are
+// kept on the kernel stack, whose sp goes to *saved_sp so exec_return
+// can unwind from anywhere in the program.
+.global exec_call
+exec_call:
+    push {r3-r11, lr}           // r3 keeps the frame 8-byte aligned
+    vpush {d8-d15}
+    ldr r12, [sp, #104]         // stack
+    ldr r4, [sp, #108]          // saved_sp
+    str sp, [r4]
+    mov sp, r12
+    mov r12, r0
+    mov r0, r1
+    mov r1, r2
+    mov r2, r3
+    blx r12
+    ldr sp, [r4]
+exec_unwind:
+    vpop {d8-d15}
+    pop {r3-r11, lr}
+    bx lr
+
+// void exec_return(unsigned long sp, int code)
+.global exec_return
+exec_return:
+    mov sp, r0
+    mov r0, r1
+    b exec_unwind
+
+// Chainload trampoline. load.c copies chain_start..chain_end into a page
+// outside the kernel image, fills in the parameter block and runs it
+// from there, so the new image can be copied over this one. Everything
+// in between is position independent. The layout of the parameter
+// block matches load_chain_t in load.c.
+.balign 64
+.global chain_start
+chain_start:
+chain_src:      .word 0                 // Image to copy to 0x8000
+chain_size:     .word 0
+                .space 56
+chain_parked:   .space 64               // One byte per core, set with caches off
+chain_go:       .word 0                 // Set by the loading core when done
+                .space 60
+
+// Other cores: flush and disable caches and MMU, report in, then wait
+// for the new image and enter it like a fresh boot
+.global chain_park
+chain_park:
+    cpsid if
+    bl chain_cache_off
+    mrc p15, 0, r0, c0, c0, 5
+    and r0, r0, #3
+    adr r1, chain_parked
+    mov r2, #1
+    strb r2, [r1, r0]
+    dsb
+1:
+    wfe
+    ldr r0, chain_go
+    cmp r0, #0
+    beq 1b
+    b chain_enter
+
+// Loading core, once the others have parked: copy the image over the
+// kernel, turn caches and MMU off, release the others and start it
+.global chain_boot
+chain_boot:
+    cpsid if
+    ldr r0, chain_src
+    ldr r1, chain_size
+    mov r2, #0x8000
+1:
+    ldmia r0!, {r3-r10}
+    stmia r2!, {r3-r10}
+    subs r1, r1, #32
+    bgt 1b
+    bl chain_cache_off
+    adr r1, chain_go
+    mov r0, #1
+    str r0, [r1]
+    dsb
+    sev
+chain_enter:
+    mov r0, #0
+    mov r1, #0
+    mov r2, #0x100              // Where the firmware puts ATAGs
+    mov r3, #0x8000
+    bx r3
+
+// Clean the data caches to memory, disable MMU and caches, then drop
+// every cached line and translation so the next kernel starts clean
+chain_cache_off:
+    mov r12, lr
+    bl chain_flush_dcache
+    mrc p15, 0, r0, c1, c0, 0
+    bic r0, r0, #0x5            // MMU, data cache
+    bic r0, r0, #0x1800         // Branch prediction, instruction cache
+    mcr p15, 0, r0, c1, c0, 0
+    isb
+    bl chain_flush_dcache
+    mov r0, #0
+    mcr p15, 0, r0, c7, c5, 0   // Invalidate instruction cache
+    mcr p15, 0, r0, c7, c5, 6   // Invalidate branch predictor
+    mcr p15, 0, r0, c8, c7, 0   // Invalidate TLBs
+    dsb
+    isb
+    bx r12
+
+// Clean and invalidate every data cache level up to the point of
+// coherency by set/way. Uses r0-r5, r7, r9-r11.
+chain_flush_dcache:
+    mrc p15, 1, r0, c0, c0, 1   // CLIDR
+    ands r3, r0, #0x07000000
+    mov r3, r3, lsr #23         // Level of coherency * 2
+    beq 5f
+    mov r10, #0                 // Current level * 2
+1:
+    add r2, r10, r10, lsr #1
+    mov r1, r0, lsr r2
+    and r1, r1, #7              // Cache type at this level
+    cmp r1, #2
+    blt 4f                      // No data cache here
+    mcr p15, 2, r10, c0, c0, 0  // Select the level in CSSELR
+    isb
+    mrc p15, 1, r1, c0, c0, 0   // CCSIDR
+    and r2, r1, #7
+    add r2, r2, #4              // log2(line size)
+    movw r4, #0x3FF
+    ands r4, r4, r1, lsr #3     // Highest way number
+    clz r5, r4                  // Way field position
+    movw r7, #0x7FFF
+    ands r7, r7, r1, lsr #13    // Highest set number
+2:
+    mov r9, r4
+3:
+    orr r11, r10, r9, lsl r5
+    orr r11, r11, r7, lsl r2
+    mcr p15, 0, r11, c7, c14, 2 // Clean and invalidate by set/way
+    subs r9, r9, #1
+    bge 3b
+    subs r7, r7, #1
+    bge 2b
+4:
+    add r10, r10, #2
+    cmp r3, r10
+    bgt 1b
+5:
+    mov r10, #0
+    mcr p15, 2, r10, c0, c0, 0
+    dsb
+    isb
+    bx lr
+.global chain_end
+chain_end:
+
 .section ".data"
     // Data section placeholder
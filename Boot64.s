@@ -0,0 +1,481 @@
+/*
+ * boot64.S - Nib OS bootloader and initial setup for AArch64
+ */
+
+// Secondary cores get small boot stacks below core 0's
+.equ SECONDARY_STACK_TOP, 0xF00000
+.equ SECONDARY_STACK_SIZE, 0x10000
+
+// SCTLR_EL1 reserved-one bits; MMU, caches and alignment checks off
+.equ SCTLR_EL1_INIT, 0x30D00800
+
+// Exception frame built by frame_push
+.equ IRQ_FRAME, 704
+
+// The firmware may enter in EL3 or EL2; drop to EL1 (on SP_EL1) with
+// all exceptions masked, leaving the timers and FP/SIMD untrapped
+.macro drop_to_el1
+    mrs x0, CurrentEL
+    cmp x0, #(3 << 2)
+    bne 1f
+    mov x0, #0x5B1              // Non-secure, EL2 AArch64 with HVC, no SMC
+    msr scr_el3, x0
+    mov x0, #0x3C9              // EL2h, DAIF masked
+    msr spsr_el3, x0
+    adr x0, 1f
+    msr elr_el3, x0
+    eret
+1:
+    mrs x0, CurrentEL
+    cmp x0, #(2 << 2)
+    bne 2f
+    mov x0, #3
+    msr cnthctl_el2, x0         // EL1 may use the physical counter and timer
+    msr cntvoff_el2, xzr
+    mov x0, #(1 << 31)          // EL1 is AArch64
+    msr hcr_el2, x0
+    mov x0, #0x33FF
+    msr cptr_el2, x0            // No FP/SIMD traps
+    msr hstr_el2, xzr
+    mrs x0, midr_el1
+    msr vpidr_el2, x0
+    mrs x0, mpidr_el1
+    msr vmpidr_el2, x0
+    mov x0, #0x3C5              // EL1h, DAIF masked
+    msr spsr_el2, x0
+    adr x0, 2f
+    msr elr_el2, x0
+    eret
+2:
+.endm
+
+// Enable FP/SIMD and install the exception vectors on this core
+.macro cpu_setup
+    ldr x0, =SCTLR_EL1_INIT
+    msr sctlr_el1, x0
+    mov x0, #(3 << 20)
+    msr cpacr_el1, x0
+    ldr x0, =vectors
+    msr vbar_el1, x0
+    isb
+.endm
+
+.section ".text.boot"
+.global _start
+
+_start:
+    drop_to_el1
+
+    // Get CPU ID - only CPU 0 should continue
+    mrs x0, mpidr_el1
+    ands x0, x0, #3
+    bne secondary_park
+
+    // Set stack pointer to 16MB (increased for MicroPython)
+    ldr x0, =0x1000000
+    mov sp, x0
+
+    // Clear BSS section (8-byte aligned by linker64.ld)
+    ldr x0, =__bss_start
+    ldr x1, =__bss_end
+clear_bss:
+    cmp x0, x1
+    bhs clear_done
+    str xzr, [x0], #8
+    b clear_bss
+
+clear_done:
+    // Enable FP/SIMD and install exception vectors
+    cpu_setup
+
+    // Caches are enabled together with the MMU in mmu_init()
+
+    // Jump to kernel main
+    bl kernel_main
+
+halt:
+    // If we return from kernel_main, halt
+    wfe
+    b halt
+
+// Secondary cores that entered here wait until smp_init() posts an entry
+// address in their spin table slot (the same protocol the firmware stub
+// uses)
+secondary_park:
+    mrs x0, mpidr_el1
+    and x0, x0, #3
+    ldr x1, =spin_table
+    add x1, x1, x0, lsl #3
+1:
+    wfe
+    ldr x2, [x1]
+    cbz x2, 1b
+    str xzr, [x1]               // Clear the slot
+    br x2
+
+// Entry point posted to secondary cores by smp_init()
+.global secondary_start
+secondary_start:
+    drop_to_el1
+
+    mrs x19, mpidr_el1
+    and x19, x19, #3
+
+    // sp = SECONDARY_STACK_TOP - (core - 1) * SECONDARY_STACK_SIZE
+    ldr x0, =SECONDARY_STACK_TOP
+    sub x1, x19, #1
+    sub x0, x0, x1, lsl #16
+    mov sp, x0
+
+    cpu_setup
+
+    mov x0, x19
+    bl secondary_main
+    b halt
+
+// Exception vector table: 16 entries of 0x80 bytes, 2KB aligned. Only
+// exceptions taken from EL1 on SP_EL1 are expected.
+.macro ventry label
+    .balign 0x80
+    b \label
+.endm
+
+.section ".text"
+.balign 2048
+vectors:
+    ventry halt                 // Current EL, SP_EL0: synchronous
+    ventry halt                 //   IRQ
+    ventry halt                 //   FIQ
+    ventry halt                 //   SError
+    ventry sync_entry           // Current EL, SP_EL1: synchronous
+    ventry irq_entry            //   IRQ
+    ventry halt                 //   FIQ
+    ventry halt                 //   SError
+    ventry halt                 // Lower EL, AArch64
+    ventry halt
+    ventry halt
+    ventry halt
+    ventry halt                 // Lower EL, AArch32
+    ventry halt
+    ventry halt
+    ventry halt
+
+// Save every register the C handlers may clobber on the interrupted
+// stack: x0-x18, x30, ELR, SPSR, FPCR, FPSR and all of q0-q31. The C
+// code only preserves the low halves of v8-v15 (d8-d15, which is all
+// thread_switch keeps), so those are saved whole here as well. ELR and
+// SPSR are on the stack too, so the handler may switch threads.
+.macro frame_push
+    sub sp, sp, #IRQ_FRAME
+    stp x0, x1, [sp, #0]
+    stp x2, x3, [sp, #16]
+    stp x4, x5, [sp, #32]
+    stp x6, x7, [sp, #48]
+    stp x8, x9, [sp, #64]
+    stp x10, x11, [sp, #80]
+    stp x12, x13, [sp, #96]
+    stp x14, x15, [sp, #112]
+    stp x16, x17, [sp, #128]
+    stp x18, x30, [sp, #144]
+    mrs x0, elr_el1
+    mrs x1, spsr_el1
+    stp x0, x1, [sp, #160]
+    mrs x0, fpcr
+    mrs x1, fpsr
+    stp x0, x1, [sp, #176]
+    stp q0, q1, [sp, #192]
+    stp q2, q3, [sp, #224]
+    stp q4, q5, [sp, #256]
+    stp q6, q7, [sp, #288]
+    stp q8, q9, [sp, #320]
+    stp q10, q11, [sp, #352]
+    stp q12, q13, [sp, #384]
+    stp q14, q15, [sp, #416]
+    stp q16, q17, [sp, #448]
+    stp q18, q19, [sp, #480]
+    stp q20, q21, [sp, #512]
+    stp q22, q23, [sp, #544]
+    stp q24, q25, [sp, #576]
+    stp q26, q27, [sp, #608]
+    stp q28, q29, [sp, #640]
+    stp q30, q31, [sp, #672]
+.endm
+
+.macro frame_pop
+    ldp q30, q31, [sp, #672]
+    ldp q28, q29, [sp, #640]
+    ldp q26, q27, [sp, #608]
+    ldp q24, q25, [sp, #576]
+    ldp q22, q23, [sp, #544]
+    ldp q20, q21, [sp, #512]
+    ldp q18, q19, [sp, #480]
+    ldp q16, q17, [sp, #448]
+    ldp q14, q15, [sp, #416]
+    ldp q12, q13, [sp, #384]
+    ldp q10, q11, [sp, #352]
+    ldp q8, q9, [sp, #320]
+    ldp q6, q7, [sp, #288]
+    ldp q4, q5, [sp, #256]
+    ldp q2, q3, [sp, #224]
+    ldp q0, q1, [sp, #192]
+    ldp x0, x1, [sp, #176]
+    msr fpcr, x0
+    msr fpsr, x1
+    ldp x0, x1, [sp, #160]
+    msr elr_el1, x0
+    msr spsr_el1, x1
+    ldp x18, x30, [sp, #144]
+    ldp x16, x17, [sp, #128]
+    ldp x14, x15, [sp, #112]
+    ldp x12, x13, [sp, #96]
+    ldp x10, x11, [sp, #80]
+    ldp x8, x9, [sp, #64]
+    ldp x6, x7, [sp, #48]
+    ldp x4, x5, [sp, #32]
+    ldp x2, x3, [sp, #16]
+    ldp x0, x1, [sp, #0]
+    add sp, sp, #IRQ_FRAME
+.endm
+
+// IRQ entry: handle the interrupt on the interrupted stack
+irq_entry:
+    frame_push
+    bl irq_handler
+    frame_pop
+    eret
+
+// Synchronous exception entry: ELR is the faulting instruction, which is
+// retried once mmu_data_abort() has mapped the page
+sync_entry:
+    frame_push
+    mrs x0, far_el1
+    mrs x1, esr_el1
+    ldr x2, [sp, #168]          // Interrupted SPSR
+    bl mmu_data_abort
+    frame_pop
+    eret
+
+// void thread_switch(unsigned long* old_sp, unsigned long new_sp)
+// Save the callee-saved context on the current stack, store sp to
+// *old_sp, then restore the context saved on new_sp and return into it.
+// The frame layout matches thread_build_frame() in thread.c.
+.global thread_switch
+thread_switch:
+    sub sp, sp, #176
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8, d9, [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mrs x2, fpcr
+    mrs x3, fpsr
+    stp x2, x3, [sp, #160]
+    mov x2, sp
+    str x2, [x0]
+    mov sp, x1
+    ldp x2, x3, [sp, #160]
+    msr fpcr, x2
+    msr fpsr, x3
+    ldp d14, d15, [sp, #144]
+    ldp d12, d13, [sp, #128]
+    ldp d10, d11, [sp, #112]
+    ldp d8, d9, [sp, #96]
+    ldp x29, x30, [sp, #80]
+    ldp x27, x28, [sp, #64]
+    ldp x25, x26, [sp, #48]
+    ldp x23, x24, [sp, #32]
+    ldp x21, x22, [sp, #16]
+    ldp x19, x20, [sp, #0]
+    add sp, sp, #176
+    ret
+
+// int exec_call(void* entry, const exec_sys_t* sys, int argc, char** argv,
+//               void* stack, unsigned long* saved_sp)
+// Run a loaded program on its own stack. The callee-saved registers are
+// kept on the kernel stack, whose sp goes to *saved_sp so exec_return
+// can unwind from anywhere in the program.
+.global exec_call
+exec_call:
+    sub sp, sp, #160
+    stp x19, x20, [sp, #0]
+    stp x21, x22, [sp, #16]
+    stp x23, x24, [sp, #32]
+    stp x25, x26, [sp, #48]
+    stp x27, x28, [sp, #64]
+    stp x29, x30, [sp, #80]
+    stp d8, d9, [sp, #96]
+    stp d10, d11, [sp, #112]
+    stp d12, d13, [sp, #128]
+    stp d14, d15, [sp, #144]
+    mov x19, x5
+    mov x9, sp
+    str x9, [x19]
+    mov sp, x4
+    mov x9, x0
+    mov x0, x1
+    mov w1, w2
+    mov x2, x3
+    blr x9
+    ldr x9, [x19]
+    mov sp, x9
+exec_unwind:
+    ldp d14, d15, [sp, #144]
+    ldp d12, d13, [sp, #128]
+    ldp d10, d11, [sp, #112]
+    ldp d8, d9, [sp, #96]
+    ldp x29, x30, [sp, #80]
+    ldp x27, x28, [sp, #64]
+    ldp x25, x26, [sp, #48]
+    ldp x23, x24, [sp, #32]
+    ldp x21, x22, [sp, #16]
+    ldp x19, x20, [sp, #0]
+    add sp, sp, #160
+    ret
+
+// void exec_return(unsigned long sp, int code)
+.global exec_return
+exec_return:
+    mov sp, x0
+    mov w0, w1
+    b exec_unwind
+
+// Chainload trampoline. load.c copies chain_start..chain_end into a page
+// outside the kernel image, fills in the parameter block and runs it
+// from there, so the new image can be copied over this one. Everything
+// in between is position independent. The layout of the parameter
+// block matches load_chain_t in load.c.
+.balign 64
+.global chain_start
+chain_start:
+chain_src:      .word 0                 // Image to copy to 0x80000
+chain_size:     .word 0
+                .space 56
+chain_parked:   .space 64               // One byte per core, set with caches off
+chain_go:       .word 0                 // Set by the loading core when done
+                .space 60
+
+// Other cores: flush and disable caches and MMU, report in, then wait
+// for the new image and enter it like a fresh boot
+.global chain_park
+chain_park:
+    msr daifset, #0xF
+    bl chain_cache_off
+    mrs x0, mpidr_el1
+    and x0, x0, #3
+    adr x1, chain_parked
+    mov w2, #1
+    strb w2, [x1, x0]
+    dsb sy
+1:
+    wfe
+    ldr w0, chain_go
+    cbz w0, 1b
+    b chain_enter
+
+// Loading core, once the others have parked: copy the image over the
+// kernel, clear the spin table the new kernel parks its cores on, turn
+// caches and MMU off, release the others and start it
+.global chain_boot
+chain_boot:
+    msr daifset, #0xF
+    ldr w0, chain_src
+    ldr w1, chain_size
+    mov x2, #0x80000
+1:
+    ldp x3, x4, [x0], #16
+    ldp x5, x6, [x0], #16
+    ldp x7, x8, [x0], #16
+    ldp x9, x10, [x0], #16
+    stp x3, x4, [x2], #16
+    stp x5, x6, [x2], #16
+    stp x7, x8, [x2], #16
+    stp x9, x10, [x2], #16
+    subs w1, w1, #64
+    bgt 1b
+    mov x0, #0xD8               // spin_table (no literal pool in here)
+    stp xzr, xzr, [x0]
+    stp xzr, xzr, [x0, #16]
+    bl chain_cache_off
+    adr x1, chain_go
+    mov w0, #1
+    str w0, [x1]
+    dsb sy
+    sev
+chain_enter:
+    mov x0, #0                  // No device tree
+    mov x1, #0
+    mov x2, #0
+    mov x3, #0
+    mov x4, #0x80000
+    br x4
+
+// Clean the data caches to memory, disable MMU and caches, then drop
+// every cached line and translation so the next kernel starts clean
+chain_cache_off:
+    mov x12, x30
+    bl chain_flush_dcache
+    mrs x0, sctlr_el1
+    mov x1, #0x1005             // MMU, data cache, instruction cache
+    bic x0, x0, x1
+    msr sctlr_el1, x0
+    isb
+    bl chain_flush_dcache
+    ic iallu
+    tlbi vmalle1
+    dsb sy
+    isb
+    ret x12
+
+// Clean and invalidate every data cache level up to the point of
+// coherency by set/way. Uses x0-x7, x9-x11.
+chain_flush_dcache:
+    mrs x0, clidr_el1
+    and w3, w0, #0x07000000
+    lsr w3, w3, #23             // Level of coherency * 2
+    cbz w3, 5f
+    mov w10, #0                 // Current level * 2
+1:
+    add w2, w10, w10, lsr #1
+    lsr w1, w0, w2
+    and w1, w1, #7              // Cache type at this level
+    cmp w1, #2
+    blt 4f                      // No data cache here
+    msr csselr_el1, x10         // Select the level
+    isb
+    mrs x1, ccsidr_el1
+    and w2, w1, #7
+    add w2, w2, #4              // log2(line size)
+    ubfx w4, w1, #3, #10        // Highest way number
+    clz w5, w4                  // Way field position
+    ubfx w7, w1, #13, #15       // Highest set number
+2:
+    mov w9, w4
+3:
+    lsl w6, w9, w5
+    orr w11, w10, w6
+    lsl w6, w7, w2
+    orr w11, w11, w6
+    dc cisw, x11                // Clean and invalidate by set/way
+    subs w9, w9, #1
+    bge 3b
+    subs w7, w7, #1
+    bge 2b
+4:
+    add w10, w10, #2
+    cmp w3, w10
+    bgt 1b
+5:
+    msr csselr_el1, xzr
+    dsb sy
+    isb
+    ret
+.global chain_end
+chain_end:
+
+.section ".data"
+    // Data section placeholder
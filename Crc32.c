@@ -0,0 +1,129 @@
+/*
+ * crc32.c - CRC-32 (IEEE 802.3), slice-by-8 tables on ARMv7, or the
+ * ARMv8 CRC32 instructions eight bytes at a time on AArch64
+ */
+
+#include "crc32.h"
+
+#define CRC32_POLY 0xEDB88320      // Reflected 0x04C11DB7
+
+#ifdef __ARM_FEATURE_CRC32
+
+#include <arm_acle.h>
+
+unsigned int crc32(unsigned int crc, const void* data, unsigned int len) {
+    const unsigned char* p = (const unsigned char*)data;
+    
+    crc = ~crc;
+    while (((unsigned long)p & 7) && len) {
+        crc = __crc32b(crc, *p++);
+        len--;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        crc = __crc32d(crc, *(const unsigned long long*)p);
+    }
+    while (len--) {
+        crc = __crc32b(crc, *p++);
+    }
+    return ~crc;
+}
+
+// The instructions need no tables
+void crc32_init(void) {
+}
+
+#else
+
+// crc32_table[k][b] is the CRC of byte b followed by k zero bytes, so
+// eight bytes can be folded in with eight independent lookups (8KB)
+static unsigned int crc32_table[8][256];
+
+// Built once at boot, before the other cores start, so lookups need no
+// flag or barrier
+void crc32_init(void) {
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+        }
+        crc32_table[0][i] = c;
+    }
+    for (unsigned int i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            unsigned int c = crc32_table[k - 1][i];
+            crc32_table[k][i] = (c >> 8) ^ crc32_table[0][c & 0xFF];
+        }
+    }
+}
+
+unsigned int crc32(unsigned int crc, const void* data, unsigned int len) {
+    const unsigned char* p = (const unsigned char*)data;
+    
+    crc = ~crc;
+    while (((unsigned long)p & 3) && len) {
+        crc = crc32_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+        len--;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        unsigned int lo = *(const unsigned int*)p ^ crc;
+        unsigned int hi = *(const unsigned int*)(p + 4);
+        crc = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+              crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+              crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+              crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+    }
+    while (len--) {
+        crc = crc32_table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#endif
+
+// Multiply vec by a 32x32 matrix over GF(2), one column per word
+static unsigned int gf2_times(const unsigned int* mat, unsigned int vec) {
+    unsigned int sum = 0;
+    while (vec) {
+        if (vec & 1) sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+static void gf2_square(unsigned int* square, const unsigned int* mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_times(mat, mat[n]);
+    }
+}
+
+// CRC of A followed by B from crc(A), crc(B) and the length of B, by
+// appending len2 zero bytes to crc1 with repeated squaring of the
+// one-zero-bit operator (as in zlib)
+unsigned int crc32_combine(unsigned int crc1, unsigned int crc2, unsigned int len2) {
+    unsigned int even[32];
+    unsigned int odd[32];
+    
+    if (len2 == 0) return crc1;
+    
+    odd[0] = CRC32_POLY;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = 1u << (n - 1);
+    }
+    gf2_square(even, odd);          // Two zero bits
+    gf2_square(odd, even);          // Four zero bits
+    
+    // First pass applies one zero byte
+    while (1) {
+        gf2_square(even, odd);
+        if (len2 & 1) crc1 = gf2_times(even, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+    
+        gf2_square(odd, even);
+        if (len2 & 1) crc1 = gf2_times(odd, crc1);
+        len2 >>= 1;
+        if (len2 == 0) break;
+    }
+    return crc1 ^ crc2;
+}
@@ -0,0 +1,18 @@
+/*
+ * crc32.h - CRC-32 (IEEE 802.3, as used by zlib and Ethernet)
+ */
+
+#ifndef CRC32_H
+#define CRC32_H
+
+// Builds the lookup tables; call once before any other core uses crc32()
+void crc32_init(void);
+
+// Start with crc = 0 and feed the previous result back in to continue
+unsigned int crc32(unsigned int crc, const void* data, unsigned int len);
+
+// CRC of two blocks back to back, given the CRC of each and the length
+// of the second, so blocks can be checked independently (in parallel)
+unsigned int crc32_combine(unsigned int crc1, unsigned int crc2, unsigned int len2);
+
+#endif
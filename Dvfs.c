@@ -0,0 +1,375 @@
+/*
+ * dvfs.c - Thermal-aware ARM clock governor
+ *
+ * A kernel thread wakes every DVFS_PERIOD_MS and samples the load of the
+ * busiest core from the scheduler's idle time, plus the SoC temperature
+ * and the firmware throttle flags from the mailbox. It moves the ARM
+ * clock one DVFS_STEP_MHZ level at a time:
+ *
+ *  - down when the temperature, extrapolated DVFS_LOOKAHEAD_MS ahead on
+ *    its slope over the last second, would come within DVFS_MARGIN_MC of
+ *    the firmware's throttle temperature, or when the firmware reports
+ *    throttling already. The level it left becomes a ceiling. These
+ *    steps are DVFS_SETTLE_MS apart, giving the temperature time to
+ *    respond to the lower clock.
+ *  - up, never past the ceiling, while the busiest core is more than
+ *    DVFS_UP_LOAD percent busy
+ *  - down while it is under DVFS_DOWN_LOAD percent, which banks thermal
+ *    headroom for the next burst
+ *
+ * The ceiling goes back up a level after the temperature has stayed
+ * DVFS_HYSTERESIS_MC under the limit for DVFS_RAISE_MS. A long job thus
+ * settles at the fastest clock the cooling can hold, instead of starting
+ * at the maximum and having the firmware cut it mid-run.
+ */
+
+#include "dvfs.h"
+#include "mailbox.h"
+#include "thread.h"
+#include "timer.h"
+#include "irq.h"
+#include "smp.h"
+#include "uart.h"
+
+#define DVFS_UP_LOAD        80      // Percent busy on the busiest core
+#define DVFS_DOWN_LOAD      30
+#define DVFS_MARGIN_MC      8000    // Millidegrees below the throttle point
+#define DVFS_HYSTERESIS_MC  4000
+#define DVFS_LOOKAHEAD_MS   2000
+#define DVFS_RAISE_MS       5000
+#define DVFS_SETTLE_MS      1000    // Between thermal steps down
+#define DVFS_SLOPE_SAMPLES  (1000 / DVFS_PERIOD_MS)
+
+// Why the clock or the ceiling changed
+#define DVFS_WHY_LOAD       0
+#define DVFS_WHY_IDLE       1
+#define DVFS_WHY_THERMAL    2
+#define DVFS_WHY_THROTTLED  3
+#define DVFS_WHY_COOLED     4
+
+typedef struct {
+    unsigned int time_ms;           // Since the governor started
+    unsigned short from_mhz;
+    unsigned short to_mhz;
+    unsigned char why;
+    unsigned char load;
+    unsigned short ceiling_mhz;
+    int temp_mc;
+} dvfs_event_t;
+
+static const char* const dvfs_why[] = {
+    "load", "idle", "thermal", "throttled", "cooled"
+};
+
+// Governor state. The thread owns it; dvfs_status() copies it under
+// dvfs_lock.
+static spinlock_t dvfs_lock = 0;
+static volatile int dvfs_on = 0;
+static int dvfs_running = 0;
+static unsigned int levels_mhz[DVFS_MAX_LEVELS];
+static unsigned int level_ms[DVFS_MAX_LEVELS];
+static unsigned int level_count = 0;
+static unsigned int level = 0;
+static unsigned int ceiling = 0;
+static int temp_mc = 0;
+static int limit_mc = 0;
+static int throttle_mc = 0;
+static unsigned int measured_mhz = 0;
+static unsigned int throttled = 0;
+static unsigned int load_pct = 0;
+static unsigned int uptime_ms = 0;
+static dvfs_event_t events[DVFS_LOG_SIZE];
+static unsigned int event_count = 0;
+
+static int dvfs_get(unsigned int tag, unsigned int id, unsigned int* value) {
+    unsigned int values[2] = { id, 0 };
+    if (mbox_property(tag, values, 2) != 0) return -1;
+    *value = values[1];
+    return 0;
+}
+
+static unsigned int dvfs_set_mhz(unsigned int mhz) {
+    unsigned int values[3] = { MBOX_CLOCK_ARM, mhz * 1000000, 0 };
+    if (mbox_property(MBOX_TAG_SET_CLOCK_RATE, values, 3) != 0) return 0;
+    return values[1] / 1000000;
+}
+
+// Highest level at or below mhz
+static unsigned int dvfs_level_of(unsigned int mhz) {
+    unsigned int found = 0;
+    for (unsigned int i = 0; i < level_count; i++) {
+        if (levels_mhz[i] <= mhz) found = i;
+    }
+    return found;
+}
+
+// Called with dvfs_lock held
+static void dvfs_log(unsigned int from, unsigned int why) {
+    dvfs_event_t* e = &events[event_count++ % DVFS_LOG_SIZE];
+    e->time_ms = uptime_ms;
+    e->from_mhz = levels_mhz[from];
+    e->to_mhz = levels_mhz[level];
+    e->why = why;
+    e->load = load_pct;
+    e->ceiling_mhz = levels_mhz[ceiling];
+    e->temp_mc = temp_mc;
+}
+
+static void dvfs_main(void* arg) {
+    (void)arg;
+    
+    unsigned int idle_ms[SMP_MAX_CORES];
+    int history[DVFS_SLOPE_SAMPLES];
+    unsigned int samples = 0;
+    unsigned int cool_ms = 0;
+    unsigned int settle_ms = DVFS_SETTLE_MS;
+    unsigned int last = timer_ticks();
+    
+    for (unsigned int core = 0; core < SMP_MAX_CORES; core++) {
+        idle_ms[core] = thread_idle_ms(core);
+    }
+    
+    while (1) {
+        thread_sleep(DVFS_PERIOD_MS);
+    
+        unsigned int now = timer_ticks();
+        unsigned int elapsed = (now - last) / 1000;
+        last = now;
+        if (elapsed == 0) elapsed = 1;
+    
+        // Busiest core over the period
+        unsigned int busiest = 0;
+        for (unsigned int core = 0; core < SMP_MAX_CORES; core++) {
+            if (!smp_core_online(core)) continue;
+            unsigned int idle = thread_idle_ms(core);
+            unsigned int delta = idle - idle_ms[core];
+            idle_ms[core] = idle;
+            if (delta > elapsed) delta = elapsed;
+            unsigned int busy = 100 - delta * 100 / elapsed;
+            if (busy > busiest) busiest = busy;
+        }
+    
+        // Time at the current clock counts even if the sensors fail
+        unsigned int flags = irq_save();
+        spin_lock(&dvfs_lock);
+        level_ms[level] += elapsed;
+        uptime_ms += elapsed;
+        load_pct = busiest;
+        spin_unlock(&dvfs_lock);
+        irq_restore(flags);
+    
+        unsigned int temp, mhz, flags_fw;
+        if (dvfs_get(MBOX_TAG_GET_TEMPERATURE, 0, &temp) != 0) continue;
+        if (dvfs_get(MBOX_TAG_GET_CLOCK_RATE_MEASURED, MBOX_CLOCK_ARM, &mhz) != 0) mhz = 0;
+        if (dvfs_get(MBOX_TAG_GET_THROTTLED, 0, &flags_fw) != 0) flags_fw = 0;
+    
+        // Extrapolate the temperature from its slope over the last second
+        int predicted = (int)temp;
+        unsigned int span = samples < DVFS_SLOPE_SAMPLES ? samples : DVFS_SLOPE_SAMPLES;
+        if (span > 0) {
+            int rise = (int)temp - history[(samples - span) % DVFS_SLOPE_SAMPLES];
+            if (rise > 0) predicted += rise * (DVFS_LOOKAHEAD_MS / DVFS_PERIOD_MS) / (int)span;
+        }
+        history[samples++ % DVFS_SLOPE_SAMPLES] = (int)temp;
+    
+        // The soft limit bit only says the firmware has capped the clock
+        // (60C on a 3B+); active throttling means it is already too hot
+        int fw_hot = (flags_fw & MBOX_THROTTLED_ACTIVE) != 0;
+        int hot = fw_hot || predicted >= limit_mc;
+    
+        flags = irq_save();
+        spin_lock(&dvfs_lock);
+    
+        temp_mc = (int)temp;
+        measured_mhz = mhz / 1000000;
+        throttled = flags_fw;
+    
+        unsigned int from = level;
+        int why = -1;
+    
+        if (dvfs_on) {
+            if (hot && settle_ms >= DVFS_SETTLE_MS && level > 0) {
+                level--;
+                ceiling = level;
+                why = fw_hot ? DVFS_WHY_THROTTLED : DVFS_WHY_THERMAL;
+            } else if (!hot && busiest >= DVFS_UP_LOAD && level < ceiling) {
+                level++;
+                why = DVFS_WHY_LOAD;
+            } else if (busiest <= DVFS_DOWN_LOAD && level > 0) {
+                level--;
+                why = DVFS_WHY_IDLE;
+            }
+    
+            if (why == DVFS_WHY_THERMAL || why == DVFS_WHY_THROTTLED) settle_ms = 0;
+            else if (settle_ms < DVFS_SETTLE_MS) settle_ms += elapsed;
+    
+            // Give back a ceiling level once it has stayed cool for a while
+            if (hot || (int)temp >= limit_mc - DVFS_HYSTERESIS_MC) {
+                cool_ms = 0;
+            } else if (ceiling < level_count - 1 && (cool_ms += elapsed) >= DVFS_RAISE_MS) {
+                ceiling++;
+                cool_ms = 0;
+                if (why < 0) why = DVFS_WHY_COOLED;
+            }
+        }
+    
+        unsigned int target = levels_mhz[level];
+        if (why >= 0) dvfs_log(from, why);
+    
+        spin_unlock(&dvfs_lock);
+        irq_restore(flags);
+    
+        if (level == from) continue;
+    
+        // Account for the clock the firmware actually set, which may be
+        // clamped, or the old one if it refused
+        unsigned int actual = dvfs_set_mhz(target);
+        if (actual != target) {
+            flags = irq_save();
+            spin_lock(&dvfs_lock);
+            level = actual ? dvfs_level_of(actual) : from;
+            if (ceiling < level) ceiling = level;
+            if (why >= 0) events[(event_count - 1) % DVFS_LOG_SIZE].to_mhz = levels_mhz[level];
+            spin_unlock(&dvfs_lock);
+            irq_restore(flags);
+        }
+    }
+}
+
+// Find the ARM clock range and start the governor thread. Does nothing
+// if the firmware does not report temperatures or clocks (QEMU).
+void dvfs_init(void) {
+    unsigned int min_hz, max_hz, cur_hz, max_mc, temp;
+    
+    if (dvfs_get(MBOX_TAG_GET_MIN_CLOCK_RATE, MBOX_CLOCK_ARM, &min_hz) != 0 ||
+        dvfs_get(MBOX_TAG_GET_MAX_CLOCK_RATE, MBOX_CLOCK_ARM, &max_hz) != 0 ||
+        dvfs_get(MBOX_TAG_GET_CLOCK_RATE, MBOX_CLOCK_ARM, &cur_hz) != 0 ||
+        dvfs_get(MBOX_TAG_GET_MAX_TEMPERATURE, 0, &max_mc) != 0 ||
+        dvfs_get(MBOX_TAG_GET_TEMPERATURE, 0, &temp) != 0 ||
+        min_hz == 0 || max_hz < min_hz || max_mc == 0) {
+        uart_puts("DVFS: no clock or temperature control, governor off\n");
+        return;
+    }
+    
+    // Levels from the minimum up in steps, ending exactly at the maximum
+    unsigned int min_mhz = min_hz / 1000000;
+    unsigned int max_mhz = max_hz / 1000000;
+    level_count = 0;
+    for (unsigned int mhz = min_mhz; mhz < max_mhz && level_count < DVFS_MAX_LEVELS - 1;
+         mhz += DVFS_STEP_MHZ) {
+        levels_mhz[level_count++] = mhz;
+    }
+    levels_mhz[level_count++] = max_mhz;
+    
+    // Start from the level nearest the firmware's choice
+    level = dvfs_level_of(cur_hz / 1000000);
+    ceiling = level_count - 1;
+    throttle_mc = (int)max_mc;
+    limit_mc = throttle_mc - DVFS_MARGIN_MC;
+    temp_mc = (int)temp;
+    dvfs_on = 1;
+    
+    if (thread_create_on("dvfs", dvfs_main, 0, THREAD_PRIO_HIGH, THREAD_ANY_CORE) < 0) {
+        dvfs_on = 0;
+        return;
+    }
+    dvfs_running = 1;
+    
+    uart_puts("DVFS: ");
+    uart_dec(min_mhz);
+    uart_puts("-");
+    uart_dec(max_mhz);
+    uart_puts(" MHz, throttle at ");
+    uart_dec(max_mc / 1000);
+    uart_puts(" C\n");
+}
+
+// Off leaves the clock where it is
+void dvfs_enable(int on) {
+    dvfs_on = on && dvfs_running;
+}
+
+// Millidegrees or milliseconds as units with one decimal
+static void dvfs_put_tenths(int value) {
+    if (value < 0) {
+        uart_putc('-');
+        value = -value;
+    }
+    uart_dec(value / 1000);
+    uart_putc('.');
+    uart_dec((value % 1000) / 100);
+}
+
+void dvfs_status(void) {
+    if (!dvfs_running) {
+        uart_puts("DVFS governor not running (no firmware clock or temperature control)\n");
+        return;
+    }
+    
+    unsigned int times[DVFS_MAX_LEVELS];
+    dvfs_event_t log[DVFS_LOG_SIZE];
+    
+    unsigned int flags = irq_save();
+    spin_lock(&dvfs_lock);
+    unsigned int count = level_count;
+    unsigned int cur = levels_mhz[level];
+    unsigned int top = levels_mhz[ceiling];
+    unsigned int measured = measured_mhz;
+    unsigned int fw = throttled;
+    unsigned int load = load_pct;
+    int temp = temp_mc;
+    for (unsigned int i = 0; i < count; i++) times[i] = level_ms[i];
+    unsigned int logged = event_count < DVFS_LOG_SIZE ? event_count : DVFS_LOG_SIZE;
+    for (unsigned int i = 0; i < logged; i++) {
+        log[i] = events[(event_count - logged + i) % DVFS_LOG_SIZE];
+    }
+    spin_unlock(&dvfs_lock);
+    irq_restore(flags);
+    
+    uart_puts(dvfs_on ? "DVFS governor: on\n" : "DVFS governor: off (clock held)\n");
+    uart_puts("  ARM clock: ");
+    uart_dec(cur);
+    uart_puts(" MHz set, ");
+    uart_dec(measured);
+    uart_puts(" MHz measured, ceiling ");
+    uart_dec(top);
+    uart_puts(" MHz\n  Temperature: ");
+    dvfs_put_tenths(temp);
+    uart_puts(" C, limit ");
+    dvfs_put_tenths(limit_mc);
+    uart_puts(" C, throttle at ");
+    dvfs_put_tenths(throttle_mc);
+    uart_puts(" C\n  Busiest core: ");
+    uart_dec(load);
+    uart_puts("%, firmware throttle flags ");
+    uart_hex(fw);
+    uart_puts("\n  Time at each clock:\n");
+    for (unsigned int i = 0; i < count; i++) {
+        uart_puts("    ");
+        uart_dec(levels_mhz[i]);
+        uart_puts(" MHz  ");
+        dvfs_put_tenths(times[i]);
+        uart_puts(" s\n");
+    }
+    
+    uart_puts("  Recent decisions:\n");
+    if (logged == 0) uart_puts("    none\n");
+    for (unsigned int i = 0; i < logged; i++) {
+        const dvfs_event_t* e = &log[i];
+        uart_puts("    ");
+        dvfs_put_tenths(e->time_ms);
+        uart_puts("s  ");
+        uart_dec(e->from_mhz);
+        uart_puts(" -> ");
+        uart_dec(e->to_mhz);
+        uart_puts(" MHz (ceiling ");
+        uart_dec(e->ceiling_mhz);
+        uart_puts(")  ");
+        uart_puts(dvfs_why[e->why]);
+        uart_puts(", load ");
+        uart_dec(e->load);
+        uart_puts("%, ");
+        dvfs_put_tenths(e->temp_mc);
+        uart_puts(" C\n");
+    }
+}
@@ -0,0 +1,17 @@
+/*
+ * dvfs.h - Thermal-aware ARM clock governor
+ */
+
+#ifndef DVFS_H
+#define DVFS_H
+
+#define DVFS_PERIOD_MS      100     // Sampling period
+#define DVFS_STEP_MHZ       100     // Clock step between levels
+#define DVFS_MAX_LEVELS     16
+#define DVFS_LOG_SIZE       16      // Decisions kept for dvfs_status()
+
+void dvfs_init(void);
+void dvfs_enable(int on);
+void dvfs_status(void);
+
+#endif
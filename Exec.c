@@ -0,0 +1,446 @@
+/*
+ * exec.c - Load and run native programs
+ *
+ * A program is an ELF shared object (ET_DYN, as linked with -pie) for
+ * the kernel's own architecture. Its PT_LOAD segments are copied into
+ * pages from the pool with their relative layout kept, .bss zeroed, and
+ * the relative relocations from PT_DYNAMIC applied for wherever that
+ * landed. Symbol relocations are rejected: programs are static.
+ *
+ * The program runs on the calling thread, at kernel privilege, on its
+ * own stack (exec_call in boot.S); it can be preempted like any thread.
+ * What it allocates or opens through the sys table is recorded so it
+ * can be released when the program ends, however it ends.
+ */
+
+#include "exec.h"
+#include "vfs.h"
+#include "memory.h"
+#include "mmu.h"
+#include "thread.h"
+#include "timer.h"
+#include "irq.h"
+#include "smp.h"
+#include "uart.h"
+
+// ELF definitions for the build's own class
+#define ELF_MAGIC           0x464C457F      // "\x7FELF"
+#define ET_DYN              3
+#define PT_LOAD             1
+#define PT_DYNAMIC          2
+#define DT_NULL             0
+
+#ifdef __aarch64__
+
+#define ELF_CLASS           2
+#define ELF_MACHINE         183             // EM_AARCH64
+#define DT_RELOCS           7               // DT_RELA
+#define DT_RELOCS_SIZE      8
+#define DT_RELOCS_ENT       9
+#define R_NONE              0
+#define R_RELATIVE          1027
+
+typedef unsigned long elf_addr_t;
+
+typedef struct {
+    unsigned char ident[16];
+    unsigned short type;
+    unsigned short machine;
+    unsigned int version;
+    unsigned long entry;
+    unsigned long phoff;
+    unsigned long shoff;
+    unsigned int flags;
+    unsigned short ehsize;
+    unsigned short phentsize;
+    unsigned short phnum;
+    unsigned short shentsize;
+    unsigned short shnum;
+    unsigned short shstrndx;
+} elf_header_t;
+
+typedef struct {
+    unsigned int type;
+    unsigned int flags;
+    unsigned long offset;
+    unsigned long vaddr;
+    unsigned long paddr;
+    unsigned long filesz;
+    unsigned long memsz;
+    unsigned long align;
+} elf_phdr_t;
+
+typedef struct {
+    long tag;
+    unsigned long val;
+} elf_dyn_t;
+
+typedef struct {
+    unsigned long offset;
+    unsigned long info;
+    long addend;
+} elf_reloc_t;
+
+#define RELOC_TYPE(info)    ((info) & 0xFFFFFFFF)
+
+#else
+
+#define ELF_CLASS           1
+#define ELF_MACHINE         40              // EM_ARM
+#define DT_RELOCS           17              // DT_REL
+#define DT_RELOCS_SIZE      18
+#define DT_RELOCS_ENT       19
+#define R_NONE              0
+#define R_RELATIVE          23
+
+typedef unsigned int elf_addr_t;
+
+typedef struct {
+    unsigned char ident[16];
+    unsigned short type;
+    unsigned short machine;
+    unsigned int version;
+    unsigned int entry;
+    unsigned int phoff;
+    unsigned int shoff;
+    unsigned int flags;
+    unsigned short ehsize;
+    unsigned short phentsize;
+    unsigned short phnum;
+    unsigned short shentsize;
+    unsigned short shnum;
+    unsigned short shstrndx;
+} elf_header_t;
+
+typedef struct {
+    unsigned int type;
+    unsigned int offset;
+    unsigned int vaddr;
+    unsigned int paddr;
+    unsigned int filesz;
+    unsigned int memsz;
+    unsigned int flags;
+    unsigned int align;
+} elf_phdr_t;
+
+typedef struct {
+    int tag;
+    unsigned int val;
+} elf_dyn_t;
+
+typedef struct {
+    unsigned int offset;
+    unsigned int info;
+} elf_reloc_t;
+
+#define RELOC_TYPE(info)    ((info) & 0xFF)
+
+#endif
+
+// A running program, found again by thread from the sys calls
+typedef struct {
+    int used;
+    int thread;
+    unsigned long saved_sp;         // Kernel stack to unwind to on exit
+    void* allocs[EXEC_MAX_ALLOCS];
+    unsigned int fds;               // Bit per open vfs descriptor
+} exec_program_t;
+
+static exec_program_t programs[EXEC_MAX_PROGRAMS];
+static spinlock_t exec_lock = 0;
+
+// boot.S: call entry(sys, argc, argv) on stack, saving the kernel sp in
+// *saved_sp; exec_return unwinds to it from anywhere in the program
+extern int exec_call(void* entry, const exec_sys_t* sys, int argc, char** argv,
+                     void* stack, unsigned long* saved_sp);
+extern void exec_return(unsigned long sp, int code) __attribute__((noreturn));
+
+static exec_program_t* exec_current(void) {
+    int id = thread_id();
+    for (int i = 0; i < EXEC_MAX_PROGRAMS; i++) {
+        if (programs[i].used && programs[i].thread == id) return &programs[i];
+    }
+    return 0;
+}
+
+// System calls
+
+static int sys_getc(void) {
+    return (unsigned char)uart_getc();
+}
+
+static int sys_open(const char* path, int flags) {
+    int fd = vfs_open(path, flags);
+    if (fd >= 0) exec_current()->fds |= 1u << fd;
+    return fd;
+}
+
+static int sys_close(int fd) {
+    exec_program_t* program = exec_current();
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !(program->fds & (1u << fd))) return VFS_ERROR;
+    program->fds &= ~(1u << fd);
+    return vfs_close(fd);
+}
+
+// Reads and writes only go to descriptors this program opened
+static int sys_read(int fd, void* buffer, unsigned int len) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !(exec_current()->fds & (1u << fd))) return VFS_ERROR;
+    return vfs_read(fd, buffer, len);
+}
+
+static int sys_write(int fd, const void* buffer, unsigned int len) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !(exec_current()->fds & (1u << fd))) return VFS_ERROR;
+    return vfs_write(fd, buffer, len);
+}
+
+static void* sys_alloc(unsigned int size) {
+    exec_program_t* program = exec_current();
+    if (size == 0 || size > ~0u - (PAGE_SIZE - 1)) return 0;
+    
+    for (int i = 0; i < EXEC_MAX_ALLOCS; i++) {
+        if (program->allocs[i]) continue;
+    
+        void* block = page_alloc_run((size + PAGE_SIZE - 1) / PAGE_SIZE);
+        program->allocs[i] = block;
+        return block;
+    }
+    return 0;
+}
+
+static void sys_free(void* ptr) {
+    exec_program_t* program = exec_current();
+    if (!ptr) return;
+    
+    for (int i = 0; i < EXEC_MAX_ALLOCS; i++) {
+        if (program->allocs[i] == ptr) {
+            program->allocs[i] = 0;
+            page_free(ptr);
+            return;
+        }
+    }
+}
+
+static void sys_exit(int code) {
+    exec_return(exec_current()->saved_sp, code);
+}
+
+static const exec_sys_t exec_sys = {
+    .version = EXEC_ABI_VERSION,
+    .size = sizeof(exec_sys_t),
+    .putc = uart_putc,
+    .puts = uart_puts,
+    .getc = sys_getc,
+    .open = sys_open,
+    .read = sys_read,
+    .write = sys_write,
+    .close = sys_close,
+    .ticks = timer_ticks,
+    .sleep = thread_sleep,
+    .alloc = sys_alloc,
+    .free = sys_free,
+    .exit = sys_exit,
+};
+
+// Loading
+
+// True if [offset, offset + len) lies within size bytes
+static int exec_within(unsigned long offset, unsigned long len, unsigned long size) {
+    return offset <= size && len <= size - offset;
+}
+
+// Copy the segments of elf into a fresh image and relocate it. Returns
+// the image and sets *entry, or 0 with *error set.
+static unsigned char* exec_load(const unsigned char* elf, unsigned int size, void** entry,
+                                int* error) {
+    const elf_header_t* header = (const elf_header_t*)elf;
+    *error = EXEC_BAD_FORMAT;
+    
+    if (size < sizeof(elf_header_t) || *(const unsigned int*)elf != ELF_MAGIC ||
+        header->ident[4] != ELF_CLASS || header->ident[5] != 1 ||
+        header->machine != ELF_MACHINE || header->phentsize != sizeof(elf_phdr_t) ||
+        !exec_within(header->phoff, (unsigned long)header->phnum * sizeof(elf_phdr_t), size)) {
+        uart_puts("exec: not an ELF program for this CPU\n");
+        return 0;
+    }
+    if (header->type != ET_DYN) {
+        uart_puts("exec: not position independent (link with -pie)\n");
+        return 0;
+    }
+    
+    // Extent of the loadable segments
+    const elf_phdr_t* phdrs = (const elf_phdr_t*)(elf + header->phoff);
+    elf_addr_t low = ~(elf_addr_t)0;
+    elf_addr_t high = 0;
+    const elf_phdr_t* dynamic = 0;
+    
+    for (int i = 0; i < header->phnum; i++) {
+        const elf_phdr_t* ph = &phdrs[i];
+        if (ph->type == PT_DYNAMIC) dynamic = ph;
+        if (ph->type != PT_LOAD) continue;
+    
+        if (ph->filesz > ph->memsz || !exec_within(ph->offset, ph->filesz, size) ||
+            ph->memsz > EXEC_MAX_IMAGE || ph->vaddr > EXEC_MAX_IMAGE) {
+            uart_puts("exec: bad segment\n");
+            return 0;
+        }
+        if (ph->vaddr < low) low = ph->vaddr;
+        if (ph->vaddr + ph->memsz > high) high = ph->vaddr + ph->memsz;
+    }
+    low &= ~(elf_addr_t)(PAGE_SIZE - 1);
+    if (high <= low || high - low > EXEC_MAX_IMAGE) {
+        uart_puts("exec: no loadable segments, or too large\n");
+        return 0;
+    }
+    
+    unsigned int span = high - low;
+    unsigned char* image = (unsigned char*)page_alloc_run((span + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!image) {
+        *error = EXEC_NO_MEMORY;
+        return 0;
+    }
+    memset(image, 0, span);
+    
+    for (int i = 0; i < header->phnum; i++) {
+        const elf_phdr_t* ph = &phdrs[i];
+        if (ph->type == PT_LOAD) {
+            memcpy(image + (ph->vaddr - low), elf + ph->offset, ph->filesz);
+        }
+    }
+    
+    // Relative relocations: add the load address to each pointer. The
+    // dynamic section is read from the loaded image, as it will be used.
+    elf_addr_t delta = (elf_addr_t)(unsigned long)image - low;
+    if (dynamic) {
+        if (!exec_within(dynamic->vaddr - low, dynamic->memsz, span)) goto bad;
+    
+        const elf_dyn_t* dyn = (const elf_dyn_t*)(image + (dynamic->vaddr - low));
+        unsigned int count = dynamic->memsz / sizeof(elf_dyn_t);
+        elf_addr_t relocs = 0;
+        elf_addr_t relocs_size = 0;
+        elf_addr_t relocs_ent = sizeof(elf_reloc_t);
+    
+        for (unsigned int i = 0; i < count && dyn[i].tag != DT_NULL; i++) {
+            if (dyn[i].tag == DT_RELOCS) relocs = dyn[i].val;
+            else if (dyn[i].tag == DT_RELOCS_SIZE) relocs_size = dyn[i].val;
+            else if (dyn[i].tag == DT_RELOCS_ENT) relocs_ent = dyn[i].val;
+        }
+    
+        if (relocs_size) {
+            if (relocs_ent != sizeof(elf_reloc_t) || relocs < low ||
+                !exec_within(relocs - low, relocs_size, span)) goto bad;
+    
+            const elf_reloc_t* rel = (const elf_reloc_t*)(image + (relocs - low));
+            for (unsigned int i = 0; i < relocs_size / sizeof(elf_reloc_t); i++) {
+                unsigned long type = RELOC_TYPE(rel[i].info);
+                if (type == R_NONE) continue;
+                if (type != R_RELATIVE) {
+                    uart_puts("exec: unsupported relocation type ");
+                    uart_dec(type);
+                    uart_puts("\n");
+                    goto bad;
+                }
+                if (rel[i].offset < low || !exec_within(rel[i].offset - low, sizeof(elf_addr_t), span)) {
+                    goto bad;
+                }
+    
+                elf_addr_t* where = (elf_addr_t*)(image + (rel[i].offset - low));
+#ifdef __aarch64__
+                *where = delta + rel[i].addend;
+#else
+                *where += delta;
+#endif
+            }
+        }
+    }
+    
+    if (header->entry < low || header->entry - low >= span) goto bad;
+    *entry = image + (header->entry - low);
+    
+    // The new code goes through the data cache; make it visible to
+    // instruction fetch on every core
+    mmu_clean_dcache(image, span);
+#ifdef __aarch64__
+    asm volatile("ic ialluis\n\tdsb sy\n\tisb" ::: "memory");
+#else
+    asm volatile("mcr p15, 0, %0, c7, c1, 0\n\tdsb\n\tisb" :: "r"(0) : "memory");
+#endif
+    
+    *error = EXEC_OK;
+    return image;
+    
+bad:
+    uart_puts("exec: bad dynamic section or relocations\n");
+    page_free(image);
+    return 0;
+}
+
+// Release whatever the program left allocated or open
+static void exec_cleanup(exec_program_t* program) {
+    for (int i = 0; i < EXEC_MAX_ALLOCS; i++) {
+        if (program->allocs[i]) {
+            page_free(program->allocs[i]);
+            program->allocs[i] = 0;
+        }
+    }
+    for (int fd = 0; fd < VFS_MAX_OPEN; fd++) {
+        if (program->fds & (1u << fd)) vfs_close(fd);
+    }
+    program->fds = 0;
+}
+
+int exec_run(const char* path, int argc, char** argv, int* code) {
+    unsigned int size;
+    const unsigned char* file = vfs_load(path, &size);
+    if (!file) return EXEC_NOT_FOUND;
+    
+    void* entry;
+    int error;
+    unsigned char* image = exec_load(file, size, &entry, &error);
+    vfs_release(file);
+    if (!image) return error;
+    
+    unsigned char* stack = (unsigned char*)page_alloc_run(EXEC_STACK_SIZE / PAGE_SIZE);
+    if (!stack) {
+        page_free(image);
+        return EXEC_NO_MEMORY;
+    }
+    
+    // Claim a slot for this thread
+    exec_program_t* program = 0;
+    unsigned int flags = irq_save();
+    spin_lock(&exec_lock);
+    for (int i = 0; i < EXEC_MAX_PROGRAMS && !program; i++) {
+        if (!programs[i].used) {
+            program = &programs[i];
+            program->used = 1;
+            program->thread = thread_id();
+        }
+    }
+    spin_unlock(&exec_lock);
+    irq_restore(flags);
+    
+    if (!program) {
+        page_free(stack);
+        page_free(image);
+        return EXEC_BUSY;
+    }
+    
+    *code = exec_call(entry, &exec_sys, argc, argv, stack + EXEC_STACK_SIZE, &program->saved_sp);
+    
+    exec_cleanup(program);
+    program->used = 0;
+    page_free(stack);
+    page_free(image);
+    return EXEC_OK;
+}
+
+const char* exec_strerror(int error) {
+    switch (error) {
+        case EXEC_OK:           return "OK";
+        case EXEC_NOT_FOUND:    return "file not found";
+        case EXEC_BAD_FORMAT:   return "not a loadable program";
+        case EXEC_NO_MEMORY:    return "out of memory";
+        case EXEC_BUSY:         return "too many programs running";
+        default:                return "error";
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * exec.h - Native programs run by the exec command
+ *
+ * Programs are statically linked, position-independent ELF files (see
+ * progs/). Their entry point is called on a private stack as
+ *
+ *   int _start(const exec_sys_t* sys, int argc, char** argv);
+ *
+ * and everything they need from the kernel goes through the sys table.
+ * Returning from _start or calling sys->exit ends the program; memory
+ * and files it still holds are released. This header is shared with
+ * the programs, so it depends on nothing else.
+ */
+
+#ifndef EXEC_H
+#define EXEC_H
+
+#define EXEC_ABI_VERSION    1
+
+// vfs_open() flags, as in vfs.h
+#define EXEC_O_READ         0x01
+#define EXEC_O_WRITE        0x02
+#define EXEC_O_CREATE       0x04
+#define EXEC_O_TRUNC        0x08
+#define EXEC_O_APPEND       0x10
+
+typedef struct {
+    unsigned int version;           // EXEC_ABI_VERSION
+    unsigned int size;              // sizeof(exec_sys_t); entries are only added
+    
+    // Console
+    void (*putc)(char c);
+    void (*puts)(const char* s);
+    int (*getc)(void);              // Waits for a key
+    
+    // Files (paths as in the shell: SD card, built-in, /tmp); negative
+    // results are VFS errors
+    int (*open)(const char* path, int flags);
+    int (*read)(int fd, void* buffer, unsigned int len);
+    int (*write)(int fd, const void* buffer, unsigned int len);
+    int (*close)(int fd);
+    
+    // Time
+    unsigned int (*ticks)(void);    // Microseconds, wraps every ~71 minutes
+    void (*sleep)(unsigned int ms);
+    
+    // Memory, in whole 4KB pages from the page pool
+    void* (*alloc)(unsigned int size);
+    void (*free)(void* ptr);
+    
+    void (*exit)(int code);
+} exec_sys_t;
+
+#ifndef EXEC_PROGRAM
+
+// Kernel side
+#define EXEC_STACK_SIZE     0x10000         // 64KB per program
+#define EXEC_MAX_IMAGE      0x800000        // Largest loaded image
+#define EXEC_MAX_PROGRAMS   4               // Running at once (exec ... &)
+#define EXEC_MAX_ALLOCS     32              // Live sys->alloc blocks per program
+
+#define EXEC_OK              0
+#define EXEC_NOT_FOUND      -1
+#define EXEC_BAD_FORMAT     -2
+#define EXEC_NO_MEMORY      -3
+#define EXEC_BUSY           -4
+
+// Runs path with argv[0..argc-1]; returns EXEC_OK with the exit code in
+// *code, or an error
+int exec_run(const char* path, int argc, char** argv, int* code);
+const char* exec_strerror(int error);
+
+#endif
+
+#endif
@@ -6,6 +6,19 @@
 #include "sd.h"
 #include "uart.h"
 #include "memory.h"
+#include "blk.h"
+#include "thread.h"
+#include "mmu.h"
+#include "smp.h"
+#include "irq.h"
+
+// Whole-cluster reads kept in flight while the FAT chain is walked
+#define FAT32_PREFETCH 4
+
+// Mapped file views, and the 1MB units of the MMU view window they use
+#define FAT32_VIEWS     8
+#define VIEW_UNIT_SHIFT 20
+#define VIEW_UNITS      (MMU_VIEW_SIZE >> VIEW_UNIT_SHIFT)
 
 // FAT32 structures
 typedef struct {
@@ -56,7 +69,43 @@ typedef struct {
 static fat32_boot_sector_t boot_sector;
 static unsigned int fat_start;
 static unsigned int data_start;
-static unsigned char sector_buffer[512];
+static unsigned char sector_buffer[512] __attribute__((aligned(4)));
+
+// Serializes users of sector_buffer across threads
+static mutex_t fat32_mutex;
+
+// Set once a FAT32 volume has been found on the card
+static int fat32_ready = 0;
+
+// A file mapped by fat32_mmap(). Every caller mapping the same file gets
+// the same view, so pages read in for one are shared by all. clusters
+// and frames live in pages of their own (meta), not on the heap.
+typedef struct {
+    unsigned long base;             // 0 if the slot is free
+    unsigned int first_cluster;
+    unsigned int size;
+    unsigned int pages;
+    unsigned int maps;              // fat32_mmap() references
+    unsigned int busy;              // Faults reading into this view
+    unsigned int* clusters;         // Cluster number of each cluster
+    void** frames;                  // Physical page behind each page, or 0
+    void* meta;
+    unsigned int meta_pages;
+} fat32_view_t;
+
+// Views, the window bitmap, and the eviction clock hand. Faults read
+// from the card without the lock and recheck before mapping.
+static fat32_view_t views[FAT32_VIEWS];
+static unsigned int view_units[VIEW_UNITS / 32];
+static unsigned int view_hand = 0;
+static unsigned int view_hand_page = 0;
+static unsigned int view_resident = 0;
+static unsigned int view_faults = 0;
+static unsigned int view_evictions = 0;
+static spinlock_t view_lock = 0;
+
+static int fat32_view_fault(unsigned long addr);
+static unsigned int fat32_view_reclaim(unsigned int count);
 
 int fat32_init(void) {
     uart_puts("Initializing FAT32 file system...\n");
@@ -81,6 +130,11 @@ int fat32_init(void) {
     // Calculate important values
     fat_start = boot_sector.reserved_sectors;
     data_start = fat_start + (boot_sector.fat_count * boot_sector.fat_size_32);
+    fat32_ready = 1;
+    
+    // Mapped files fault their pages in, and give them back under pressure
+    mmu_set_view_fault(fat32_view_fault);
+    page_set_reclaim(fat32_view_reclaim);
     
     uart_puts("FAT32: Initialized successfully\n");
     uart_puts("  Sector size: ");
@@ -112,11 +166,9 @@ static unsigned int get_next_cluster(unsigned int cluster) {
     return *(unsigned int*)(sector_buffer + entry_offset) & 0x0FFFFFFF;
 }
 
-int fat32_read_file(const char* filename, unsigned char* buffer, unsigned int max_size) {
-    uart_puts("Reading file: ");
-    uart_puts(filename);
-    uart_puts("\n");
-    
+// Looks up an 8.3 name in the root directory
+static int fat32_find_file(const char* filename, unsigned int* cluster, unsigned int* size,
+                           unsigned int* mtime) {
     // Read root directory
     unsigned int root_sector = cluster_to_sector(boot_sector.root_cluster);
     
@@ -146,9 +198,6 @@ int fat32_read_file(const char* filename, unsigned char* buffer, unsigned int ma
     
     // Search for file
     fat32_dir_entry_t* entries = (fat32_dir_entry_t*)sector_buffer;
-    int found = 0;
-    unsigned int file_cluster = 0;
-    unsigned int file_size = 0;
     
     for (int e = 0; e < 16; e++) {
         if (entries[e].name[0] == 0) break;
@@ -163,16 +212,32 @@ int fat32_read_file(const char* filename, unsigned char* buffer, unsigned int ma
         }
         
         if (match) {
-            found = 1;
-            file_cluster = ((unsigned int)entries[e].cluster_high << 16) | entries[e].cluster_low;
-            file_size = entries[e].file_size;
-            break;
+            *cluster = ((unsigned int)entries[e].cluster_high << 16) | entries[e].cluster_low;
+            *size = entries[e].file_size;
+            *mtime = ((unsigned int)entries[e].modified_date << 16) | entries[e].modified_time;
+            return FAT32_OK;
         }
     }
     
-    if (!found) {
+    return FAT32_NOT_FOUND;
+}
+
+static int fat32_read_file_locked(const char* filename, unsigned char* buffer, unsigned int max_size,
+                                  fat32_progress_t progress, void* ctx) {
+    uart_puts("Reading file: ");
+    uart_puts(filename);
+    uart_puts("\n");
+    
+    unsigned int file_cluster = 0;
+    unsigned int file_size = 0;
+    unsigned int file_mtime;
+    int found = fat32_find_file(filename, &file_cluster, &file_size, &file_mtime);
+    
+    if (found == FAT32_NOT_FOUND) {
         uart_puts("FAT32: File not found\n");
-        return FAT32_NOT_FOUND;
+    }
+    if (found != FAT32_OK) {
+        return found;
     }
     
     uart_puts("Found file, size: ");
@@ -184,31 +249,86 @@ int fat32_read_file(const char* filename, unsigned char* buffer, unsigned int ma
         return FAT32_ERROR;
     }
     
-    // Read file data
+    // Read file data. Whole clusters go straight into the caller's buffer
+    // and are queued ahead, so the card keeps streaming while the next
+    // FAT entry is looked up; a partial last cluster is copied by sector.
     unsigned int bytes_read = 0;
     unsigned int cluster = file_cluster;
+    unsigned int cluster_size = boot_sector.sectors_per_cluster * 512;
+    blk_request_t reqs[FAT32_PREFETCH];
+    unsigned int submitted = 0;
+    unsigned int completed = 0;
+    int status = FAT32_OK;
     
     while (cluster < 0x0FFFFFF8 && bytes_read < file_size) {
         unsigned int sector = cluster_to_sector(cluster);
         
-        for (int s = 0; s < boot_sector.sectors_per_cluster; s++) {
-            if (bytes_read >= file_size) break;
+        if (file_size - bytes_read >= cluster_size &&
+            boot_sector.sectors_per_cluster <= BLK_MAX_BLOCKS) {
+            blk_request_t* req = &reqs[submitted % FAT32_PREFETCH];
             
-            if (sd_read_block(sector + s, sector_buffer) != SD_OK) {
-                uart_puts("FAT32: Failed to read file data\n");
-                return FAT32_ERROR;
+            if (submitted - completed == FAT32_PREFETCH) {
+                completed++;
+                if (blk_wait(req) != SD_OK) {
+                    status = FAT32_ERROR;
+                    break;
+                }
+                if (progress) {
+                    progress(buffer, req->buffer - buffer + req->count * 512, ctx);
+                }
             }
             
-            unsigned int to_copy = file_size - bytes_read;
-            if (to_copy > 512) to_copy = 512;
-            
-            memcpy(buffer + bytes_read, sector_buffer, to_copy);
-            bytes_read += to_copy;
+            req->lba = sector;
+            req->count = boot_sector.sectors_per_cluster;
+            req->buffer = buffer + bytes_read;
+            req->write = 0;
+            req->callback = 0;
+            req->ctx = 0;
+            if (blk_submit(req) != SD_OK) {
+                status = FAT32_ERROR;
+                break;
+            }
+            submitted++;
+            bytes_read += cluster_size;
+        } else {
+            for (int s = 0; s < boot_sector.sectors_per_cluster; s++) {
+                if (bytes_read >= file_size) break;
+                
+                if (sd_read_block(sector + s, sector_buffer) != SD_OK) {
+                    status = FAT32_ERROR;
+                    break;
+                }
+                
+                unsigned int to_copy = file_size - bytes_read;
+                if (to_copy > 512) to_copy = 512;
+                
+                memcpy(buffer + bytes_read, sector_buffer, to_copy);
+                bytes_read += to_copy;
+            }
+            if (status != FAT32_OK) break;
         }
         
         cluster = get_next_cluster(cluster);
     }
     
+    // Drain the reads still in flight
+    while (completed < submitted) {
+        blk_request_t* req = &reqs[completed % FAT32_PREFETCH];
+        if (blk_wait(req) != SD_OK) {
+            status = FAT32_ERROR;
+        } else if (progress && status == FAT32_OK) {
+            progress(buffer, req->buffer - buffer + req->count * 512, ctx);
+        }
+        completed++;
+    }
+    
+    if (status != FAT32_OK) {
+        uart_puts("FAT32: Failed to read file data\n");
+        return FAT32_ERROR;
+    }
+    
+    if (progress) progress(buffer, bytes_read, ctx);
+    
     uart_puts("Read ");
     uart_dec(bytes_read);
     uart_puts(" bytes\n");
@@ -216,7 +336,115 @@ int fat32_read_file(const char* filename, unsigned char* buffer, unsigned int ma
     return bytes_read;
 }
 
-void fat32_list_files(void) {
+int fat32_read_file(const char* filename, unsigned char* buffer, unsigned int max_size) {
+    return fat32_read_file_progress(filename, buffer, max_size, 0, 0);
+}
+
+// Like fat32_read_file, but calls progress each time a longer prefix of
+// the file has landed in buffer, while later clusters are still in flight
+int fat32_read_file_progress(const char* filename, unsigned char* buffer, unsigned int max_size,
+                             fat32_progress_t progress, void* ctx) {
+    if (!fat32_ready) return FAT32_ERROR;
+    
+    mutex_lock(&fat32_mutex);
+    int result = fat32_read_file_locked(filename, buffer, max_size, progress, ctx);
+    mutex_unlock(&fat32_mutex);
+    return result;
+}
+
+// Stream a file through ring, ring_size bytes (a multiple of the
+// cluster size): file offset n lands at ring + n % ring_size. ready() is
+// told how many bytes have landed so far and returns how many the
+// caller is done with; with wait set the reader cannot go on until more
+// is released, so it should block until that happens. Whole clusters
+// are queued ahead like fat32_read_file, so the card keeps streaming.
+int fat32_read_file_ring(const char* filename, unsigned char* ring, unsigned int ring_size,
+                         fat32_ring_t ready, void* ctx) {
+    if (!fat32_ready) return FAT32_ERROR;
+    
+    unsigned int cluster_size = boot_sector.sectors_per_cluster * 512;
+    if (ring_size < cluster_size || ring_size % cluster_size) return FAT32_ERROR;
+    
+    mutex_lock(&fat32_mutex);
+    
+    unsigned int cluster, file_size, mtime;
+    int status = fat32_find_file(filename, &cluster, &file_size, &mtime);
+    
+    unsigned int bytes_read = 0;
+    unsigned int done = 0;
+    unsigned int released = 0;
+    blk_request_t reqs[FAT32_PREFETCH];
+    unsigned int submitted = 0;
+    unsigned int completed = 0;
+    
+    while (status == FAT32_OK && cluster < 0x0FFFFFF8 && bytes_read < file_size) {
+        unsigned int sector = cluster_to_sector(cluster);
+        unsigned int len = file_size - bytes_read < cluster_size ? file_size - bytes_read : cluster_size;
+        unsigned char* dest = ring + bytes_read % ring_size;
+        int whole = len == cluster_size && boot_sector.sectors_per_cluster <= BLK_MAX_BLOCKS;
+    
+        // Make room: finish the oldest read, or let the caller catch up.
+        // A partial cluster is copied by sector once the rest is in.
+        while (status == FAT32_OK &&
+               (bytes_read + cluster_size - released > ring_size ||
+                submitted - completed == FAT32_PREFETCH || (!whole && completed < submitted))) {
+            if (completed < submitted) {
+                blk_request_t* req = &reqs[completed % FAT32_PREFETCH];
+                completed++;
+                if (blk_wait(req) != SD_OK) status = FAT32_ERROR;
+                done += req->count * 512;
+                released = ready(done, 0, ctx);
+            } else {
+                released = ready(done, 1, ctx);
+            }
+        }
+        if (status != FAT32_OK) break;
+    
+        if (whole) {
+            blk_request_t* req = &reqs[submitted % FAT32_PREFETCH];
+            req->lba = sector;
+            req->count = boot_sector.sectors_per_cluster;
+            req->buffer = dest;
+            req->write = 0;
+            req->callback = 0;
+            req->ctx = 0;
+            if (blk_submit(req) != SD_OK) {
+                status = FAT32_ERROR;
+                break;
+            }
+            submitted++;
+        } else {
+            for (unsigned int s = 0; s * 512 < len; s++) {
+                if (sd_read_block(sector + s, sector_buffer) != SD_OK) {
+                    status = FAT32_ERROR;
+                    break;
+                }
+                unsigned int to_copy = len - s * 512 < 512 ? len - s * 512 : 512;
+                memcpy(dest + s * 512, sector_buffer, to_copy);
+            }
+            done += len;
+        }
+        bytes_read += len;
+    
+        cluster = get_next_cluster(cluster);
+    }
+    
+    while (completed < submitted) {
+        blk_request_t* req = &reqs[completed % FAT32_PREFETCH];
+        completed++;
+        if (blk_wait(req) != SD_OK) status = FAT32_ERROR;
+        done += req->count * 512;
+    }
+    
+    mutex_unlock(&fat32_mutex);
+    
+    if (status != FAT32_OK) return status;
+    if (bytes_read < file_size) return FAT32_ERROR;
+    ready(done, 0, ctx);
+    return file_size;
+}
+
+static void fat32_list_files_locked(void) {
     uart_puts("\nFiles in root directory:\n");
     uart_puts("========================\n");
     
@@ -258,3 +486,358 @@ void fat32_list_files(void) {
     
     uart_puts("========================\n");
 }
+
+int fat32_file_size(const char* filename) {
+    unsigned int size, mtime;
+    int result = fat32_stat(filename, &size, &mtime);
+    return result == FAT32_OK ? (int)size : result;
+}
+
+// mtime is the FAT modified date and time, date in the high half
+int fat32_stat(const char* filename, unsigned int* size, unsigned int* mtime) {
+    if (!fat32_ready) return FAT32_ERROR;
+    
+    unsigned int cluster;
+    mutex_lock(&fat32_mutex);
+    int result = fat32_find_file(filename, &cluster, size, mtime);
+    mutex_unlock(&fat32_mutex);
+    
+    return result;
+}
+
+int fat32_mounted(void) {
+    return fat32_ready;
+}
+
+void fat32_list_files(void) {
+    if (!fat32_ready) return;
+    
+    mutex_lock(&fat32_mutex);
+    fat32_list_files_locked();
+    mutex_unlock(&fat32_mutex);
+}
+
+// Fill clusters[] with the file's chain, caching the current FAT sector
+static int fat32_map_clusters(unsigned int cluster, unsigned int* clusters, unsigned int count) {
+    unsigned char fat[512] __attribute__((aligned(4)));
+    unsigned int cached = 0;
+    
+    for (unsigned int i = 0; i < count; i++) {
+        if (cluster < 2 || cluster >= 0x0FFFFFF8) return FAT32_ERROR;
+        clusters[i] = cluster;
+    
+        unsigned int fat_sector = fat_start + cluster / 128;
+        if (fat_sector != cached) {
+            if (sd_read_block(fat_sector, fat) != SD_OK) return FAT32_ERROR;
+            cached = fat_sector;
+        }
+        cluster = *(unsigned int*)(fat + (cluster % 128) * 4) & 0x0FFFFFFF;
+    }
+    return FAT32_OK;
+}
+
+// Unmap and free everything a view holds. Called with view_lock held
+// once nobody maps it and no fault is reading into it.
+static void fat32_view_free(fat32_view_t* view) {
+    for (unsigned int p = 0; p < view->pages; p++) {
+        if (view->frames[p]) {
+            mmu_view_unmap(view->base + p * PAGE_SIZE);
+            page_free(view->frames[p]);
+            view_resident--;
+        }
+    }
+    
+    unsigned int unit = (view->base - MMU_VIEW_BASE) >> VIEW_UNIT_SHIFT;
+    unsigned int units = (view->pages * PAGE_SIZE + (1 << VIEW_UNIT_SHIFT) - 1) >> VIEW_UNIT_SHIFT;
+    for (unsigned int u = unit; u < unit + units; u++) {
+        view_units[u / 32] &= ~(1u << (u % 32));
+    }
+    
+    for (unsigned int i = 0; i < view->meta_pages; i++) {
+        page_free((unsigned char*)view->meta + i * PAGE_SIZE);
+    }
+    view->base = 0;
+}
+
+// First fit over the window bitmap. Called with view_lock held.
+static unsigned long fat32_view_place(unsigned int units) {
+    unsigned int run = 0;
+    for (unsigned int u = 0; u < VIEW_UNITS; u++) {
+        if (view_units[u / 32] & (1u << (u % 32))) {
+            run = 0;
+            continue;
+        }
+        if (++run < units) continue;
+    
+        unsigned int first = u + 1 - units;
+        for (unsigned int i = first; i <= u; i++) {
+            view_units[i / 32] |= 1u << (i % 32);
+        }
+        return MMU_VIEW_BASE + ((unsigned long)first << VIEW_UNIT_SHIFT);
+    }
+    return 0;
+}
+
+// Map a file read-only. Nothing is read until a page is first touched;
+// the pages stay cached for later readers until memory runs short.
+// Touch views only from threads with interrupts on: a miss sleeps on
+// the card. Returns 0 on failure.
+void* fat32_mmap(const char* filename, unsigned int* size) {
+    if (!fat32_ready) return 0;
+    
+    mutex_lock(&fat32_mutex);
+    
+    unsigned int first, file_size, mtime;
+    if (fat32_find_file(filename, &first, &file_size, &mtime) != FAT32_OK ||
+        file_size == 0 || file_size > MMU_VIEW_SIZE) {
+        mutex_unlock(&fat32_mutex);
+        return 0;
+    }
+    
+    // Already mapped: share it
+    unsigned int flags = irq_save();
+    spin_lock(&view_lock);
+    for (int v = 0; v < FAT32_VIEWS; v++) {
+        if (views[v].base && views[v].first_cluster == first) {
+            views[v].maps++;
+            void* addr = (void*)views[v].base;
+            *size = views[v].size;
+            spin_unlock(&view_lock);
+            irq_restore(flags);
+            mutex_unlock(&fat32_mutex);
+            return addr;
+        }
+    }
+    spin_unlock(&view_lock);
+    irq_restore(flags);
+    
+    unsigned int cluster_size = boot_sector.sectors_per_cluster * 512;
+    unsigned int count = (file_size + cluster_size - 1) / cluster_size;
+    unsigned int pages = (file_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    unsigned int meta_size = count * sizeof(unsigned int) + pages * sizeof(void*);
+    unsigned int meta_pages = (meta_size + PAGE_SIZE - 1) / PAGE_SIZE;
+    
+    void* meta = page_alloc_run(meta_pages);
+    if (!meta) {
+        mutex_unlock(&fat32_mutex);
+        return 0;
+    }
+    memset(meta, 0, meta_pages * PAGE_SIZE);
+    
+    fat32_view_t view;
+    view.first_cluster = first;
+    view.size = file_size;
+    view.pages = pages;
+    view.maps = 1;
+    view.busy = 0;
+    view.frames = (void**)meta;
+    view.clusters = (unsigned int*)((unsigned char*)meta + pages * sizeof(void*));
+    view.meta = meta;
+    view.meta_pages = meta_pages;
+    
+    if (fat32_map_clusters(first, view.clusters, count) != FAT32_OK) {
+        for (unsigned int i = 0; i < meta_pages; i++) {
+            page_free((unsigned char*)meta + i * PAGE_SIZE);
+        }
+        mutex_unlock(&fat32_mutex);
+        return 0;
+    }
+    
+    // Claim a slot and window space, then make sure page tables exist so
+    // the fault path never allocates them
+    fat32_view_t* slot = 0;
+    flags = irq_save();
+    spin_lock(&view_lock);
+    for (int v = 0; v < FAT32_VIEWS && !slot; v++) {
+        if (!views[v].base) slot = &views[v];
+    }
+    if (slot) {
+        view.base = fat32_view_place((pages * PAGE_SIZE + (1 << VIEW_UNIT_SHIFT) - 1) >> VIEW_UNIT_SHIFT);
+        if (view.base) {
+            *slot = view;
+        } else {
+            slot = 0;
+        }
+    }
+    spin_unlock(&view_lock);
+    irq_restore(flags);
+    
+    if (slot && mmu_view_reserve(view.base, pages * PAGE_SIZE) != 0) {
+        flags = irq_save();
+        spin_lock(&view_lock);
+        fat32_view_free(slot);
+        spin_unlock(&view_lock);
+        irq_restore(flags);
+        slot = 0;
+    } else if (!slot) {
+        for (unsigned int i = 0; i < meta_pages; i++) {
+            page_free((unsigned char*)meta + i * PAGE_SIZE);
+        }
+    }
+    
+    mutex_unlock(&fat32_mutex);
+    
+    if (!slot) return 0;
+    *size = file_size;
+    return (void*)view.base;
+}
+
+void fat32_munmap(const void* addr) {
+    unsigned int flags = irq_save();
+    spin_lock(&view_lock);
+    for (int v = 0; v < FAT32_VIEWS; v++) {
+        fat32_view_t* view = &views[v];
+        if (view->base && view->base == (unsigned long)addr) {
+            if (--view->maps == 0 && view->busy == 0) {
+                fat32_view_free(view);
+            }
+            break;
+        }
+    }
+    spin_unlock(&view_lock);
+    irq_restore(flags);
+}
+
+// Read one page of a view from the card into frame, zero past the end
+static int fat32_view_read(fat32_view_t* view, unsigned int page, unsigned char* frame) {
+    unsigned int spc = boot_sector.sectors_per_cluster;
+    unsigned int cluster_size = spc * 512;
+    unsigned int offset = page * PAGE_SIZE;
+    unsigned int count = (view->size + cluster_size - 1) / cluster_size;
+    unsigned int valid = view->size - offset;
+    if (valid > PAGE_SIZE) valid = PAGE_SIZE;
+    
+    if (cluster_size >= PAGE_SIZE) {
+        // Part of one cluster
+        unsigned int cluster = view->clusters[offset / cluster_size];
+        unsigned int sector = cluster_to_sector(cluster) + (offset % cluster_size) / 512;
+        if (blk_read(sector, (valid + 511) / 512, frame) != SD_OK) return FAT32_ERROR;
+    } else {
+        // Several whole clusters, contiguous in the file but not on disk
+        for (unsigned int c = offset / cluster_size, done = 0; c < count && done < valid;
+             c++, done += cluster_size) {
+            if (blk_read(cluster_to_sector(view->clusters[c]), spc, frame + done) != SD_OK) {
+                return FAT32_ERROR;
+            }
+        }
+    }
+    
+    if (valid < PAGE_SIZE) memset(frame + valid, 0, PAGE_SIZE - valid);
+    return FAT32_OK;
+}
+
+// Data abort handler for the view window (mmu_set_view_fault). Runs in
+// the faulting thread with interrupts on; two threads missing on the
+// same page both read it and the loser frees its copy.
+static int fat32_view_fault(unsigned long addr) {
+    fat32_view_t* view = 0;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&view_lock);
+    for (int v = 0; v < FAT32_VIEWS; v++) {
+        if (views[v].base && addr - views[v].base < views[v].pages * PAGE_SIZE) {
+            view = &views[v];
+            view->busy++;
+            break;
+        }
+    }
+    spin_unlock(&view_lock);
+    irq_restore(flags);
+    
+    if (!view) return -1;
+    
+    unsigned int page = (addr - view->base) / PAGE_SIZE;
+    int result = -1;
+    unsigned char* frame = (unsigned char*)page_alloc();
+    if (frame && fat32_view_read(view, page, frame) != FAT32_OK) {
+        page_free(frame);
+        frame = 0;
+    }
+    
+    flags = irq_save();
+    spin_lock(&view_lock);
+    if (frame) {
+        if (!view->frames[page]) {
+            view->frames[page] = frame;
+            mmu_view_map(view->base + page * PAGE_SIZE, frame);
+            view_resident++;
+            view_faults++;
+            frame = 0;
+        }
+        result = 0;
+    }
+    if (--view->busy == 0 && view->maps == 0) {
+        fat32_view_free(view);
+    }
+    spin_unlock(&view_lock);
+    irq_restore(flags);
+    
+    if (frame) page_free(frame);
+    return result;
+}
+
+// Page pool reclaim hook: evict resident view pages, round robin over
+// all views, until count pages have been freed or none are left.
+// Every page can be read back from the card, so any of them will do.
+static unsigned int fat32_view_reclaim(unsigned int count) {
+    unsigned int freed = 0;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&view_lock);
+    while (freed < count && view_resident > 0) {
+        fat32_view_t* view = &views[view_hand];
+        if (!view->base || view_hand_page >= view->pages) {
+            view_hand = (view_hand + 1) % FAT32_VIEWS;
+            view_hand_page = 0;
+            continue;
+        }
+    
+        unsigned int page = view_hand_page++;
+        if (view->frames[page]) {
+            mmu_view_unmap(view->base + page * PAGE_SIZE);
+            page_free(view->frames[page]);
+            view->frames[page] = 0;
+            view_resident--;
+            view_evictions++;
+            freed++;
+        }
+    }
+    spin_unlock(&view_lock);
+    irq_restore(flags);
+    
+    return freed;
+}
+
+void fat32_view_stats(unsigned int* mapped, unsigned int* resident, unsigned int* faults,
+                      unsigned int* evictions) {
+    unsigned int flags = irq_save();
+    spin_lock(&view_lock);
+    *mapped = 0;
+    for (int v = 0; v < FAT32_VIEWS; v++) {
+        if (views[v].base) (*mapped)++;
+    }
+    *resident = view_resident;
+    *faults = view_faults;
+    *evictions = view_evictions;
+    spin_unlock(&view_lock);
+    irq_restore(flags);
+}
+
+// Resident pages of the view starting at addr
+unsigned int fat32_view_resident(const void* addr) {
+    unsigned int count = 0;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&view_lock);
+    for (int v = 0; v < FAT32_VIEWS; v++) {
+        if (views[v].base && views[v].base == (unsigned long)addr) {
+            for (unsigned int p = 0; p < views[v].pages; p++) {
+                if (views[v].frames[p]) count++;
+            }
+        }
+    }
+    spin_unlock(&view_lock);
+    irq_restore(flags);
+    
+    return count;
+}
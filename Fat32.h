@@ -9,8 +9,28 @@
 #define FAT32_ERROR    -1
 #define FAT32_NOT_FOUND -2
 
+// Called with the number of bytes at the start of buffer that are valid
+typedef void (*fat32_progress_t)(const unsigned char* buffer, unsigned int ready, void* ctx);
+
+// Streaming reads: returns how many bytes the caller has finished with
+typedef unsigned int (*fat32_ring_t)(unsigned int ready, int wait, void* ctx);
+
 int fat32_init(void);
 int fat32_read_file(const char* filename, unsigned char* buffer, unsigned int max_size);
+int fat32_read_file_progress(const char* filename, unsigned char* buffer, unsigned int max_size,
+                             fat32_progress_t progress, void* ctx);
+int fat32_read_file_ring(const char* filename, unsigned char* ring, unsigned int ring_size,
+                         fat32_ring_t ready, void* ctx);
+int fat32_file_size(const char* filename);
+int fat32_stat(const char* filename, unsigned int* size, unsigned int* mtime);
+int fat32_mounted(void);
 void fat32_list_files(void);
 
+// Demand-paged, read-only file views (see fat32.c)
+void* fat32_mmap(const char* filename, unsigned int* size);
+void fat32_munmap(const void* addr);
+unsigned int fat32_view_resident(const void* addr);
+void fat32_view_stats(unsigned int* mapped, unsigned int* resident, unsigned int* faults,
+                      unsigned int* evictions);
+
 #endif
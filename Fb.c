@@ -0,0 +1,356 @@
+/*
+ * fb.c - Framebuffer text console
+ *
+ * The framebuffer is allocated through the mailbox with a virtual height
+ * of twice the screen, so scrolling is a pan of the virtual offset; only
+ * when the bottom of the virtual buffer is reached is the visible text
+ * copied back to the top. Glyphs come from a built-in 8x8 font, drawn
+ * with doubled rows, four 64-bit stores per pixel row.
+ */
+
+#include "fb.h"
+#include "mailbox.h"
+#include "memory.h"
+#include "mmu.h"
+#include "irq.h"
+#include "smp.h"
+
+#define FB_WIDTH        1024
+#define FB_HEIGHT       768
+#define FB_DEPTH        32
+#define GLYPH_W         8
+#define GLYPH_H         16
+#define FB_FG           0x00C0C0C0
+#define FB_BG           0x00000000      // Cleared with memset
+
+// 8x8 font for ASCII 0x20-0x7E, one byte per row, bit 0 is the leftmost pixel
+static const unsigned char font8x8[95][8] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},   // 0x20 ' '
+    {0x18, 0x3C, 0x3C, 0x18, 0x18, 0x00, 0x18, 0x00},   // 0x21 '!'
+    {0x36, 0x36, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},   // 0x22 '"'
+    {0x36, 0x36, 0x7F, 0x36, 0x7F, 0x36, 0x36, 0x00},   // 0x23 '#'
+    {0x0C, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x0C, 0x00},   // 0x24 '$'
+    {0x00, 0x63, 0x33, 0x18, 0x0C, 0x66, 0x63, 0x00},   // 0x25 '%'
+    {0x1C, 0x36, 0x1C, 0x6E, 0x3B, 0x33, 0x6E, 0x00},   // 0x26 '&'
+    {0x06, 0x06, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00},   // 0x27 '''
+    {0x18, 0x0C, 0x06, 0x06, 0x06, 0x0C, 0x18, 0x00},   // 0x28 '('
+    {0x06, 0x0C, 0x18, 0x18, 0x18, 0x0C, 0x06, 0x00},   // 0x29 ')'
+    {0x00, 0x66, 0x3C, 0xFF, 0x3C, 0x66, 0x00, 0x00},   // 0x2A '*'
+    {0x00, 0x0C, 0x0C, 0x3F, 0x0C, 0x0C, 0x00, 0x00},   // 0x2B '+'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x06},   // 0x2C ','
+    {0x00, 0x00, 0x00, 0x3F, 0x00, 0x00, 0x00, 0x00},   // 0x2D '-'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x0C, 0x0C, 0x00},   // 0x2E '.'
+    {0x60, 0x30, 0x18, 0x0C, 0x06, 0x03, 0x01, 0x00},   // 0x2F '/'
+    {0x3E, 0x63, 0x73, 0x7B, 0x6F, 0x67, 0x3E, 0x00},   // 0x30 '0'
+    {0x0C, 0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x3F, 0x00},   // 0x31 '1'
+    {0x1E, 0x33, 0x30, 0x1C, 0x06, 0x33, 0x3F, 0x00},   // 0x32 '2'
+    {0x1E, 0x33, 0x30, 0x1C, 0x30, 0x33, 0x1E, 0x00},   // 0x33 '3'
+    {0x38, 0x3C, 0x36, 0x33, 0x7F, 0x30, 0x78, 0x00},   // 0x34 '4'
+    {0x3F, 0x03, 0x1F, 0x30, 0x30, 0x33, 0x1E, 0x00},   // 0x35 '5'
+    {0x1C, 0x06, 0x03, 0x1F, 0x33, 0x33, 0x1E, 0x00},   // 0x36 '6'
+    {0x3F, 0x33, 0x30, 0x18, 0x0C, 0x0C, 0x0C, 0x00},   // 0x37 '7'
+    {0x1E, 0x33, 0x33, 0x1E, 0x33, 0x33, 0x1E, 0x00},   // 0x38 '8'
+    {0x1E, 0x33, 0x33, 0x3E, 0x30, 0x18, 0x0E, 0x00},   // 0x39 '9'
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x00},   // 0x3A ':'
+    {0x00, 0x0C, 0x0C, 0x00, 0x00, 0x0C, 0x0C, 0x06},   // 0x3B ';'
+    {0x18, 0x0C, 0x06, 0x03, 0x06, 0x0C, 0x18, 0x00},   // 0x3C '<'
+    {0x00, 0x00, 0x3F, 0x00, 0x00, 0x3F, 0x00, 0x00},   // 0x3D '='
+    {0x06, 0x0C, 0x18, 0x30, 0x18, 0x0C, 0x06, 0x00},   // 0x3E '>'
+    {0x1E, 0x33, 0x30, 0x18, 0x0C, 0x00, 0x0C, 0x00},   // 0x3F '?'
+    {0x3E, 0x63, 0x7B, 0x7B, 0x7B, 0x03, 0x1E, 0x00},   // 0x40 '@'
+    {0x0C, 0x1E, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x00},   // 0x41 'A'
+    {0x3F, 0x66, 0x66, 0x3E, 0x66, 0x66, 0x3F, 0x00},   // 0x42 'B'
+    {0x3C, 0x66, 0x03, 0x03, 0x03, 0x66, 0x3C, 0x00},   // 0x43 'C'
+    {0x1F, 0x36, 0x66, 0x66, 0x66, 0x36, 0x1F, 0x00},   // 0x44 'D'
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x46, 0x7F, 0x00},   // 0x45 'E'
+    {0x7F, 0x46, 0x16, 0x1E, 0x16, 0x06, 0x0F, 0x00},   // 0x46 'F'
+    {0x3C, 0x66, 0x03, 0x03, 0x73, 0x66, 0x7C, 0x00},   // 0x47 'G'
+    {0x33, 0x33, 0x33, 0x3F, 0x33, 0x33, 0x33, 0x00},   // 0x48 'H'
+    {0x1E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},   // 0x49 'I'
+    {0x78, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E, 0x00},   // 0x4A 'J'
+    {0x67, 0x66, 0x36, 0x1E, 0x36, 0x66, 0x67, 0x00},   // 0x4B 'K'
+    {0x0F, 0x06, 0x06, 0x06, 0x46, 0x66, 0x7F, 0x00},   // 0x4C 'L'
+    {0x63, 0x77, 0x7F, 0x7F, 0x6B, 0x63, 0x63, 0x00},   // 0x4D 'M'
+    {0x63, 0x67, 0x6F, 0x7B, 0x73, 0x63, 0x63, 0x00},   // 0x4E 'N'
+    {0x1C, 0x36, 0x63, 0x63, 0x63, 0x36, 0x1C, 0x00},   // 0x4F 'O'
+    {0x3F, 0x66, 0x66, 0x3E, 0x06, 0x06, 0x0F, 0x00},   // 0x50 'P'
+    {0x1E, 0x33, 0x33, 0x33, 0x3B, 0x1E, 0x38, 0x00},   // 0x51 'Q'
+    {0x3F, 0x66, 0x66, 0x3E, 0x36, 0x66, 0x67, 0x00},   // 0x52 'R'
+    {0x1E, 0x33, 0x07, 0x0E, 0x38, 0x33, 0x1E, 0x00},   // 0x53 'S'
+    {0x3F, 0x2D, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},   // 0x54 'T'
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x33, 0x3F, 0x00},   // 0x55 'U'
+    {0x33, 0x33, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00},   // 0x56 'V'
+    {0x63, 0x63, 0x63, 0x6B, 0x7F, 0x77, 0x63, 0x00},   // 0x57 'W'
+    {0x63, 0x63, 0x36, 0x1C, 0x1C, 0x36, 0x63, 0x00},   // 0x58 'X'
+    {0x33, 0x33, 0x33, 0x1E, 0x0C, 0x0C, 0x1E, 0x00},   // 0x59 'Y'
+    {0x7F, 0x63, 0x31, 0x18, 0x4C, 0x66, 0x7F, 0x00},   // 0x5A 'Z'
+    {0x1E, 0x06, 0x06, 0x06, 0x06, 0x06, 0x1E, 0x00},   // 0x5B '['
+    {0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x40, 0x00},   // 0x5C '\\'
+    {0x1E, 0x18, 0x18, 0x18, 0x18, 0x18, 0x1E, 0x00},   // 0x5D ']'
+    {0x08, 0x1C, 0x36, 0x63, 0x00, 0x00, 0x00, 0x00},   // 0x5E '^'
+    {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xFF},   // 0x5F '_'
+    {0x0C, 0x0C, 0x18, 0x00, 0x00, 0x00, 0x00, 0x00},   // 0x60 '`'
+    {0x00, 0x00, 0x1E, 0x30, 0x3E, 0x33, 0x6E, 0x00},   // 0x61 'a'
+    {0x07, 0x06, 0x06, 0x3E, 0x66, 0x66, 0x3B, 0x00},   // 0x62 'b'
+    {0x00, 0x00, 0x1E, 0x33, 0x03, 0x33, 0x1E, 0x00},   // 0x63 'c'
+    {0x38, 0x30, 0x30, 0x3E, 0x33, 0x33, 0x6E, 0x00},   // 0x64 'd'
+    {0x00, 0x00, 0x1E, 0x33, 0x3F, 0x03, 0x1E, 0x00},   // 0x65 'e'
+    {0x1C, 0x36, 0x06, 0x0F, 0x06, 0x06, 0x0F, 0x00},   // 0x66 'f'
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x1F},   // 0x67 'g'
+    {0x07, 0x06, 0x36, 0x6E, 0x66, 0x66, 0x67, 0x00},   // 0x68 'h'
+    {0x0C, 0x00, 0x0E, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},   // 0x69 'i'
+    {0x30, 0x00, 0x30, 0x30, 0x30, 0x33, 0x33, 0x1E},   // 0x6A 'j'
+    {0x07, 0x06, 0x66, 0x36, 0x1E, 0x36, 0x67, 0x00},   // 0x6B 'k'
+    {0x0E, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x1E, 0x00},   // 0x6C 'l'
+    {0x00, 0x00, 0x33, 0x7F, 0x7F, 0x6B, 0x63, 0x00},   // 0x6D 'm'
+    {0x00, 0x00, 0x1F, 0x33, 0x33, 0x33, 0x33, 0x00},   // 0x6E 'n'
+    {0x00, 0x00, 0x1E, 0x33, 0x33, 0x33, 0x1E, 0x00},   // 0x6F 'o'
+    {0x00, 0x00, 0x3B, 0x66, 0x66, 0x3E, 0x06, 0x0F},   // 0x70 'p'
+    {0x00, 0x00, 0x6E, 0x33, 0x33, 0x3E, 0x30, 0x78},   // 0x71 'q'
+    {0x00, 0x00, 0x3B, 0x6E, 0x66, 0x06, 0x0F, 0x00},   // 0x72 'r'
+    {0x00, 0x00, 0x3E, 0x03, 0x1E, 0x30, 0x1F, 0x00},   // 0x73 's'
+    {0x08, 0x0C, 0x3E, 0x0C, 0x0C, 0x2C, 0x18, 0x00},   // 0x74 't'
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x33, 0x6E, 0x00},   // 0x75 'u'
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x1E, 0x0C, 0x00},   // 0x76 'v'
+    {0x00, 0x00, 0x63, 0x6B, 0x7F, 0x7F, 0x36, 0x00},   // 0x77 'w'
+    {0x00, 0x00, 0x63, 0x36, 0x1C, 0x36, 0x63, 0x00},   // 0x78 'x'
+    {0x00, 0x00, 0x33, 0x33, 0x33, 0x3E, 0x30, 0x1F},   // 0x79 'y'
+    {0x00, 0x00, 0x3F, 0x19, 0x0C, 0x26, 0x3F, 0x00},   // 0x7A 'z'
+    {0x38, 0x0C, 0x0C, 0x07, 0x0C, 0x0C, 0x38, 0x00},   // 0x7B '{'
+    {0x18, 0x18, 0x18, 0x00, 0x18, 0x18, 0x18, 0x00},   // 0x7C '|'
+    {0x07, 0x0C, 0x0C, 0x38, 0x0C, 0x0C, 0x07, 0x00},   // 0x7D '}'
+    {0x6E, 0x3B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},   // 0x7E '~'
+};
+
+static unsigned int msg[36] __attribute__((aligned(16)));
+
+static unsigned char* fb_base = 0;
+static unsigned int fb_pitch;
+static unsigned int virt_height;
+static unsigned int y_offset;           // First visible pixel row
+static int panning;
+static unsigned int cols;
+static unsigned int rows;
+static unsigned int cur_col;
+static unsigned int cur_row;
+static int esc_state;                   // 0 text, 1 after ESC, 2 in CSI
+static unsigned int esc_param;
+static spinlock_t fb_lock = 0;
+
+// Four pixels per font nibble, as two 64-bit stores
+static unsigned long long nibble_pixels[16][2];
+
+int fb_init(void) {
+    unsigned int i = 0;
+    
+    msg[i++] = 0;                       // Size, filled in below
+    msg[i++] = MBOX_REQUEST;
+    
+    msg[i++] = MBOX_TAG_SET_PHYS_WH;
+    msg[i++] = 8;
+    msg[i++] = 0;
+    msg[i++] = FB_WIDTH;
+    msg[i++] = FB_HEIGHT;
+    
+    msg[i++] = MBOX_TAG_SET_VIRT_WH;
+    msg[i++] = 8;
+    msg[i++] = 0;
+    msg[i++] = FB_WIDTH;
+    unsigned int virt_index = i;
+    msg[i++] = FB_HEIGHT * 2;
+    
+    msg[i++] = MBOX_TAG_SET_VIRT_OFFSET;
+    msg[i++] = 8;
+    msg[i++] = 0;
+    msg[i++] = 0;
+    msg[i++] = 0;
+    
+    msg[i++] = MBOX_TAG_SET_DEPTH;
+    msg[i++] = 4;
+    msg[i++] = 0;
+    unsigned int depth_index = i;
+    msg[i++] = FB_DEPTH;
+    
+    msg[i++] = MBOX_TAG_SET_PIXEL_ORDER;
+    msg[i++] = 4;
+    msg[i++] = 0;
+    msg[i++] = 1;                       // RGB
+    
+    msg[i++] = MBOX_TAG_ALLOCATE_FB;
+    msg[i++] = 8;
+    msg[i++] = 0;
+    unsigned int alloc_index = i;
+    msg[i++] = 16;                      // Alignment
+    msg[i++] = 0;
+    
+    msg[i++] = MBOX_TAG_GET_PITCH;
+    msg[i++] = 4;
+    msg[i++] = 0;
+    unsigned int pitch_index = i;
+    msg[i++] = 0;
+    
+    msg[i++] = MBOX_TAG_END;
+    msg[0] = i * 4;
+    
+    if (mbox_call(MBOX_CH_PROP, msg) != 0 || msg[depth_index] != FB_DEPTH ||
+        msg[alloc_index] == 0) {
+        return -1;
+    }
+    
+    unsigned int base = msg[alloc_index] & 0x3FFFFFFF;
+    unsigned int size = msg[alloc_index + 1];
+    fb_pitch = msg[pitch_index];
+    virt_height = msg[virt_index];
+    panning = virt_height >= FB_HEIGHT * 2;
+    
+    // Write-through: stores reach the screen, the wrap copy reads cached
+    mmu_set_region(base, size, MMU_WRITETHROUGH);
+    
+    for (unsigned int n = 0; n < 16; n++) {
+        unsigned int px[4];
+        for (int b = 0; b < 4; b++) {
+            px[b] = (n & (1 << b)) ? FB_FG : FB_BG;
+        }
+        nibble_pixels[n][0] = px[0] | ((unsigned long long)px[1] << 32);
+        nibble_pixels[n][1] = px[2] | ((unsigned long long)px[3] << 32);
+    }
+    
+    cols = FB_WIDTH / GLYPH_W;
+    rows = FB_HEIGHT / GLYPH_H;
+    fb_base = (unsigned char*)(unsigned long)base;
+    fb_clear();
+    
+    return 0;
+}
+
+int fb_available(void) {
+    return fb_base != 0;
+}
+
+static unsigned char* fb_text_line(unsigned int row) {
+    return fb_base + (y_offset + row * GLYPH_H) * fb_pitch;
+}
+
+static void fb_draw_glyph(unsigned int col, unsigned int row, char c) {
+    if (c < 0x20 || c > 0x7E) c = '?';
+    const unsigned char* glyph = font8x8[c - 0x20];
+    unsigned char* line = fb_text_line(row) + col * GLYPH_W * 4;
+    
+    for (int y = 0; y < 8; y++) {
+        const unsigned long long* lo = nibble_pixels[glyph[y] & 0xF];
+        const unsigned long long* hi = nibble_pixels[glyph[y] >> 4];
+        
+        for (int twice = 0; twice < 2; twice++) {
+            unsigned long long* px = (unsigned long long*)line;
+            px[0] = lo[0];
+            px[1] = lo[1];
+            px[2] = hi[0];
+            px[3] = hi[1];
+            line += fb_pitch;
+        }
+    }
+}
+
+static void fb_clear_row(unsigned int row) {
+    memset(fb_text_line(row), 0, GLYPH_H * fb_pitch);
+}
+
+static void fb_scroll(void) {
+    if (!panning) {
+        memmove(fb_base, fb_base + GLYPH_H * fb_pitch, (FB_HEIGHT - GLYPH_H) * fb_pitch);
+        fb_clear_row(rows - 1);
+        return;
+    }
+    
+    if (y_offset + FB_HEIGHT + GLYPH_H <= virt_height) {
+        y_offset += GLYPH_H;
+    } else {
+        // Bottom of the virtual buffer: move the text back to the top
+        memcpy(fb_base, fb_text_line(1), (FB_HEIGHT - GLYPH_H) * fb_pitch);
+        y_offset = 0;
+    }
+    fb_clear_row(rows - 1);
+    
+    unsigned int offset[2] = { 0, y_offset };
+    mbox_property(MBOX_TAG_SET_VIRT_OFFSET, offset, 2);
+}
+
+static void fb_clear_locked(void) {
+    if (panning && y_offset != 0) {
+        unsigned int offset[2] = { 0, 0 };
+        y_offset = 0;
+        mbox_property(MBOX_TAG_SET_VIRT_OFFSET, offset, 2);
+    }
+    memset(fb_base, 0, FB_HEIGHT * fb_pitch);
+    cur_col = 0;
+    cur_row = 0;
+}
+
+void fb_clear(void) {
+    if (!fb_base) return;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&fb_lock);
+    fb_clear_locked();
+    spin_unlock(&fb_lock);
+    irq_restore(flags);
+}
+
+static void fb_newline(void) {
+    cur_col = 0;
+    if (cur_row + 1 < rows) {
+        cur_row++;
+    } else {
+        fb_scroll();
+    }
+}
+
+// Minimal ANSI handling: ESC[2J clears, ESC[H homes, the rest is ignored
+static void fb_escape(char c) {
+    if (esc_state == 1) {
+        esc_state = (c == '[') ? 2 : 0;
+        esc_param = 0;
+        return;
+    }
+    if (c >= '0' && c <= '9') {
+        esc_param = esc_param * 10 + (c - '0');
+        return;
+    }
+    if (c == ';') return;
+    
+    if (c == 'J' && esc_param == 2) {
+        fb_clear_locked();
+    } else if (c == 'H') {
+        cur_col = 0;
+        cur_row = 0;
+    }
+    esc_state = 0;
+}
+
+void fb_putc(char c) {
+    if (!fb_base) return;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&fb_lock);
+    
+    if (esc_state) {
+        fb_escape(c);
+    } else if (c == '\033') {
+        esc_state = 1;
+    } else if (c == '\n') {
+        fb_newline();
+    } else if (c == '\r') {
+        cur_col = 0;
+    } else if (c == '\b') {
+        if (cur_col > 0) cur_col--;
+    } else if (c == '\t') {
+        cur_col = (cur_col + 8) & ~7;
+        if (cur_col >= cols) fb_newline();
+    } else {
+        fb_draw_glyph(cur_col, cur_row, c);
+        if (++cur_col >= cols) fb_newline();
+    }
+    
+    spin_unlock(&fb_lock);
+    irq_restore(flags);
+}
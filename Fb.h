@@ -0,0 +1,13 @@
+/*
+ * fb.h - Framebuffer text console header
+ */
+
+#ifndef FB_H
+#define FB_H
+
+int fb_init(void);
+int fb_available(void);
+void fb_putc(char c);
+void fb_clear(void);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * initramfs.c - Read-only file archive linked into the kernel image
+ *
+ * The archive sits in its own section placed by linker.ld, so files are
+ * available before (and without) the SD card. Lookups binary search the
+ * sorted index and hand back a pointer into the image; nothing is copied.
+ */
+
+#include "initramfs.h"
+#include "uart.h"
+
+extern unsigned char __initramfs_start[];
+extern unsigned char __initramfs_end[];
+
+static const initramfs_header_t* header = 0;
+static const initramfs_entry_t* entries = 0;
+
+int initramfs_init(void) {
+    unsigned int len = __initramfs_end - __initramfs_start;
+    const initramfs_header_t* h = (const initramfs_header_t*)__initramfs_start;
+    
+    if (len < sizeof(initramfs_header_t) || h->magic != INITRAMFS_MAGIC ||
+        h->size > len ||
+        sizeof(initramfs_header_t) + h->count * sizeof(initramfs_entry_t) > h->size) {
+        uart_puts("initramfs: no archive in image\n");
+        return -1;
+    }
+    
+    header = h;
+    entries = (const initramfs_entry_t*)(h + 1);
+    
+    uart_puts("initramfs: ");
+    uart_dec(h->count);
+    uart_puts(" files, ");
+    uart_dec(h->size);
+    uart_puts(" bytes\n");
+    return 0;
+}
+
+// Compares a lookup key against an index name, folding the key to lowercase
+static int name_cmp(const char* key, const char* name) {
+    for (int i = 0; i < INITRAMFS_NAME_MAX; i++) {
+        char c = key[i];
+        if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+        
+        if (c != name[i]) return (unsigned char)c - (unsigned char)name[i];
+        if (c == '\0') return 0;
+    }
+    return 0;
+}
+
+const unsigned char* initramfs_lookup(const char* name, unsigned int* size) {
+    if (!header) return 0;
+    
+    while (*name == '/') name++;
+    
+    unsigned int lo = 0;
+    unsigned int hi = header->count;
+    
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        int cmp = name_cmp(name, entries[mid].name);
+        
+        if (cmp == 0) {
+            *size = entries[mid].size;
+            return (const unsigned char*)header + entries[mid].offset;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    
+    return 0;
+}
+
+int initramfs_contains(const void* ptr) {
+    const unsigned char* p = (const unsigned char*)ptr;
+    return p >= __initramfs_start && p < __initramfs_end;
+}
+
+void initramfs_list(void) {
+    if (!header) return;
+    
+    uart_puts("\nFiles in initramfs:\n");
+    uart_puts("========================\n");
+    
+    for (unsigned int i = 0; i < header->count; i++) {
+        uart_puts(entries[i].name);
+        uart_puts("  (");
+        uart_dec(entries[i].size);
+        uart_puts(" bytes)\n");
+    }
+    
+    uart_puts("========================\n");
+}
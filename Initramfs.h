@@ -0,0 +1,33 @@
+/*
+ * initramfs.h - Read-only file archive linked into the kernel image
+ */
+
+#ifndef INITRAMFS_H
+#define INITRAMFS_H
+
+// Archive layout, written by tools/mkinitramfs:
+//   header, count entries sorted by name, then the file data. Each file
+//   starts on a 16-byte boundary and is followed by at least one NUL byte.
+//   Offsets are from the archive start.
+#define INITRAMFS_MAGIC     0x5242494E  // "NIBR"
+#define INITRAMFS_NAME_MAX  24          // Including the terminating NUL
+
+typedef struct {
+    unsigned int magic;
+    unsigned int count;
+    unsigned int size;              // Whole archive in bytes
+    unsigned int reserved;
+} initramfs_header_t;
+
+typedef struct {
+    char name[INITRAMFS_NAME_MAX];  // Lowercase, NUL padded
+    unsigned int offset;
+    unsigned int size;
+} initramfs_entry_t;
+
+int initramfs_init(void);
+const unsigned char* initramfs_lookup(const char* name, unsigned int* size);
+int initramfs_contains(const void* ptr);
+void initramfs_list(void);
+
+#endif
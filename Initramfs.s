@@ -0,0 +1,10 @@
+/*
+ * initramfs.S - Embeds the packed initramfs archive in the kernel image
+ *
+ * initramfs.img is produced by tools/mkinitramfs; linker.ld places this
+ * section and defines __initramfs_start/__initramfs_end around it.
+ */
+
+.section ".initramfs", "a"
+.balign 16
+.incbin "initramfs.img"
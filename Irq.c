@@ -0,0 +1,154 @@
+/*
+ * irq.c - BCM2835 interrupt controller driver
+ */
+
+#include "irq.h"
+#include "uart.h"
+#include "smp.h"
+#include "thread.h"
+
+// Interrupt controller registers (Raspberry Pi 2/3)
+#define IRQ_BASE            0x3F00B200
+#define IRQ_BASIC_PENDING   ((volatile unsigned int*)(IRQ_BASE + 0x00))
+#define IRQ_PENDING_1       ((volatile unsigned int*)(IRQ_BASE + 0x04))
+#define IRQ_PENDING_2       ((volatile unsigned int*)(IRQ_BASE + 0x08))
+#define IRQ_FIQ_CONTROL     ((volatile unsigned int*)(IRQ_BASE + 0x0C))
+#define IRQ_ENABLE_1        ((volatile unsigned int*)(IRQ_BASE + 0x10))
+#define IRQ_ENABLE_2        ((volatile unsigned int*)(IRQ_BASE + 0x14))
+#define IRQ_ENABLE_BASIC    ((volatile unsigned int*)(IRQ_BASE + 0x18))
+#define IRQ_DISABLE_1       ((volatile unsigned int*)(IRQ_BASE + 0x1C))
+#define IRQ_DISABLE_2       ((volatile unsigned int*)(IRQ_BASE + 0x20))
+#define IRQ_DISABLE_BASIC   ((volatile unsigned int*)(IRQ_BASE + 0x24))
+
+// Local peripherals: per-core interrupt source register
+#define LOCAL_IRQ_SOURCE(c) ((volatile unsigned int*)(0x40000060UL + 4 * (c)))
+
+#define IRQ_COUNT 64
+
+static irq_handler_t handlers[IRQ_COUNT];
+static irq_handler_t local_handlers[IRQ_LOCAL_COUNT];
+
+void irq_init(void) {
+    irq_disable();
+    
+    // Mask everything until a driver asks for its line
+    *IRQ_FIQ_CONTROL = 0;
+    *IRQ_DISABLE_1 = 0xFFFFFFFF;
+    *IRQ_DISABLE_2 = 0xFFFFFFFF;
+    *IRQ_DISABLE_BASIC = 0xFFFFFFFF;
+    
+    for (int i = 0; i < IRQ_COUNT; i++) {
+        handlers[i] = 0;
+    }
+    for (int i = 0; i < IRQ_LOCAL_COUNT; i++) {
+        local_handlers[i] = 0;
+    }
+    
+    uart_puts("Interrupts initialized\n");
+}
+
+void irq_register(unsigned int irq, irq_handler_t handler) {
+    if (irq >= IRQ_COUNT) return;
+    
+    handlers[irq] = handler;
+    if (irq < 32) {
+        *IRQ_ENABLE_1 = 1 << irq;
+    } else {
+        *IRQ_ENABLE_2 = 1 << (irq - 32);
+    }
+}
+
+void irq_unregister(unsigned int irq) {
+    if (irq >= IRQ_COUNT) return;
+    
+    if (irq < 32) {
+        *IRQ_DISABLE_1 = 1 << irq;
+    } else {
+        *IRQ_DISABLE_2 = 1 << (irq - 32);
+    }
+    handlers[irq] = 0;
+}
+
+// Register a handler for a per-core source; each core enables the
+// source in its own local control register
+void irq_register_local(unsigned int source, irq_handler_t handler) {
+    if (source < IRQ_LOCAL_COUNT) {
+        local_handlers[source] = handler;
+    }
+}
+
+static void irq_dispatch(unsigned int pending, unsigned int base) {
+    while (pending) {
+        unsigned int bit = 31 - __builtin_clz(pending);
+        pending &= ~(1 << bit);
+        
+        if (handlers[base + bit]) {
+            handlers[base + bit]();
+        } else {
+            // Nobody wants it - mask it so it cannot storm
+            irq_unregister(base + bit);
+        }
+    }
+}
+
+// Called from irq_entry in boot.S with interrupts masked, on the stack
+// of the interrupted thread
+void irq_handler(void) {
+    unsigned int source = *LOCAL_IRQ_SOURCE(smp_core_id());
+    
+    // GPU peripheral interrupts are routed to core 0 only
+    if (source & (1 << IRQ_LOCAL_GPU)) {
+        irq_dispatch(*IRQ_PENDING_1, 0);
+        irq_dispatch(*IRQ_PENDING_2, 32);
+    }
+    
+    for (unsigned int i = 0; i < IRQ_LOCAL_COUNT; i++) {
+        if (i != IRQ_LOCAL_GPU && (source & (1 << i)) && local_handlers[i]) {
+            local_handlers[i]();
+        }
+    }
+    
+    // Switch threads if a tick or wakeup asked for it
+    thread_preempt();
+}
+
+void irq_enable(void) {
+#ifdef __aarch64__
+    asm volatile("msr daifclr, #2" ::: "memory");
+#else
+    asm volatile("cpsie i" ::: "memory");
+#endif
+}
+
+void irq_disable(void) {
+#ifdef __aarch64__
+    asm volatile("msr daifset, #2" ::: "memory");
+#else
+    asm volatile("cpsid i" ::: "memory");
+#endif
+}
+
+unsigned int irq_save(void) {
+    unsigned long flags;
+#ifdef __aarch64__
+    asm volatile("mrs %0, daif\n\tmsr daifset, #2" : "=r"(flags) :: "memory");
+#else
+    asm volatile("mrs %0, cpsr\n\tcpsid i" : "=r"(flags) :: "memory");
+#endif
+    return flags;
+}
+
+// The I bit is bit 7 of both CPSR and DAIF
+void irq_restore(unsigned int flags) {
+    if (!(flags & (1 << 7))) {
+        irq_enable();
+    }
+}
+
+// Sleep until the next interrupt. Must be called with interrupts masked,
+// after checking the wake condition, so a wakeup cannot be lost.
+void irq_wait(void) {
+    asm volatile("dsb sy\n\twfi" ::: "memory");
+    irq_enable();
+    irq_disable();
+}
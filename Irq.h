@@ -0,0 +1,33 @@
+/*
+ * irq.h - Interrupt controller header
+ */
+
+#ifndef IRQ_H
+#define IRQ_H
+
+// GPU peripheral interrupt numbers (0-63)
+#define IRQ_SYSTIMER_3  3
+#define IRQ_UART0       57
+#define IRQ_EMMC        62
+
+// Per-core local interrupt sources (BCM2836/7 local peripherals)
+#define IRQ_LOCAL_CNTV  3
+#define IRQ_LOCAL_MBOX0 4
+#define IRQ_LOCAL_GPU   8
+#define IRQ_LOCAL_COUNT 12
+
+typedef void (*irq_handler_t)(void);
+
+void irq_init(void);
+void irq_register(unsigned int irq, irq_handler_t handler);
+void irq_unregister(unsigned int irq);
+void irq_register_local(unsigned int source, irq_handler_t handler);
+void irq_handler(void);
+
+void irq_enable(void);
+void irq_disable(void);
+unsigned int irq_save(void);
+void irq_restore(unsigned int flags);
+void irq_wait(void);
+
+#endif
@@ -6,10 +6,28 @@
 #include "memory.h"
 #include "sd.h"
 #include "fat32.h"
+#include "irq.h"
+#include "timer.h"
+#include "blk.h"
+#include "thread.h"
+#include "mmu.h"
+#include "smp.h"
+#include "fb.h"
+#include "initramfs.h"
+#include "tmpfs.h"
+#include "vfs.h"
+#include "load.h"
+#include "crc32.h"
+#include "verify.h"
+#include "exec.h"
+#include "dvfs.h"
  
-// MicroPython placeholder (we'll add integration instructions)
+#ifdef MICROPYTHON
+// MicroPython port (mpport/), linked in with make MICROPYTHON=1
 extern int micropython_init(void);
-extern int micropython_run_file(const char* code, unsigned int size);
+extern int micropython_run_file(const char* path);
+extern void micropython_repl(void);
+#endif
  
 // String functions
 int strlen(const char* str) {
@@ -49,12 +67,28 @@ void cmd_help() {
     uart_puts("  help      - Show this help\n");
     uart_puts("  echo      - Echo text\n");
     uart_puts("  clear     - Clear screen\n");
+    uart_puts("  console   - Select output (serial, fb, both)\n");
     uart_puts("  info      - System information\n");
-    uart_puts("  ls        - List files on SD card\n");
+    uart_puts("  ls        - List files (built-in, /tmp, SD card)\n");
     uart_puts("  cat       - Display file contents\n");
+    uart_puts("  write     - Write text to a file (write <file> <text>)\n");
+    uart_puts("  append    - Append text to a file\n");
+    uart_puts("  cp        - Copy a file (cp <from> <to>)\n");
+    uart_puts("  rm        - Delete a file\n");
     uart_puts("  run       - Run a Python file\n");
-    uart_puts("  python    - Interactive Python (coming soon)\n");
+    uart_puts("  python    - Interactive Python (Ctrl-D exits)\n");
+    uart_puts("  exec      - Run a native program (exec <file.elf> [args])\n");
+    uart_puts("  load      - Receive a kernel or file over serial (tools/nibload)\n");
+    uart_puts("  verify    - Check SD card files against an SFV manifest (verify <file>)\n");
+    uart_puts("  mmap      - Dump a file through a paged view (mmap <file> [offset [len]])\n");
     uart_puts("  mem       - Show memory usage\n");
+    uart_puts("  memprof   - Top heap call sites (memprof [live|peak|allocs] [n], memprof reset)\n");
+    uart_puts("  iostat    - Show block I/O statistics\n");
+    uart_puts("  ps        - List threads and CPU time\n");
+    uart_puts("  sleep     - Sleep for N milliseconds\n");
+    uart_puts("  nice      - Set thread priority (nice <id> <0-3>)\n");
+    uart_puts("  dvfs      - Clock governor status (dvfs [on|off])\n");
+    uart_puts("  <cmd> &   - Run a command in the background\n");
     uart_puts("  reboot    - Reboot system\n");
 }
  
@@ -69,11 +103,42 @@ void cmd_clear() {
     uart_puts("\033[2J\033[H");
 }
  
+// Command: console (select output device)
+void cmd_console(char* args) {
+    int outputs;
+    
+    if (strcmp(args, "serial") == 0) {
+        outputs = UART_OUT_SERIAL;
+    } else if (strcmp(args, "fb") == 0) {
+        outputs = UART_OUT_FB;
+    } else if (strcmp(args, "both") == 0) {
+        outputs = UART_OUT_SERIAL | UART_OUT_FB;
+    } else {
+        uart_puts("Usage: console <serial|fb|both>\n");
+        return;
+    }
+    
+    if ((outputs & UART_OUT_FB) && !fb_available()) {
+        uart_puts("console: no framebuffer\n");
+        return;
+    }
+    
+    // Input still arrives on the serial port only
+    uart_set_output(outputs);
+}
+ 
 // Command: info
 void cmd_info() {
     uart_puts("Nib OS v1.0\n");
-    uart_puts("Architecture: ARM\n");
+#ifdef __aarch64__
+    uart_puts("Architecture: ARMv8 AArch64\n");
+#else
+    uart_puts("Architecture: ARMv7\n");
+#endif
     uart_puts("Platform: Raspberry Pi 2/3\n");
+    uart_puts("Cores online: ");
+    uart_dec(smp_cores_online());
+    uart_puts("\n");
     uart_puts("Features:\n");
     uart_puts("  - SD card support (FAT32)\n");
     uart_puts("  - MicroPython interpreter\n");
@@ -82,7 +147,7 @@ void cmd_info() {
  
 // Command: ls (list files)
 void cmd_ls() {
-    fat32_list_files();
+    vfs_list();
 }
  
 // Command: cat (display file)
@@ -92,23 +157,136 @@ void cmd_cat(char* filename) {
         return;
     }
     
-    unsigned char* buffer = (unsigned char*)malloc(10240);
+    int fd = vfs_open(filename, VFS_O_READ);
+    if (fd < 0) {
+        uart_puts("cat: ");
+        uart_puts(vfs_strerror(fd));
+        uart_puts("\n");
+        return;
+    }
+    
+    unsigned char* buffer = (unsigned char*)page_alloc();
     if (!buffer) {
         uart_puts("Error: Out of memory\n");
+        vfs_close(fd);
         return;
     }
     
-    int size = fat32_read_file(filename, buffer, 10240);
-    
-    if (size > 0) {
-        uart_puts("\n--- File contents ---\n");
-        for (int i = 0; i < size; i++) {
+    uart_puts("\n--- File contents ---\n");
+    int n;
+    while ((n = vfs_read(fd, buffer, PAGE_SIZE)) > 0) {
+        for (int i = 0; i < n; i++) {
             uart_putc(buffer[i]);
         }
-        uart_puts("\n--- End of file ---\n");
+    }
+    uart_puts("\n--- End of file ---\n");
+    
+    page_free(buffer);
+    vfs_close(fd);
+}
+ 
+// Split "<path> <rest>" in place, returning rest
+static char* split_arg(char* args) {
+    while (*args && *args != ' ') args++;
+    if (*args) {
+        *args++ = '\0';
+        while (*args == ' ') args++;
+    }
+    return args;
+}
+ 
+// Command: write / append (store a line of text in a file)
+void cmd_write(char* args, int append) {
+    char* text = split_arg(args);
+    if (*args == '\0') {
+        uart_puts(append ? "Usage: append <file> <text>\n" : "Usage: write <file> <text>\n");
+        return;
     }
     
-    free(buffer);
+    int flags = VFS_O_WRITE | VFS_O_CREATE | (append ? VFS_O_APPEND : VFS_O_TRUNC);
+    int fd = vfs_open(args, flags);
+    if (fd < 0) {
+        uart_puts("write: ");
+        uart_puts(vfs_strerror(fd));
+        uart_puts("\n");
+        return;
+    }
+    
+    int result = vfs_write(fd, text, strlen(text));
+    if (result >= 0) result = vfs_write(fd, "\n", 1);
+    if (result < 0) {
+        uart_puts("write: ");
+        uart_puts(vfs_strerror(result));
+        uart_puts("\n");
+    }
+    vfs_close(fd);
+}
+ 
+// Command: cp (copy a file, e.g. from the SD card into /tmp)
+void cmd_cp(char* args) {
+    char* to = split_arg(args);
+    split_arg(to);
+    if (*args == '\0' || *to == '\0') {
+        uart_puts("Usage: cp <from> <to>\n");
+        return;
+    }
+    
+    int in = vfs_open(args, VFS_O_READ);
+    if (in < 0) {
+        uart_puts("cp: ");
+        uart_puts(vfs_strerror(in));
+        uart_puts("\n");
+        return;
+    }
+    int out = vfs_open(to, VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC);
+    if (out < 0) {
+        uart_puts("cp: ");
+        uart_puts(vfs_strerror(out));
+        uart_puts("\n");
+        vfs_close(in);
+        return;
+    }
+    
+    unsigned char* buffer = (unsigned char*)page_alloc();
+    int n = buffer ? 0 : VFS_NO_SPACE;
+    unsigned int total = 0;
+    
+    while (buffer && (n = vfs_read(in, buffer, PAGE_SIZE)) > 0) {
+        int w = vfs_write(out, buffer, n);
+        if (w != n) {
+            n = w < 0 ? w : VFS_NO_SPACE;
+            break;
+        }
+        total += n;
+    }
+    
+    if (n < 0) {
+        uart_puts("cp: ");
+        uart_puts(vfs_strerror(n));
+        uart_puts("\n");
+    } else {
+        uart_dec(total);
+        uart_puts(" bytes copied\n");
+    }
+    
+    page_free(buffer);
+    vfs_close(out);
+    vfs_close(in);
+}
+ 
+// Command: rm (delete a file)
+void cmd_rm(char* args) {
+    if (*args == '\0') {
+        uart_puts("Usage: rm <file>\n");
+        return;
+    }
+    
+    int result = vfs_unlink(args);
+    if (result != VFS_OK) {
+        uart_puts("rm: ");
+        uart_puts(vfs_strerror(result));
+        uart_puts("\n");
+    }
 }
  
 // Command: run (execute Python file)
@@ -118,39 +296,166 @@ void cmd_run(char* filename) {
         return;
     }
     
-    uart_puts("Loading Python script: ");
-    uart_puts(filename);
-    uart_puts("\n");
+#ifdef MICROPYTHON
+    micropython_run_file(filename);
+#else
+    unsigned int size;
+    const unsigned char* buffer = vfs_load(filename, &size);
     
-    unsigned char* buffer = (unsigned char*)malloc(10240);
     if (!buffer) {
-        uart_puts("Error: Out of memory\n");
+        uart_puts("run: file not found\n");
         return;
     }
     
-    int size = fat32_read_file(filename, buffer, 10240);
+    uart_puts("MicroPython is not built in; rebuild with make MICROPYTHON=1\n");
+    uart_puts("--- Code preview ---\n");
+    for (unsigned int i = 0; i < (size < 500 ? size : 500); i++) {
+        uart_putc(buffer[i]);
+    }
+    if (size > 500) uart_puts("\n... (truncated) ...");
+    uart_puts("\n");
     
-    if (size > 0) {
-        uart_puts("Executing Python code...\n");
-        uart_puts("--- Output ---\n");
-        
-        // For now, just display the code
-        // In full version, this would call: micropython_run_file((char*)buffer, size);
-        uart_puts("MicroPython execution not yet integrated.\n");
-        uart_puts("To integrate MicroPython:\n");
-        uart_puts("1. Download MicroPython for ARM\n");
-        uart_puts("2. Link it with this kernel\n");
-        uart_puts("3. Implement micropython_run_file() function\n");
-        
-        uart_puts("\n--- Code preview ---\n");
-        for (int i = 0; i < (size < 500 ? size : 500); i++) {
-            uart_putc(buffer[i]);
+    vfs_release(buffer);
+#endif
+}
+ 
+// Command: exec (run a native ELF program with arguments)
+void cmd_exec(char* args) {
+    char* argv[16];
+    int argc = 0;
+    
+    while (*args && argc < 15) {
+        argv[argc++] = args;
+        args = split_arg(args);
+    }
+    argv[argc] = 0;
+    
+    if (argc == 0) {
+        uart_puts("Usage: exec <file.elf> [args]\n");
+        return;
+    }
+    
+    int code;
+    int result = exec_run(argv[0], argc, argv, &code);
+    if (result != EXEC_OK) {
+        uart_puts("exec: ");
+        uart_puts(exec_strerror(result));
+        uart_puts("\n");
+    } else if (code != 0) {
+        uart_puts("exec: exit code ");
+        if (code < 0) uart_putc('-');
+        uart_dec(code < 0 ? -(unsigned int)code : (unsigned int)code);
+        uart_puts("\n");
+    }
+}
+ 
+// Command: load (receive a kernel or a file from tools/nibload)
+void cmd_load() {
+    uart_puts("Waiting for tools/nibload, Ctrl-C cancels...\n");
+    if (load_receive(LOAD_SHELL_WAIT_MS, LOAD_ACCEPT_KERNEL | LOAD_ACCEPT_FILE) == LOAD_NO_HOST) {
+        uart_puts("load: no transfer\n");
+    }
+}
+ 
+// Parse a decimal or 0x-prefixed number, advancing *args past it
+static unsigned int parse_number(char** args) {
+    char* p = *args;
+    unsigned int value = 0;
+    
+    if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        p += 2;
+        while (1) {
+            char c = *p;
+            if (c >= '0' && c <= '9') value = value * 16 + (c - '0');
+            else if (c >= 'a' && c <= 'f') value = value * 16 + (c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F') value = value * 16 + (c - 'A' + 10);
+            else break;
+            p++;
         }
-        if (size > 500) uart_puts("\n... (truncated) ...");
+    } else {
+        while (*p >= '0' && *p <= '9') value = value * 10 + (*p++ - '0');
+    }
+    while (*p == ' ') p++;
+    *args = p;
+    return value;
+}
+ 
+// Command: mmap (hexdump part of an SD card file through a paged view)
+void cmd_mmap(char* args) {
+    char* rest = split_arg(args);
+    if (*args == '\0') {
+        uart_puts("Usage: mmap <file> [offset [len]]\n");
+        return;
+    }
+    
+    unsigned int size;
+    const unsigned char* data = (const unsigned char*)fat32_mmap(args, &size);
+    if (!data) {
+        uart_puts("mmap: cannot map ");
+        uart_puts(args);
         uart_puts("\n");
+        return;
     }
     
-    free(buffer);
+    unsigned int offset = parse_number(&rest);
+    unsigned int len = *rest ? parse_number(&rest) : 256;
+    if (offset > size) offset = size;
+    if (len > size - offset) len = size - offset;
+    
+    // Each line touches the view, faulting pages in as it goes
+    for (unsigned int i = 0; i < len; i += 16) {
+        uart_hex(offset + i);
+        uart_puts(": ");
+        for (unsigned int j = 0; j < 16; j++) {
+            if (i + j < len) {
+                unsigned char b = data[offset + i + j];
+                uart_putc("0123456789abcdef"[b >> 4]);
+                uart_putc("0123456789abcdef"[b & 15]);
+                uart_putc(' ');
+            } else {
+                uart_puts("   ");
+            }
+        }
+        for (unsigned int j = 0; j < 16 && i + j < len; j++) {
+            unsigned char c = data[offset + i + j];
+            uart_putc(c >= 32 && c < 127 ? c : '.');
+        }
+        uart_puts("\n");
+    }
+    
+    uart_puts("Mapped ");
+    uart_dec(size);
+    uart_puts(" bytes at ");
+    uart_hex((unsigned long)data);
+    uart_puts(", ");
+    uart_dec(fat32_view_resident(data));
+    uart_puts(" of ");
+    uart_dec((size + PAGE_SIZE - 1) / PAGE_SIZE);
+    uart_puts(" pages resident\n");
+    
+    fat32_munmap(data);
+}
+ 
+// Command: verify (CRC-check SD card files listed in a manifest)
+void cmd_verify(char* args) {
+    if (*args == '\0') {
+        uart_puts("Usage: verify <manifest.sfv>\n");
+        return;
+    }
+    verify_manifest(args);
+}
+ 
+// Command: dvfs (clock governor status and control)
+void cmd_dvfs(char* args) {
+    if (strcmp(args, "on") == 0) {
+        dvfs_enable(1);
+    } else if (strcmp(args, "off") == 0) {
+        dvfs_enable(0);
+    } else if (*args != '\0') {
+        uart_puts("Usage: dvfs [on|off]\n");
+        return;
+    }
+    dvfs_status();
 }
  
 // Command: mem (memory info)
@@ -162,6 +467,96 @@ void cmd_mem() {
     uart_puts("  Available: ");
     uart_dec(mem_available());
     uart_puts(" bytes\n");
+    uart_puts("  Pages: ");
+    uart_dec(page_used());
+    uart_puts(" of ");
+    uart_dec(page_total());
+    uart_puts(" in use (4KB)\n");
+    
+    unsigned int files, bytes, pages;
+    tmpfs_stats(&files, &bytes, &pages);
+    uart_puts("  tmpfs: ");
+    uart_dec(files);
+    uart_puts(" files, ");
+    uart_dec(bytes);
+    uart_puts(" bytes in ");
+    uart_dec(pages);
+    uart_puts(" pages\n");
+    
+    unsigned int views, resident, faults, evictions;
+    fat32_view_stats(&views, &resident, &faults, &evictions);
+    uart_puts("  File views: ");
+    uart_dec(views);
+    uart_puts(" mapped, ");
+    uart_dec(resident);
+    uart_puts(" pages resident (");
+    uart_dec(faults);
+    uart_puts(" faults, ");
+    uart_dec(evictions);
+    uart_puts(" evicted)\n");
+}
+ 
+// Command: memprof (heap profile by call site)
+void cmd_memprof(char* args) {
+#ifdef MEMPROF
+    char* rest = split_arg(args);
+    int order = MEMPROF_BY_LIVE;
+    
+    if (strcmp(args, "reset") == 0) {
+        memprof_reset();
+        uart_puts("memprof: counters reset\n");
+        return;
+    } else if (strcmp(args, "peak") == 0) {
+        order = MEMPROF_BY_PEAK;
+    } else if (strcmp(args, "allocs") == 0) {
+        order = MEMPROF_BY_ALLOCS;
+    } else if (*args >= '0' && *args <= '9') {
+        rest = args;
+    } else if (*args != '\0' && strcmp(args, "live") != 0) {
+        uart_puts("Usage: memprof [live|peak|allocs] [count] | memprof reset\n");
+        return;
+    }
+    
+    unsigned int count = *rest ? parse_number(&rest) : 10;
+    memprof_report(order, count);
+#else
+    (void)args;
+    uart_puts("The heap profiler is not built in; rebuild with make MEMPROF=1\n");
+#endif
+}
+ 
+// Command: ps (list threads)
+void cmd_ps() {
+    thread_list();
+}
+ 
+// Command: sleep
+void cmd_sleep(char* args) {
+    unsigned int ms = 0;
+    while (*args >= '0' && *args <= '9') {
+        ms = ms * 10 + (*args++ - '0');
+    }
+    thread_sleep(ms);
+}
+ 
+// Command: nice (set thread priority)
+void cmd_nice(char* args) {
+    int id = 0;
+    int prio = 0;
+    
+    while (*args >= '0' && *args <= '9') {
+        id = id * 10 + (*args++ - '0');
+    }
+    while (*args == ' ') args++;
+    if (*args < '0' || *args > '9') {
+        uart_puts("Usage: nice <id> <priority 0-3>\n");
+        return;
+    }
+    prio = *args - '0';
+    
+    if (thread_set_priority(id, prio) != 0) {
+        uart_puts("nice: no such thread or bad priority\n");
+    }
 }
  
 // Command: reboot
@@ -199,18 +594,52 @@ void parse_command(char* cmd) {
         cmd_echo(args);
     } else if (strcmp(cmd, "clear") == 0) {
         cmd_clear();
+    } else if (strcmp(cmd, "console") == 0) {
+        cmd_console(args);
     } else if (strcmp(cmd, "info") == 0) {
         cmd_info();
     } else if (strcmp(cmd, "ls") == 0) {
         cmd_ls();
     } else if (strcmp(cmd, "cat") == 0) {
         cmd_cat(args);
+    } else if (strcmp(cmd, "write") == 0) {
+        cmd_write(args, 0);
+    } else if (strcmp(cmd, "append") == 0) {
+        cmd_write(args, 1);
+    } else if (strcmp(cmd, "cp") == 0) {
+        cmd_cp(args);
+    } else if (strcmp(cmd, "rm") == 0) {
+        cmd_rm(args);
     } else if (strcmp(cmd, "run") == 0) {
         cmd_run(args);
+    } else if (strcmp(cmd, "exec") == 0) {
+        cmd_exec(args);
+    } else if (strcmp(cmd, "load") == 0) {
+        cmd_load();
+    } else if (strcmp(cmd, "verify") == 0) {
+        cmd_verify(args);
+    } else if (strcmp(cmd, "mmap") == 0) {
+        cmd_mmap(args);
     } else if (strcmp(cmd, "mem") == 0) {
         cmd_mem();
+    } else if (strcmp(cmd, "memprof") == 0) {
+        cmd_memprof(args);
+    } else if (strcmp(cmd, "iostat") == 0) {
+        blk_stats();
+    } else if (strcmp(cmd, "ps") == 0) {
+        cmd_ps();
+    } else if (strcmp(cmd, "sleep") == 0) {
+        cmd_sleep(args);
+    } else if (strcmp(cmd, "nice") == 0) {
+        cmd_nice(args);
+    } else if (strcmp(cmd, "dvfs") == 0) {
+        cmd_dvfs(args);
     } else if (strcmp(cmd, "python") == 0) {
-        uart_puts("Interactive Python coming soon!\n");
+#ifdef MICROPYTHON
+        micropython_repl();
+#else
+        uart_puts("MicroPython is not built in; rebuild with make MICROPYTHON=1\n");
+#endif
     } else if (strcmp(cmd, "reboot") == 0) {
         cmd_reboot();
     } else {
@@ -220,6 +649,38 @@ void parse_command(char* cmd) {
     }
 }
  
+// Background job: runs one command line in its own thread
+static void job_main(void* arg) {
+    char* line = (char*)arg;
+    parse_command(line);
+    free(line);
+}
+ 
+// Run a command line ending in '&' in a new thread
+static int run_background(char* line, int len) {
+    while (len > 0 && line[len - 1] == ' ') len--;
+    if (len == 0 || line[len - 1] != '&') return 0;
+    line[len - 1] = '\0';
+    
+    char* copy = (char*)malloc(len);
+    if (!copy) {
+        uart_puts("Error: Out of memory\n");
+        return 1;
+    }
+    strcpy(copy, line);
+    
+    int id = thread_create(copy, job_main, copy);
+    if (id < 0) {
+        uart_puts("Error: Cannot start background job\n");
+        return 1;
+    }
+    
+    uart_puts("[");
+    uart_dec(id);
+    uart_puts("] started\n");
+    return 1;
+}
+ 
 // Simple shell
 void shell() {
     char buffer[256];
@@ -235,7 +696,9 @@ void shell() {
             uart_puts("\n");
             
             if (pos > 0) {
-                parse_command(buffer);
+                if (!run_background(buffer, pos)) {
+                    parse_command(buffer);
+                }
                 pos = 0;
             }
             
@@ -264,14 +727,51 @@ void kernel_main(void) {
     uart_puts("========================================\n");
     uart_puts("Lightweight OS with Python support\n\n");
     
+    // Enable the MMU and caches (needed for spinlocks)
+    mmu_init();
+    
     // Initialize memory
     mem_init();
     
-    // Initialize SD card
+    // CRC tables, used by the loader and by verify on every core
+    crc32_init();
+    
+    // Boot stage: tools/nibload can replace this kernel before it goes on
+    load_receive(LOAD_BOOT_WAIT_MS, LOAD_ACCEPT_KERNEL);
+    
+    // Mirror the console to the screen if the GPU gives us a framebuffer
+    if (fb_init() == 0) {
+        uart_set_output(UART_OUT_SERIAL | UART_OUT_FB);
+        uart_puts("Framebuffer console enabled\n");
+    }
+    
+    // Initialize interrupts, the system timer and the scheduler
+    irq_init();
+    timer_init();
+    thread_init();
+    timer_tick_start();
+    uart_irq_init();
+    irq_enable();
+    
+    // Bring up the parked cores
+    smp_init();
+    
+    // Start the clock governor once every core's idle time is counted
+    dvfs_init();
+    
+    // Built-in files are usable whether or not the SD card comes up
+    initramfs_init();
+    tmpfs_init();
+#ifdef MICROPYTHON
+    micropython_init();
+#endif
+    
+    // Initialize SD card and the block request queue
+    blk_init();
     int sd_status = sd_init();
     if (sd_status != 0) {
         uart_puts("WARNING: SD card initialization failed!\n");
-        uart_puts("File system features will not be available.\n\n");
+        uart_puts("Only built-in initramfs files will be available.\n\n");
     } else {
         // Initialize FAT32
         int fat_status = fat32_init();
@@ -0,0 +1,345 @@
+/*
+ * load.c - Serial loader for kernels and files
+ *
+ * The host (tools/nibload) sends a kernel image or a file in CRC-checked
+ * 1KB blocks with a sliding window, after switching both ends to a fast
+ * baud rate. kernel_main listens briefly at boot so a new kernel can be
+ * pushed right after reset; the load command listens from the shell.
+ *
+ * Once a transfer starts, the receiving core masks interrupts and polls
+ * the UART FIFO directly, so nothing preempts it at high speed. The
+ * image is staged in the page pool and only checked with its whole-file
+ * CRC at the end. A kernel is then started through the trampoline in
+ * boot.S, copied to a spare page so it survives the new image being
+ * copied over this one; files are written under /tmp.
+ */
+
+#include "load.h"
+#include "uart.h"
+#include "timer.h"
+#include "irq.h"
+#include "smp.h"
+#include "mmu.h"
+#include "memory.h"
+#include "thread.h"
+#include "crc32.h"
+#include "vfs.h"
+
+#define LOAD_BYTE_TIMEOUT   20000       // Between bytes of one frame, us
+#define LOAD_IDLE_TIMEOUT   3000000     // Silence that ends a transfer
+#define LOAD_SPEED_TIMEOUT  2000000     // For the HELLO at the new speed
+#define LOAD_PARK_TIMEOUT   100000      // For the other cores to park
+#define LOAD_MAX_BAUD       3000000
+
+// Internal frame results besides the frame type
+#define LOAD_NONE          -1
+#define LOAD_BAD           -2
+#define LOAD_CANCEL        -3
+
+// Parameter block at the start of the trampoline in boot.S
+typedef struct {
+    unsigned int src;
+    unsigned int size;
+    unsigned int pad0[14];
+    volatile unsigned char parked[64];  // Own cache line, written by parked cores
+    volatile unsigned int go;
+} load_chain_t;
+
+extern char chain_start[];
+extern char chain_end[];
+extern char chain_park[];
+extern char chain_boot[];
+
+static unsigned char frame_buf[LOAD_BLOCK];
+
+static void load_send(int type, unsigned int seq, const void* payload, unsigned int len) {
+    load_header_t h;
+    h.sync = LOAD_SYNC;
+    h.type = type;
+    h.seq = seq;
+    h.len = len;
+    h.check = crc32(0, &h, 6);
+    h.crc = 0;
+    h.crc = crc32(crc32(0, &h, sizeof(h)), payload, len);
+    
+    uart_send(&h, sizeof(h));
+    uart_send(payload, len);
+}
+
+static void load_send_error(unsigned int code) {
+    load_send(LOAD_ERR, 0, &code, sizeof(code));
+}
+
+static void load_ready(void) {
+    unsigned int info[4];
+    info[0] = LOAD_VERSION;
+    info[1] = LOAD_BLOCK;
+    info[2] = LOAD_WINDOW;
+    info[3] = (page_total() - page_used()) * PAGE_SIZE;
+    load_send(LOAD_READY, 0, info, sizeof(info));
+}
+
+// Wait up to timeout_us for a frame and return its type, with the
+// payload in frame_buf. Bytes before a sync byte are skipped; Ctrl-C
+// among them cancels if 'cancel' is set. A header that fails its check
+// came from a sync byte inside other data and is reported as damaged.
+static int load_recv(load_header_t* h, unsigned int timeout_us, int cancel) {
+    unsigned char* p = (unsigned char*)h;
+    unsigned int start = timer_ticks();
+    int c;
+    
+    do {
+        unsigned int spent = timer_ticks() - start;
+        if (spent >= timeout_us) return LOAD_NONE;
+        c = uart_recv(timeout_us - spent);
+        if (c == 3 && cancel) return LOAD_CANCEL;
+    } while (c != LOAD_SYNC);
+    
+    p[0] = LOAD_SYNC;
+    for (unsigned int i = 1; i < sizeof(*h); i++) {
+        if ((c = uart_recv(LOAD_BYTE_TIMEOUT)) < 0) return LOAD_BAD;
+        p[i] = c;
+    }
+    if (h->check != (crc32(0, h, 6) & 0xFFFF) || h->len > LOAD_BLOCK) return LOAD_BAD;
+    
+    for (unsigned int i = 0; i < h->len; i++) {
+        if ((c = uart_recv(LOAD_BYTE_TIMEOUT)) < 0) return LOAD_BAD;
+        frame_buf[i] = c;
+    }
+    
+    unsigned int crc = h->crc;
+    h->crc = 0;
+    if (crc32(crc32(0, h, sizeof(*h)), frame_buf, h->len) != crc) return LOAD_BAD;
+    return h->type;
+}
+
+static unsigned int load_pages(const load_start_t* st) {
+    // Kernels get an extra page for the trampoline
+    return (st->size + PAGE_SIZE - 1) / PAGE_SIZE + ((st->flags & LOAD_KERNEL) ? 1 : 0);
+}
+
+// Run the protocol from the first HELLO to DONE. Returns 0 with the
+// image in *image, or a LOAD_E_ code.
+static int load_transfer(load_start_t* st, unsigned char** image, unsigned int accept) {
+    load_header_t h;
+    int type = LOAD_HELLO;
+    
+    // Handshake at the default speed; HELLO repeats until we answer
+    while (type != LOAD_START || h.len < sizeof(*st)) {
+        if (type == LOAD_HELLO) load_ready();
+        type = load_recv(&h, LOAD_IDLE_TIMEOUT, 0);
+        if (type == LOAD_NONE) return LOAD_E_TIMEOUT;
+    }
+    memcpy(st, frame_buf, sizeof(*st));
+    st->name[sizeof(st->name) - 1] = '\0';
+    
+    if (!(accept & ((st->flags & LOAD_KERNEL) ? LOAD_ACCEPT_KERNEL : LOAD_ACCEPT_FILE))) {
+        load_send_error(LOAD_E_TYPE);
+        return LOAD_E_TYPE;
+    }
+    if (st->size == 0 || ((st->flags & LOAD_KERNEL) && st->size > LOAD_MAX_KERNEL)) {
+        load_send_error(LOAD_E_SIZE);
+        return LOAD_E_SIZE;
+    }
+    *image = (unsigned char*)page_alloc_run(load_pages(st));
+    if (!*image) {
+        load_send_error(LOAD_E_NO_MEM);
+        return LOAD_E_NO_MEM;
+    }
+    
+    // The ACK names the speed both ends switch to
+    unsigned int baud = st->baud;
+    if (baud == 0 || baud > LOAD_MAX_BAUD) baud = LOAD_BAUD;
+    load_send(LOAD_ACK, 0, &baud, sizeof(baud));
+    uart_flush();
+    uart_set_baud(baud);
+    
+    do {
+        type = load_recv(&h, LOAD_SPEED_TIMEOUT, 0);
+    } while (type != LOAD_HELLO && type != LOAD_NONE);
+    if (type == LOAD_NONE) return LOAD_E_TIMEOUT;
+    load_ready();
+    
+    // Blocks are taken in order only. A damaged frame or a stale one gets
+    // a NAK naming the block we need; frames from beyond a gap draw just
+    // one, since they are what the host sent before it went back.
+    unsigned int blocks = (st->size + LOAD_BLOCK - 1) / LOAD_BLOCK;
+    unsigned int next = 0;
+    int nak_sent = 0;
+    
+    while (1) {
+        type = load_recv(&h, LOAD_IDLE_TIMEOUT, 0);
+        if (type == LOAD_NONE) return LOAD_E_TIMEOUT;
+    
+        int ahead = 0;
+        if (type == LOAD_DATA && next < blocks && h.seq == (next & 0xFFFF)) {
+            unsigned int offset = next * LOAD_BLOCK;
+            unsigned int len = st->size - offset < LOAD_BLOCK ? st->size - offset : LOAD_BLOCK;
+            if (h.len == len) {
+                memcpy(*image + offset, frame_buf, len);
+                next++;
+                nak_sent = 0;
+                load_send(LOAD_ACK, next, 0, 0);
+                continue;
+            }
+        } else if (type == LOAD_DATA) {
+            ahead = (unsigned short)(h.seq - next) < 0x8000;
+        } else if (type == LOAD_HELLO) {
+            load_ready();
+            continue;
+        } else if (type == LOAD_END && next == blocks) {
+            break;
+        }
+    
+        if (!ahead || !nak_sent) {
+            load_send(LOAD_NAK, next, 0, 0);
+            nak_sent = 1;
+        }
+    }
+    
+    if (crc32(0, *image, st->size) != st->crc) {
+        load_send_error(LOAD_E_CRC);
+        return LOAD_E_CRC;
+    }
+    load_send(LOAD_DONE, 0, 0, 0);
+    return 0;
+}
+
+// Copy the trampoline out of the way, park the other cores in it and
+// let it copy the image to LOAD_ADDRESS and jump there. Does not return.
+static void load_chain(const unsigned char* image, unsigned int size, unsigned char* page) {
+    unsigned int len = chain_end - chain_start;
+    load_chain_t* chain = (load_chain_t*)page;
+    
+    irq_save();
+    
+    memcpy(page, chain_start, len);
+    chain->src = (unsigned long)image;
+    chain->size = size;
+    
+    // Other cores fetch the trampoline with their caches on at first and
+    // read it with them off later
+    mmu_clean_dcache(page, len);
+#ifdef __aarch64__
+    asm volatile("ic ialluis\n\tdsb sy\n\tisb" ::: "memory");
+#else
+    asm volatile("mcr p15, 0, %0, c7, c1, 0\n\tdsb\n\tisb" :: "r"(0) : "memory");
+#endif
+    
+    unsigned int others = smp_park_others((void (*)(void))(page + (chain_park - chain_start)));
+    unsigned int start = timer_ticks();
+    while (timer_ticks() - start < LOAD_PARK_TIMEOUT) {
+        mmu_invalidate_dcache((const void*)chain->parked, SMP_MAX_CORES);
+        unsigned int parked = 0;
+        for (unsigned int core = 0; core < SMP_MAX_CORES; core++) {
+            if (chain->parked[core]) parked |= 1 << core;
+        }
+        if ((parked & others) == others) break;
+    }
+    
+    ((void (*)(void))(page + (chain_boot - chain_start)))();
+}
+
+static const char* load_error(int code) {
+    switch (code) {
+        case LOAD_E_SIZE: return "image too large";
+        case LOAD_E_NO_MEM: return "out of memory";
+        case LOAD_E_CRC: return "CRC mismatch";
+        case LOAD_E_TIMEOUT: return "timed out";
+        case LOAD_E_TYPE: return "only kernels can be loaded at boot";
+        default: return "failed";
+    }
+}
+
+// Store a received file; bare names go under /tmp
+static void load_store(const load_start_t* st, const unsigned char* data) {
+    char path[5 + sizeof(st->name)];
+    unsigned int n = 0;
+    
+    if (st->name[0] != '/') {
+        const char* prefix = "/tmp/";
+        while (*prefix) path[n++] = *prefix++;
+    }
+    for (const char* s = st->name; *s; s++) path[n++] = *s;
+    path[n] = '\0';
+    
+    int fd = vfs_open(path, VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC);
+    int written = fd;
+    if (fd >= 0) {
+        written = vfs_write(fd, data, st->size);
+        vfs_close(fd);
+    }
+    
+    uart_puts("load: ");
+    if (written == (int)st->size) {
+        uart_puts("saved ");
+        uart_puts(path);
+    } else {
+        uart_puts(path);
+        uart_puts(": ");
+        uart_puts(vfs_strerror(written < 0 ? written : VFS_NO_SPACE));
+    }
+    uart_puts("\n");
+}
+
+// Wait up to wait_ms for tools/nibload and receive what it sends. A
+// kernel does not come back from here.
+int load_receive(unsigned int wait_ms, unsigned int accept) {
+    load_header_t h;
+    load_start_t st;
+    int type;
+    
+    uart_raw_begin();
+    
+    // Wait for the host with interrupts on; a HELLO fits in the FIFO
+    unsigned int start = timer_ticks();
+    do {
+        type = load_recv(&h, 10000, 1);
+        if (type != LOAD_HELLO) thread_yield();
+    } while (type != LOAD_HELLO && type != LOAD_CANCEL && timer_ticks() - start < wait_ms * 1000);
+    
+    if (type != LOAD_HELLO) {
+        uart_raw_end();
+        return LOAD_NO_HOST;
+    }
+    
+    // Nothing may preempt this core while it polls the line at speed
+    unsigned int flags = irq_save();
+    unsigned char* image = 0;
+    start = timer_ticks();
+    int error = load_transfer(&st, &image, accept);
+    unsigned int elapsed = timer_ticks() - start;
+    uart_flush();
+    uart_set_baud(LOAD_BAUD);
+    irq_restore(flags);
+    uart_raw_end();
+    
+    if (error) {
+        uart_puts("load: ");
+        uart_puts(load_error(error));
+        uart_puts("\n");
+        page_free(image);
+        return LOAD_FAILED;
+    }
+    
+    unsigned int ms = elapsed / 1000;
+    uart_puts("load: received ");
+    uart_puts(st.name);
+    uart_puts(" (");
+    uart_dec(st.size);
+    uart_puts(" bytes) in ");
+    uart_dec(ms);
+    uart_puts(" ms, ");
+    uart_dec(ms ? st.size / ms : st.size);         // Bytes per ms = KB/s
+    uart_puts(" KB/s\n");
+    
+    if (st.flags & LOAD_KERNEL) {
+        uart_puts("load: starting new kernel\n\n");
+        uart_flush();
+        load_chain(image, st.size, image + (load_pages(&st) - 1) * PAGE_SIZE);
+    }
+    
+    load_store(&st, image);
+    page_free(image);
+    return LOAD_OK;
+}
@@ -0,0 +1,96 @@
+/*
+ * load.h - Serial loader for kernels and files (host side: tools/nibload)
+ */
+
+#ifndef LOAD_H
+#define LOAD_H
+
+// Where the firmware loads kernel.img (kernel8.img) and where a received
+// kernel goes
+#ifdef __aarch64__
+#define LOAD_ADDRESS        0x80000
+#else
+#define LOAD_ADDRESS        0x8000
+#endif
+#define LOAD_MAX_KERNEL     (0x1000000 - LOAD_ADDRESS)
+
+// How long kernel_main listens for the host before booting normally, and
+// how long the load command waits for it
+#ifndef LOAD_BOOT_WAIT_MS
+#define LOAD_BOOT_WAIT_MS   250
+#endif
+#define LOAD_SHELL_WAIT_MS  60000
+
+// Protocol. Every frame is a 12-byte little-endian header followed by up
+// to LOAD_BLOCK bytes of payload. check is the low half of the CRC-32 of
+// the first six header bytes, so a stray sync byte is rejected before
+// any payload is read; crc is the CRC-32 of the header (with crc zero)
+// and the payload. The handshake runs at 115200 baud:
+//
+//   host HELLO            -> READY {version, block, window, max_size}
+//   host START {size, crc, baud, flags, name[32]}
+//                         -> ACK {baud} then both switch to baud,
+//                            or ERR {code}
+//   host HELLO            -> READY (confirms the new speed)
+//   host DATA seq=n       -> ACK seq=next block expected, or NAK seq=that
+//                            block after a bad or out-of-order frame
+//   host END              -> DONE once the whole-image CRC matches, else
+//                            ERR; both return to 115200
+//
+// The host keeps up to 'window' blocks in flight and goes back to the
+// block named by a NAK, or to the last ACK after a timeout.
+#define LOAD_SYNC           0x5A
+#define LOAD_VERSION        1
+#define LOAD_BLOCK          1024
+#define LOAD_WINDOW         8
+#define LOAD_BAUD           115200
+
+#define LOAD_HELLO          0x01
+#define LOAD_START          0x02
+#define LOAD_DATA           0x03
+#define LOAD_END            0x04
+#define LOAD_ACK            0x80
+#define LOAD_READY          0x81
+#define LOAD_NAK            0x82
+#define LOAD_DONE           0x83
+#define LOAD_ERR            0x84
+
+// START flags: a kernel replaces the running one, anything else is a file
+#define LOAD_KERNEL         0x01
+
+// ERR codes
+#define LOAD_E_SIZE         1
+#define LOAD_E_NO_MEM       2
+#define LOAD_E_CRC          3
+#define LOAD_E_TIMEOUT      4
+#define LOAD_E_TYPE         5       // Boot stage takes kernels only
+
+// What load_receive() accepts
+#define LOAD_ACCEPT_KERNEL  0x01
+#define LOAD_ACCEPT_FILE    0x02
+
+// load_receive() results
+#define LOAD_OK             0
+#define LOAD_NO_HOST       -1
+#define LOAD_FAILED        -2
+
+typedef struct {
+    unsigned char sync;
+    unsigned char type;
+    unsigned short seq;
+    unsigned short len;
+    unsigned short check;
+    unsigned int crc;
+} load_header_t;
+
+typedef struct {
+    unsigned int size;
+    unsigned int crc;
+    unsigned int baud;
+    unsigned int flags;
+    char name[32];
+} load_start_t;
+
+int load_receive(unsigned int wait_ms, unsigned int accept);
+
+#endif
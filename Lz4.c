@@ -0,0 +1,296 @@
+/*
+ * lz4.c - Streaming LZ4 frame decoder
+ *
+ * The compressed frame sits in one buffer that fills up front to back
+ * (an initramfs file, or a FAT32 file still being read from the card).
+ * Each lz4_frame_feed() call decodes every block that has fully arrived,
+ * so decompression overlaps the remaining card reads. Output goes to a
+ * contiguous page run, which doubles as the 64KB history window for
+ * linked blocks.
+ *
+ * Literal runs and matches are moved 8 bytes at a time with unaligned
+ * word accesses and may overrun their end by up to 7 bytes, as long as
+ * that stays inside the buffers. NEON is not used: interrupts and
+ * context switches only preserve the VFP registers d0-d15.
+ *
+ * Block and content checksums are skipped, not verified.
+ */
+
+#include "lz4.h"
+#include "memory.h"
+
+#define LZ4_ST_MAGIC    0
+#define LZ4_ST_HEADER   1
+#define LZ4_ST_BLOCK    2
+#define LZ4_ST_TRAILER  3
+#define LZ4_ST_SKIP     4
+
+#define LZ4_FLG_INDEPENDENT     0x20
+#define LZ4_FLG_BLOCK_CHECKSUM  0x10
+#define LZ4_FLG_CONTENT_SIZE    0x08
+#define LZ4_FLG_CONTENT_CHECKSUM 0x04
+#define LZ4_FLG_DICT_ID         0x01
+
+#define LZ4_SKIPPABLE_MASK  0xFFFFFFF0
+#define LZ4_SKIPPABLE       0x184D2A50
+
+#define LZ4_MIN_MATCH   4
+
+typedef struct {
+    unsigned int v;
+} __attribute__((packed)) lz4_u32_t;
+
+// Match pointer adjustments for offsets below 8 (see the match copy)
+static const unsigned char lz4_inc[8] = { 0, 1, 2, 1, 4, 4, 4, 4 };
+static const signed char lz4_dec[8] = { 0, 0, 0, -1, 0, 1, 2, 3 };
+
+static inline unsigned int lz4_read32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static inline void lz4_copy8(unsigned char* d, const unsigned char* s) {
+    ((lz4_u32_t*)d)[0].v = ((const lz4_u32_t*)s)[0].v;
+    ((lz4_u32_t*)d)[1].v = ((const lz4_u32_t*)s)[1].v;
+}
+
+int lz4_is_frame(const unsigned char* data, unsigned int len) {
+    return len >= 4 && lz4_read32(data) == LZ4_MAGIC;
+}
+
+void lz4_frame_init(lz4_frame_t* f) {
+    memset(f, 0, sizeof(*f));
+    f->state = LZ4_ST_MAGIC;
+}
+
+// Decodes one raw LZ4 block, appending to out at out_pos. Earlier output
+// in out[0..out_pos) is the match history. Returns the bytes produced.
+int lz4_decompress_block(const unsigned char* src, unsigned int src_len,
+                         unsigned char* out, unsigned int out_pos, unsigned int out_cap) {
+    const unsigned char* ip = src;
+    const unsigned char* iend = src + src_len;
+    unsigned char* op = out + out_pos;
+    unsigned char* oend = out + out_cap;
+    
+    while (ip < iend) {
+        unsigned int token = *ip++;
+        
+        // Literals
+        unsigned int len = token >> 4;
+        if (len == 15) {
+            unsigned int b;
+            do {
+                if (ip >= iend) return LZ4_ERROR;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > (unsigned int)(iend - ip) || len > (unsigned int)(oend - op)) {
+            return LZ4_ERROR;
+        }
+        
+        if (len + 8 <= (unsigned int)(iend - ip) && len + 8 <= (unsigned int)(oend - op)) {
+            unsigned char* end = op + len;
+            do {
+                lz4_copy8(op, ip);
+                op += 8;
+                ip += 8;
+            } while (op < end);
+            ip -= op - end;
+            op = end;
+        } else {
+            memcpy(op, ip, len);
+            op += len;
+            ip += len;
+        }
+        
+        // The last sequence has literals only
+        if (ip == iend) break;
+        
+        // Match
+        if (iend - ip < 2) return LZ4_ERROR;
+        unsigned int offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (unsigned int)(op - out)) return LZ4_ERROR;
+        
+        len = token & 15;
+        if (len == 15) {
+            unsigned int b;
+            do {
+                if (ip >= iend) return LZ4_ERROR;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += LZ4_MIN_MATCH;
+        if (len > (unsigned int)(oend - op)) return LZ4_ERROR;
+        
+        const unsigned char* match = op - offset;
+        unsigned char* end = op + len;
+        
+        if (len + 16 <= (unsigned int)(oend - op)) {
+            if (offset < 8) {
+                // Spread the repeating pattern over the first 8 bytes and
+                // step match back so it trails op by a multiple of offset
+                // that is at least 8, then copy words as usual
+                op[0] = match[0];
+                op[1] = match[1];
+                op[2] = match[2];
+                op[3] = match[3];
+                match += lz4_inc[offset];
+                ((lz4_u32_t*)(op + 4))->v = ((const lz4_u32_t*)match)->v;
+                match -= lz4_dec[offset];
+                op += 8;
+            }
+            while (op < end) {
+                lz4_copy8(op, match);
+                op += 8;
+                match += 8;
+            }
+            op = end;
+        } else {
+            while (op < end) *op++ = *match++;
+        }
+    }
+    
+    return op - (out + out_pos);
+}
+
+// Makes room for need more output bytes plus a terminating NUL
+static int lz4_reserve(lz4_frame_t* f, unsigned int need) {
+    if (f->out_cap - f->out_len > need) return LZ4_OK;
+    
+    unsigned int cap = f->out_cap * 2;
+    if (cap < f->out_len + need + 1) cap = f->out_len + need + 1;
+    
+    unsigned int pages = (cap + PAGE_SIZE - 1) / PAGE_SIZE;
+    unsigned char* out = (unsigned char*)page_alloc_run(pages);
+    if (!out) return LZ4_NO_MEM;
+    
+    if (f->out) {
+        memcpy(out, f->out, f->out_len);
+        page_free(f->out);
+    }
+    f->out = out;
+    f->out_cap = pages * PAGE_SIZE;
+    return LZ4_OK;
+}
+
+int lz4_frame_feed(lz4_frame_t* f, const unsigned char* in, unsigned int avail) {
+    while (1) {
+        unsigned int left = avail - f->pos;
+        const unsigned char* p = in + f->pos;
+        
+        switch (f->state) {
+        case LZ4_ST_MAGIC: {
+            if (left < 4) return LZ4_OK;
+            unsigned int magic = lz4_read32(p);
+            
+            if (magic == LZ4_MAGIC) {
+                f->state = LZ4_ST_HEADER;
+            } else if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE) {
+                f->state = LZ4_ST_SKIP;
+            } else {
+                return LZ4_ERROR;
+            }
+            f->pos += 4;
+            break;
+        }
+        
+        case LZ4_ST_SKIP: {
+            if (left < 4 || left - 4 < lz4_read32(p)) return LZ4_OK;
+            f->pos += 4 + lz4_read32(p);
+            f->state = LZ4_ST_MAGIC;
+            break;
+        }
+        
+        case LZ4_ST_HEADER: {
+            if (left < 2) return LZ4_OK;
+            unsigned int flg = p[0];
+            unsigned int bd = (p[1] >> 4) & 7;
+            unsigned int size = 3;
+            
+            if ((flg >> 6) != 1 || bd < 4) return LZ4_ERROR;
+            if (flg & LZ4_FLG_DICT_ID) return LZ4_ERROR;
+            if (flg & LZ4_FLG_CONTENT_SIZE) size += 8;
+            if (left < size) return LZ4_OK;
+            
+            f->flags = flg;
+            f->block_max = 1u << (2 * bd + 8);
+            f->content_end = 0;
+            
+            if (flg & LZ4_FLG_CONTENT_SIZE) {
+                unsigned int content = lz4_read32(p + 2);
+                if (lz4_read32(p + 6) != 0) return LZ4_ERROR;
+                
+                f->content_end = f->out_len + content;
+                if (lz4_reserve(f, content) != LZ4_OK) return LZ4_NO_MEM;
+            }
+            
+            f->pos += size;
+            f->state = LZ4_ST_BLOCK;
+            break;
+        }
+        
+        case LZ4_ST_BLOCK: {
+            if (left < 4) return LZ4_OK;
+            unsigned int word = lz4_read32(p);
+            unsigned int size = word & 0x7FFFFFFF;
+            
+            if (word == 0) {
+                f->pos += 4;
+                f->state = LZ4_ST_TRAILER;
+                break;
+            }
+            if (size > f->block_max) return LZ4_ERROR;
+            
+            unsigned int total = 4 + size + (f->flags & LZ4_FLG_BLOCK_CHECKSUM ? 4 : 0);
+            if (left < total) return LZ4_OK;
+            
+            unsigned int need = (word & 0x80000000) ? size : f->block_max;
+            if (f->content_end && need > f->content_end - f->out_len) {
+                need = f->content_end - f->out_len;
+            }
+            if (lz4_reserve(f, need) != LZ4_OK) return LZ4_NO_MEM;
+            
+            if (word & 0x80000000) {
+                if (size > need) return LZ4_ERROR;
+                memcpy(f->out + f->out_len, p + 4, size);
+                f->out_len += size;
+            } else {
+                // Independent blocks could drop the history, but keeping it
+                // costs nothing here since all output stays in one buffer
+                int n = lz4_decompress_block(p + 4, size, f->out, f->out_len, f->out_len + need);
+                if (n < 0) return LZ4_ERROR;
+                f->out_len += n;
+            }
+            
+            f->pos += total;
+            break;
+        }
+        
+        case LZ4_ST_TRAILER: {
+            unsigned int size = f->flags & LZ4_FLG_CONTENT_CHECKSUM ? 4 : 0;
+            if (left < size) return LZ4_OK;
+            if (f->content_end && f->out_len != f->content_end) return LZ4_ERROR;
+            if (lz4_reserve(f, 0) != LZ4_OK) return LZ4_NO_MEM;
+            
+            f->pos += size;
+            f->frames++;
+            f->state = LZ4_ST_MAGIC;
+            break;
+        }
+        }
+    }
+}
+
+// True once total input bytes have been consumed and ended on a frame
+int lz4_frame_done(lz4_frame_t* f, unsigned int total) {
+    return f->frames > 0 && f->state == LZ4_ST_MAGIC && f->pos == total;
+}
+
+void lz4_frame_discard(lz4_frame_t* f) {
+    page_free(f->out);
+    f->out = 0;
+    f->out_len = 0;
+    f->out_cap = 0;
+}
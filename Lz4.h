@@ -0,0 +1,37 @@
+/*
+ * lz4.h - Streaming LZ4 frame decoder
+ */
+
+#ifndef LZ4_H
+#define LZ4_H
+
+#define LZ4_OK       0
+#define LZ4_ERROR   -1
+#define LZ4_NO_MEM  -2
+
+#define LZ4_MAGIC    0x184D2204
+
+typedef struct {
+    int state;
+    unsigned int pos;               // Next input byte to decode
+    unsigned int frames;            // Frames completed
+    unsigned int flags;             // FLG byte of the current frame
+    unsigned int block_max;
+    unsigned int content_end;       // Output size when the frame says so, else 0
+    
+    // Decompressed data, from page_alloc_run(); owned by the caller once
+    // the frame is done. There is always room for a NUL after out_len.
+    unsigned char* out;
+    unsigned int out_len;
+    unsigned int out_cap;
+} lz4_frame_t;
+
+int lz4_is_frame(const unsigned char* data, unsigned int len);
+void lz4_frame_init(lz4_frame_t* f);
+int lz4_frame_feed(lz4_frame_t* f, const unsigned char* in, unsigned int avail);
+int lz4_frame_done(lz4_frame_t* f, unsigned int total);
+void lz4_frame_discard(lz4_frame_t* f);
+int lz4_decompress_block(const unsigned char* src, unsigned int src_len,
+                         unsigned char* out, unsigned int out_pos, unsigned int out_cap);
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * mailbox.c - VideoCore mailbox property interface
+ */
+
+#include "mailbox.h"
+#include "mmu.h"
+#include "irq.h"
+#include "smp.h"
+
+// Mailbox 0 registers (Raspberry Pi 2/3)
+#define MBOX_BASE       0x3F00B880
+#define MBOX_READ       ((volatile unsigned int*)(MBOX_BASE + 0x00))
+#define MBOX_STATUS     ((volatile unsigned int*)(MBOX_BASE + 0x18))
+#define MBOX_WRITE      ((volatile unsigned int*)(MBOX_BASE + 0x20))
+
+#define MBOX_FULL       0x80000000
+#define MBOX_EMPTY      0x40000000
+
+// The GPU sees ARM RAM through the L2-uncached bus alias
+#define BUS_ALIAS       0xC0000000
+
+static volatile unsigned int prop_buffer[36] __attribute__((aligned(16)));
+static spinlock_t mbox_lock = 0;
+
+// Send a 16-byte aligned message and wait for the reply in place
+int mbox_call(unsigned int channel, volatile unsigned int* buffer) {
+    unsigned int message = ((unsigned long)buffer | BUS_ALIAS) | (channel & 0xF);
+    
+    // The GPU reads and writes memory behind the data cache
+    mmu_clean_dcache((const void*)buffer, buffer[0]);
+    
+    while (*MBOX_STATUS & MBOX_FULL) { }
+    *MBOX_WRITE = message;
+    
+    while (1) {
+        while (*MBOX_STATUS & MBOX_EMPTY) { }
+        if (*MBOX_READ == message) break;
+    }
+    
+    mmu_invalidate_dcache((const void*)buffer, buffer[0]);
+    return buffer[1] == MBOX_RESPONSE_OK ? 0 : -1;
+}
+
+// Issue a single property tag; 'values' holds the request and receives
+// the response (up to 32 words)
+int mbox_property(unsigned int tag, unsigned int* values, unsigned int count) {
+    if (count > 32) return -1;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&mbox_lock);
+    
+    prop_buffer[0] = (count + 6) * 4;
+    prop_buffer[1] = MBOX_REQUEST;
+    prop_buffer[2] = tag;
+    prop_buffer[3] = count * 4;
+    prop_buffer[4] = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        prop_buffer[5 + i] = values[i];
+    }
+    prop_buffer[5 + count] = MBOX_TAG_END;
+    
+    int result = mbox_call(MBOX_CH_PROP, prop_buffer);
+    if (result == 0 && !(prop_buffer[4] & MBOX_RESPONSE_OK)) {
+        result = -1;
+    }
+    for (unsigned int i = 0; i < count; i++) {
+        values[i] = prop_buffer[5 + i];
+    }
+    
+    spin_unlock(&mbox_lock);
+    irq_restore(flags);
+    return result;
+}
@@ -0,0 +1,44 @@
+/*
+ * mailbox.h - VideoCore mailbox property interface header
+ */
+
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#define MBOX_CH_PROP        8
+
+// Property tags
+#define MBOX_TAG_END            0x00000000
+#define MBOX_TAG_GET_CLOCK_RATE 0x00030002
+#define MBOX_TAG_GET_MAX_CLOCK_RATE 0x00030004
+#define MBOX_TAG_GET_TEMPERATURE 0x00030006
+#define MBOX_TAG_GET_MIN_CLOCK_RATE 0x00030007
+#define MBOX_TAG_GET_MAX_TEMPERATURE 0x0003000A
+#define MBOX_TAG_GET_THROTTLED  0x00030046
+#define MBOX_TAG_GET_CLOCK_RATE_MEASURED 0x00030047
+#define MBOX_TAG_SET_CLOCK_RATE 0x00038002
+#define MBOX_TAG_ALLOCATE_FB    0x00040001
+#define MBOX_TAG_GET_PITCH      0x00040008
+#define MBOX_TAG_SET_PHYS_WH    0x00048003
+#define MBOX_TAG_SET_VIRT_WH    0x00048004
+#define MBOX_TAG_SET_DEPTH      0x00048005
+#define MBOX_TAG_SET_PIXEL_ORDER 0x00048006
+#define MBOX_TAG_SET_VIRT_OFFSET 0x00048009
+
+// Clock ids for the clock rate tags
+#define MBOX_CLOCK_UART     2
+#define MBOX_CLOCK_ARM      3
+
+// GET_THROTTLED bits (the same bits << 16 are sticky since boot)
+#define MBOX_THROTTLED_UNDERVOLT    (1 << 0)
+#define MBOX_THROTTLED_CAPPED       (1 << 1)
+#define MBOX_THROTTLED_ACTIVE       (1 << 2)
+#define MBOX_THROTTLED_SOFT_TEMP    (1 << 3)
+
+#define MBOX_REQUEST        0x00000000
+#define MBOX_RESPONSE_OK    0x80000000
+
+int mbox_call(unsigned int channel, volatile unsigned int* buffer);
+int mbox_property(unsigned int tag, unsigned int* values, unsigned int count);
+
+#endif
@@ -4,28 +4,159 @@
 
 #include "memory.h"
 #include "uart.h"
+#include "irq.h"
+#include "smp.h"
+#include "timer.h"
 
 // Heap starts at 16MB
 #define HEAP_START 0x1000000
 #define HEAP_SIZE  0x1000000  // 16MB heap
 
+// Allocation alignment: a word on ARM, AAPCS64's 16 bytes on AArch64
+#ifdef __aarch64__
+#define HEAP_ALIGN 16
+#else
+#define HEAP_ALIGN 4
+#endif
+
 static unsigned char* heap_current = (unsigned char*)HEAP_START;
 static unsigned char* heap_end = (unsigned char*)(HEAP_START + HEAP_SIZE);
+static spinlock_t heap_lock = 0;
+
+#ifdef MEMPROF
+// Allocation profiler (make MEMPROF=1). Every block gets a header naming
+// its call site, so free() can charge it back; the per-site counters
+// live in a fixed open-addressed table here, never on the heap itself.
+// Sites that do not fit share the last slot. Sizes are bucketed by
+// powers of four from <=16 bytes up to >64KB.
+#define MEMPROF_SITES   256
+#define MEMPROF_BUCKETS 8
+#define MEMPROF_MAGIC   0xA5
+#define MEMPROF_HEADER  ((sizeof(memprof_header_t) + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1))
+
+typedef struct {
+    unsigned short slot;
+    unsigned char gen;              // Blocks from before a reset are not charged
+    unsigned char magic;            // Cleared on free to catch double frees
+    unsigned int size;
+} memprof_header_t;
+
+typedef struct {
+    unsigned long site;             // Return address into the caller, 0 if unused
+    unsigned int allocs;
+    unsigned int frees;
+    unsigned int bytes;
+    unsigned int live;
+    unsigned int peak;
+    unsigned int sizes[MEMPROF_BUCKETS];
+} memprof_site_t;
+
+static memprof_site_t prof_sites[MEMPROF_SITES + 1];
+static unsigned int prof_used = 0;
+static unsigned int prof_allocs = 0;
+static unsigned int prof_frees = 0;
+static unsigned int prof_bad_frees = 0;
+static unsigned int prof_live = 0;
+static unsigned int prof_peak = 0;
+static unsigned int prof_start = 0;
+static unsigned char prof_gen = 0;
+
+// Called with heap_lock held
+static unsigned int memprof_slot(unsigned long site) {
+    unsigned int slot = ((unsigned int)(site >> 2) * 2654435761u) >> 24;
+    for (unsigned int probe = 0; probe < MEMPROF_SITES; probe++) {
+        memprof_site_t* entry = &prof_sites[slot];
+        if (entry->site == site) return slot;
+        if (entry->site == 0) {
+            if (prof_used == MEMPROF_SITES - MEMPROF_SITES / 4) break;
+            entry->site = site;
+            prof_used++;
+            return slot;
+        }
+        slot = (slot + 1) % MEMPROF_SITES;
+    }
+    return MEMPROF_SITES;
+}
+
+static void memprof_alloc(memprof_header_t* header, unsigned int size, unsigned long site) {
+    unsigned int slot = memprof_slot(site);
+    memprof_site_t* entry = &prof_sites[slot];
+    
+    unsigned int bucket = 0;
+    while (bucket < MEMPROF_BUCKETS - 1 && size > (16u << (2 * bucket))) bucket++;
+    
+    entry->allocs++;
+    entry->bytes += size;
+    entry->live += size;
+    if (entry->live > entry->peak) entry->peak = entry->live;
+    entry->sizes[bucket]++;
+    
+    prof_allocs++;
+    prof_live += size;
+    if (prof_live > prof_peak) prof_peak = prof_live;
+    
+    header->slot = slot;
+    header->gen = prof_gen;
+    header->magic = MEMPROF_MAGIC;
+    header->size = size;
+}
+
+static void memprof_free(memprof_header_t* header) {
+    if (header->magic != MEMPROF_MAGIC || header->slot > MEMPROF_SITES) {
+        prof_bad_frees++;
+        return;
+    }
+    header->magic = 0;
+    if (header->gen != prof_gen) return;
+    
+    memprof_site_t* entry = &prof_sites[header->slot];
+    entry->frees++;
+    entry->live -= header->size;
+    prof_frees++;
+    prof_live -= header->size;
+}
+#endif
+
+// Page pool above the heap. A bitmap marks pages in use and the first
+// page of each allocation records its length, so runs of contiguous
+// pages can be handed out and freed by address alone.
+#define PAGE_POOL_START 0x2000000
+#define PAGE_POOL_SIZE  0x1000000  // 16MB of 4KB pages
+#define PAGE_COUNT      (PAGE_POOL_SIZE / PAGE_SIZE)
+
+static unsigned int page_bitmap[PAGE_COUNT / 32];
+static unsigned short page_run[PAGE_COUNT];
+static unsigned int page_low = 0;      // No free page below this one
+static unsigned int pages_in_use = 0;
+static spinlock_t page_lock = 0;
+static page_reclaim_t page_reclaim = 0;
 
 void mem_init(void) {
     heap_current = (unsigned char*)HEAP_START;
     uart_puts("Memory initialized: ");
     uart_hex(HEAP_START);
     uart_puts(" - ");
-    uart_hex((unsigned int)heap_end);
+    uart_hex((unsigned long)heap_end);
+    uart_puts(", pages ");
+    uart_hex(PAGE_POOL_START);
+    uart_puts(" - ");
+    uart_hex(PAGE_POOL_START + PAGE_POOL_SIZE);
     uart_puts("\n");
 }
 
 void* malloc(unsigned int size) {
-    // Align to 4-byte boundary
-    size = (size + 3) & ~3;
+#ifdef MEMPROF
+    unsigned int requested = size;
+    size += MEMPROF_HEADER;
+#endif
+    size = (size + HEAP_ALIGN - 1) & ~(HEAP_ALIGN - 1);
+    
+    unsigned int flags = irq_save();
+    spin_lock(&heap_lock);
     
     if (heap_current + size > heap_end) {
+        spin_unlock(&heap_lock);
+        irq_restore(flags);
         uart_puts("ERROR: Out of memory!\n");
         return 0;
     }
@@ -33,17 +164,279 @@ void* malloc(unsigned int size) {
     void* ptr = heap_current;
     heap_current += size;
     
+#ifdef MEMPROF
+    memprof_alloc((memprof_header_t*)ptr, requested, (unsigned long)__builtin_return_address(0));
+    ptr = (unsigned char*)ptr + MEMPROF_HEADER;
+#endif
+    
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
+    
     return ptr;
 }
 
 void free(void* ptr) {
     // Simple allocator doesn't support free
     // In a real OS, you'd implement a proper allocator
+#ifdef MEMPROF
+    // ...but the profiler still counts what callers give back
+    unsigned char* block = (unsigned char*)ptr;
+    if (block < (unsigned char*)HEAP_START + MEMPROF_HEADER || block >= heap_end) return;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&heap_lock);
+    if (block <= heap_current) {
+        memprof_free((memprof_header_t*)(block - MEMPROF_HEADER));
+    }
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
+#else
     (void)ptr;
+#endif
+}
+
+#ifdef MEMPROF
+
+// Forget all counters. Blocks allocated before the reset are no longer
+// charged when they are freed.
+void memprof_reset(void) {
+    unsigned int flags = irq_save();
+    spin_lock(&heap_lock);
+    memset(prof_sites, 0, sizeof(prof_sites));
+    prof_used = 0;
+    prof_allocs = 0;
+    prof_frees = 0;
+    prof_bad_frees = 0;
+    prof_live = 0;
+    prof_peak = 0;
+    prof_start = timer_ticks();
+    prof_gen++;
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
+}
+
+static unsigned int memprof_key(const memprof_site_t* entry, int order) {
+    if (order == MEMPROF_BY_PEAK) return entry->peak;
+    if (order == MEMPROF_BY_ALLOCS) return entry->allocs;
+    return entry->live;
+}
+
+// Allocations per second over 'elapsed' microseconds (the 32-bit system
+// timer, so windows longer than about 71 minutes wrap)
+static unsigned int memprof_rate(unsigned int allocs, unsigned int elapsed) {
+    unsigned int centis = elapsed / 10000;
+    if (centis == 0) return 0;
+    if (allocs > 0xFFFFFFFF / 100) return allocs / (centis / 100 + 1);
+    return allocs * 100 / centis;
+}
+
+// Print the top 'count' call sites by live bytes, peak bytes or number
+// of allocations. Look the addresses up in kernel.list (make disasm).
+void memprof_report(int order, unsigned int count) {
+    memprof_site_t top[MEMPROF_TOP];
+    unsigned int found = 0;
+    if (count > MEMPROF_TOP) count = MEMPROF_TOP;
+    
+    // Pick the winners under the lock, print after it
+    unsigned int flags = irq_save();
+    spin_lock(&heap_lock);
+    for (unsigned int i = 0; i <= MEMPROF_SITES; i++) {
+        const memprof_site_t* entry = &prof_sites[i];
+        if (entry->allocs == 0) continue;
+    
+        unsigned int key = memprof_key(entry, order);
+        unsigned int pos = found < count ? found : count;
+        while (pos > 0 && memprof_key(&top[pos - 1], order) < key) pos--;
+        if (pos >= count) continue;
+    
+        unsigned int last = found < count ? found : count - 1;
+        for (unsigned int j = last; j > pos; j--) top[j] = top[j - 1];
+        top[pos] = *entry;
+        if (found < count) found++;
+    }
+    unsigned int allocs = prof_allocs;
+    unsigned int frees = prof_frees;
+    unsigned int bad_frees = prof_bad_frees;
+    unsigned int live = prof_live;
+    unsigned int peak = prof_peak;
+    unsigned int sites = prof_used;
+    unsigned int elapsed = timer_ticks() - prof_start;
+    spin_unlock(&heap_lock);
+    irq_restore(flags);
+    
+    uart_puts("Heap profile over ");
+    uart_dec(elapsed / 1000000);
+    uart_puts("s: ");
+    uart_dec(allocs);
+    uart_puts(" allocs (");
+    uart_dec(memprof_rate(allocs, elapsed));
+    uart_puts("/s), ");
+    uart_dec(frees);
+    uart_puts(" frees, ");
+    uart_dec(bad_frees);
+    uart_puts(" bad frees, ");
+    uart_dec(sites);
+    uart_puts(" sites\n  Live ");
+    uart_dec(live);
+    uart_puts(" bytes, peak ");
+    uart_dec(peak);
+    uart_puts(" bytes\n");
+    
+    uart_puts("Site        Allocs     Rate/s     Frees      Live       Peak       Bytes\n");
+    for (unsigned int i = 0; i < found; i++) {
+        const memprof_site_t* entry = &top[i];
+        unsigned int values[6] = {
+            entry->allocs, memprof_rate(entry->allocs, elapsed), entry->frees,
+            entry->live, entry->peak, entry->bytes
+        };
+    
+        if (entry->site) {
+            uart_hex(entry->site);
+        } else {
+            uart_puts("(other)   ");
+        }
+        for (unsigned int v = 0; v < 6; v++) {
+            // Columns are 11 characters wide
+            unsigned int digits = 1;
+            for (unsigned int n = values[v]; n >= 10; n /= 10) digits++;
+            uart_puts("  ");
+            uart_dec(values[v]);
+            for (unsigned int pad = digits; pad < 9 && v < 5; pad++) uart_putc(' ');
+        }
+        uart_puts("\n    sizes:");
+        for (unsigned int b = 0; b < MEMPROF_BUCKETS; b++) {
+            if (entry->sizes[b] == 0) continue;
+            uart_puts(b == MEMPROF_BUCKETS - 1 ? " >" : " <=");
+            unsigned int limit = 16u << (2 * (b == MEMPROF_BUCKETS - 1 ? b - 1 : b));
+            if (limit >= 1024) {
+                uart_dec(limit / 1024);
+                uart_putc('K');
+            } else {
+                uart_dec(limit);
+            }
+            uart_putc(':');
+            uart_dec(entry->sizes[b]);
+        }
+        uart_puts("\n");
+    }
+}
+
+#endif
+
+static int page_busy(unsigned int n) {
+    return page_bitmap[n / 32] & (1u << (n % 32));
+}
+
+// First fit over the bitmap, skipping fully used words
+static void* page_take(unsigned int count) {
+    unsigned int flags = irq_save();
+    spin_lock(&page_lock);
+    
+    void* page = 0;
+    unsigned int start = page_low;
+    
+    while (start + count <= PAGE_COUNT) {
+        if ((start % 32) == 0 && page_bitmap[start / 32] == 0xFFFFFFFF) {
+            start += 32;
+            continue;
+        }
+        if (page_busy(start)) {
+            start++;
+            continue;
+        }
+        
+        unsigned int len = 1;
+        while (len < count && !page_busy(start + len)) len++;
+        
+        if (len == count) {
+            for (unsigned int n = start; n < start + count; n++) {
+                page_bitmap[n / 32] |= 1u << (n % 32);
+            }
+            page_run[start] = count;
+            pages_in_use += count;
+            if (start == page_low) page_low += count;
+            page = (void*)(PAGE_POOL_START + (unsigned long)start * PAGE_SIZE);
+            break;
+        }
+        start += len;
+    }
+    
+    spin_unlock(&page_lock);
+    irq_restore(flags);
+    
+    return page;
+}
+
+// When the pool runs dry, ask the reclaim hook (evictable file view
+// pages) to give some back and try again while it makes progress
+void* page_alloc_run(unsigned int count) {
+    if (count == 0 || count > PAGE_COUNT) return 0;
+    
+    void* page = page_take(count);
+    while (!page && page_reclaim && page_reclaim(count) > 0) {
+        page = page_take(count);
+    }
+    return page;
+}
+
+void page_set_reclaim(page_reclaim_t reclaim) {
+    page_reclaim = reclaim;
 }
 
+void* page_alloc(void) {
+    return page_alloc_run(1);
+}
+
+// Frees a whole allocation given its first page
+void page_free(void* page) {
+    if (!page) return;
+    
+    unsigned int start = ((unsigned long)page - PAGE_POOL_START) / PAGE_SIZE;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&page_lock);
+    
+    unsigned int count = page_run[start];
+    for (unsigned int n = start; n < start + count; n++) {
+        page_bitmap[n / 32] &= ~(1u << (n % 32));
+    }
+    page_run[start] = 0;
+    pages_in_use -= count;
+    if (start < page_low) page_low = start;
+    
+    spin_unlock(&page_lock);
+    irq_restore(flags);
+}
+
+int page_owned(const void* ptr) {
+    unsigned long addr = (unsigned long)ptr;
+    return addr >= PAGE_POOL_START && addr < PAGE_POOL_START + PAGE_POOL_SIZE;
+}
+
+// Word loops use unsigned long: 4 bytes on ARM, 8 on AArch64
+#define WORD_MASK (sizeof(unsigned long) - 1)
+
 void* memset(void* dest, int val, unsigned int len) {
     unsigned char* ptr = (unsigned char*)dest;
+    
+    while (((unsigned long)ptr & WORD_MASK) && len > 0) {
+        *ptr++ = (unsigned char)val;
+        len--;
+    }
+    
+    // Fill whole words once aligned
+    unsigned long word = (unsigned char)val * (~0UL / 0xFF);
+    unsigned long* wptr = (unsigned long*)ptr;
+    while (len >= 4 * sizeof(unsigned long)) {
+        wptr[0] = word;
+        wptr[1] = word;
+        wptr[2] = word;
+        wptr[3] = word;
+        wptr += 4;
+        len -= 4 * sizeof(unsigned long);
+    }
+    ptr = (unsigned char*)wptr;
+    
     while (len-- > 0) {
         *ptr++ = (unsigned char)val;
     }
@@ -53,12 +446,56 @@ void* memset(void* dest, int val, unsigned int len) {
 void* memcpy(void* dest, const void* src, unsigned int len) {
     unsigned char* d = (unsigned char*)dest;
     const unsigned char* s = (const unsigned char*)src;
+    
+    // Copy words when both pointers can be aligned together
+    if ((((unsigned long)d ^ (unsigned long)s) & WORD_MASK) == 0) {
+        while (((unsigned long)d & WORD_MASK) && len > 0) {
+            *d++ = *s++;
+            len--;
+        }
+        
+        unsigned long* dw = (unsigned long*)d;
+        const unsigned long* sw = (const unsigned long*)s;
+        while (len >= 4 * sizeof(unsigned long)) {
+            dw[0] = sw[0];
+            dw[1] = sw[1];
+            dw[2] = sw[2];
+            dw[3] = sw[3];
+            dw += 4;
+            sw += 4;
+            len -= 4 * sizeof(unsigned long);
+        }
+        while (len >= sizeof(unsigned long)) {
+            *dw++ = *sw++;
+            len -= sizeof(unsigned long);
+        }
+        d = (unsigned char*)dw;
+        s = (const unsigned char*)sw;
+    }
+    
     while (len-- > 0) {
         *d++ = *s++;
     }
     return dest;
 }
 
+void* memmove(void* dest, const void* src, unsigned int len) {
+    unsigned char* d = (unsigned char*)dest;
+    const unsigned char* s = (const unsigned char*)src;
+    
+    // memcpy copies forwards, which is safe unless dest overlaps above src
+    if (d <= s || d >= s + len) {
+        return memcpy(dest, src, len);
+    }
+    
+    d += len;
+    s += len;
+    while (len-- > 0) {
+        *--d = *--s;
+    }
+    return dest;
+}
+
 unsigned int mem_used(void) {
     return (unsigned int)(heap_current - (unsigned char*)HEAP_START);
 }
@@ -66,3 +503,11 @@ unsigned int mem_used(void) {
 unsigned int mem_available(void) {
     return (unsigned int)(heap_end - heap_current);
 }
+
+unsigned int page_used(void) {
+    return pages_in_use;
+}
+
+unsigned int page_total(void) {
+    return PAGE_COUNT;
+}
@@ -5,12 +5,35 @@
 #ifndef MEMORY_H
 #define MEMORY_H
 
+#define PAGE_SIZE 4096
+
+// Frees up to 'count' pages when the pool is exhausted, returns how many.
+// May be called from any context that can call page_alloc().
+typedef unsigned int (*page_reclaim_t)(unsigned int count);
+
 void mem_init(void);
 void* malloc(unsigned int size);
 void free(void* ptr);
 void* memset(void* dest, int val, unsigned int len);
 void* memcpy(void* dest, const void* src, unsigned int len);
+void* memmove(void* dest, const void* src, unsigned int len);
 unsigned int mem_used(void);
 unsigned int mem_available(void);
+void* page_alloc(void);
+void* page_alloc_run(unsigned int count);
+void page_free(void* page);
+void page_set_reclaim(page_reclaim_t reclaim);
+int page_owned(const void* ptr);
+unsigned int page_used(void);
+unsigned int page_total(void);
+
+// Allocation profiler, built with make MEMPROF=1 (see memory.c)
+#define MEMPROF_BY_LIVE     0
+#define MEMPROF_BY_PEAK     1
+#define MEMPROF_BY_ALLOCS   2
+#define MEMPROF_TOP         16
+
+void memprof_report(int order, unsigned int count);
+void memprof_reset(void);
 
 #endif
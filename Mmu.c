@@ -0,0 +1,342 @@
+/*
+ * mmu.c - Identity-mapped MMU setup with caches enabled
+ *
+ * RAM is mapped as normal, write-back cacheable, shareable memory with
+ * 1MB sections (2MB blocks on AArch64); the peripheral window is mapped
+ * as device memory. Exclusive loads/stores (spinlocks) need the MMU on.
+ *
+ * Above RAM, a window of 4KB pages holds demand-paged views (fat32_mmap):
+ * pages are mapped read-only one at a time when a data abort asks for
+ * them, and unmapped again when they are evicted.
+ */
+
+#include "mmu.h"
+#include "uart.h"
+#include "irq.h"
+#include "smp.h"
+#include "memory.h"
+
+#define PERIPHERAL_BASE     0x3F000000
+#define LOCAL_PERIPH_END    0x40100000
+
+#ifdef __aarch64__
+
+// Long-descriptor block and table entries (4KB granule)
+#define PT_TABLE            (3 << 0)
+#define PT_BLOCK            (1 << 0)
+#define PT_ATTR(i)          ((i) << 2)      // MAIR_EL1 slot
+#define PT_SH_INNER         (3 << 8)
+#define PT_AF               (1 << 10)
+#define PT_XN               (3UL << 53)     // PXN and UXN
+
+// MAIR_EL1 slots: 0 write-back, 1 device nGnRnE, 2 write-through
+#define MAIR_VALUE          (0xFFUL | (0x00UL << 8) | (0xBBUL << 16))
+
+#define SECT_NORMAL         (PT_BLOCK | PT_ATTR(0) | PT_SH_INNER | PT_AF)
+#define SECT_WRITETHROUGH   (PT_BLOCK | PT_ATTR(2) | PT_SH_INNER | PT_AF)
+#define SECT_DEVICE         (PT_BLOCK | PT_ATTR(1) | PT_AF | PT_XN)
+
+// TCR_EL1: 4GB from TTBR0 (T0SZ 32, walks start at level 1), 4KB
+// granule, write-back shareable walks, TTBR1 walks disabled
+#define TCR_VALUE           (32 | (1 << 8) | (1 << 10) | (3 << 12) | (1UL << 23))
+
+// Level 2 tables for the first 2GB, 2MB per entry
+#define SECT_SHIFT          21
+#define SECT_COUNT          1024
+
+// Level 3 read-only page for views
+#define PT_PAGE             (3 << 0)
+#define PT_AP_RO            (2 << 6)
+#define PAGE_VIEW           (PT_PAGE | PT_ATTR(0) | PT_SH_INNER | PT_AF | PT_AP_RO | PT_XN)
+
+typedef unsigned long pte_t;
+
+static pte_t page_dir[4] __attribute__((aligned(4096)));
+static pte_t* view_dir = 0;         // Level 2 table for the view window
+
+#else
+
+// Short-descriptor section entry bits
+#define SECT                (2 << 0)
+#define SECT_B              (1 << 2)
+#define SECT_C              (1 << 3)
+#define SECT_XN             (1 << 4)
+#define SECT_AP_RW          (3 << 10)
+#define SECT_TEX(x)         ((x) << 12)
+#define SECT_S              (1 << 16)
+
+#define SECT_NORMAL         (SECT | SECT_TEX(1) | SECT_C | SECT_B | SECT_AP_RW | SECT_S)
+#define SECT_WRITETHROUGH   (SECT | SECT_C | SECT_AP_RW | SECT_S)
+#define SECT_DEVICE         (SECT | SECT_B | SECT_AP_RW | SECT_XN)
+
+// TTBR0: inner/outer write-back write-allocate, shareable table walks
+#define TTBR_FLAGS          0x4A
+
+// One level, 1MB per entry
+#define SECT_SHIFT          20
+#define SECT_COUNT          4096
+
+// Coarse page table (1KB, 256 entries) and read-only small pages for views
+#define COARSE              (1 << 0)
+#define PAGE_SMALL_XN       (3 << 0)
+#define PAGE_B              (1 << 2)
+#define PAGE_C              (1 << 3)
+#define PAGE_AP_RO          ((1 << 4) | (1 << 9))
+#define PAGE_TEX(x)         ((x) << 6)
+#define PAGE_S              (1 << 10)
+#define PAGE_VIEW           (PAGE_SMALL_XN | PAGE_TEX(1) | PAGE_C | PAGE_B | PAGE_AP_RO | PAGE_S)
+
+typedef unsigned int pte_t;
+
+#endif
+
+#define CACHE_LINE          64
+
+static pte_t page_table[SECT_COUNT] __attribute__((aligned(16384)));
+
+static mmu_fault_t view_fault = 0;
+
+// Build the translation table and enable it on the boot core
+void mmu_init(void) {
+    for (unsigned int i = 0; i < SECT_COUNT; i++) {
+        unsigned long base = (unsigned long)i << SECT_SHIFT;
+        if (base < PERIPHERAL_BASE) {
+            page_table[i] = base | SECT_NORMAL;
+        } else if (base < LOCAL_PERIPH_END) {
+            page_table[i] = base | SECT_DEVICE;
+        } else {
+            page_table[i] = 0;      // Fault
+        }
+    }
+#ifdef __aarch64__
+    page_dir[0] = (unsigned long)&page_table[0] | PT_TABLE;
+    page_dir[1] = (unsigned long)&page_table[512] | PT_TABLE;
+#endif
+    
+    mmu_enable();
+    uart_puts("MMU enabled, caches on\n");
+}
+
+#ifdef __aarch64__
+
+// Enable the shared translation table on the calling core
+void mmu_enable(void) {
+    unsigned long r;
+    
+    asm volatile("tlbi vmalle1\n\tic iallu\n\tdsb sy\n\tisb" ::: "memory");
+    
+    asm volatile("msr mair_el1, %0" :: "r"(MAIR_VALUE));
+    asm volatile("msr tcr_el1, %0" :: "r"(TCR_VALUE));
+    asm volatile("msr ttbr0_el1, %0" :: "r"((unsigned long)page_dir));
+    asm volatile("dsb sy\n\tisb" ::: "memory");
+    
+    // MMU, data cache, instruction cache; allow unaligned access
+    asm volatile("mrs %0, sctlr_el1" : "=r"(r));
+    r |= (1 << 0) | (1 << 2) | (1 << 12);
+    r &= ~(1 << 1);
+    asm volatile("msr sctlr_el1, %0" :: "r"(r));
+    asm volatile("dsb sy\n\tisb" ::: "memory");
+}
+
+#else
+
+// Enable the shared translation table on the calling core
+void mmu_enable(void) {
+    unsigned int r;
+    
+    // Invalidate TLBs and the instruction cache
+    asm volatile("mcr p15, 0, %0, c8, c7, 0" :: "r"(0));
+    asm volatile("mcr p15, 0, %0, c7, c5, 0" :: "r"(0));
+    
+    // All domains are clients, TTBR0 covers the whole address space
+    asm volatile("mcr p15, 0, %0, c3, c0, 0" :: "r"(0x55555555));
+    asm volatile("mcr p15, 0, %0, c2, c0, 2" :: "r"(0));
+    asm volatile("mcr p15, 0, %0, c2, c0, 0" :: "r"((unsigned int)page_table | TTBR_FLAGS));
+    asm volatile("dsb\n\tisb" ::: "memory");
+    
+    // MMU, data cache, branch prediction, instruction cache; allow unaligned access
+    asm volatile("mrc p15, 0, %0, c1, c0, 0" : "=r"(r));
+    r |= (1 << 0) | (1 << 2) | (1 << 11) | (1 << 12);
+    r &= ~(1 << 1);
+    asm volatile("mcr p15, 0, %0, c1, c0, 0" :: "r"(r));
+    asm volatile("dsb\n\tisb" ::: "memory");
+}
+
+#endif
+
+// Write dirty lines back to memory before a bus master reads them
+void mmu_clean_dcache(const void* addr, unsigned int len) {
+    unsigned long p = (unsigned long)addr & ~(CACHE_LINE - 1);
+    unsigned long end = (unsigned long)addr + len;
+    for (; p < end; p += CACHE_LINE) {
+#ifdef __aarch64__
+        asm volatile("dc cvac, %0" :: "r"(p));
+#else
+        asm volatile("mcr p15, 0, %0, c7, c10, 1" :: "r"(p));
+#endif
+    }
+    asm volatile("dsb sy" ::: "memory");
+}
+
+// Clean and invalidate lines so the next read sees what a bus master wrote
+void mmu_invalidate_dcache(const void* addr, unsigned int len) {
+    unsigned long p = (unsigned long)addr & ~(CACHE_LINE - 1);
+    unsigned long end = (unsigned long)addr + len;
+    for (; p < end; p += CACHE_LINE) {
+#ifdef __aarch64__
+        asm volatile("dc civac, %0" :: "r"(p));
+#else
+        asm volatile("mcr p15, 0, %0, c7, c14, 1" :: "r"(p));
+#endif
+    }
+    asm volatile("dsb sy" ::: "memory");
+}
+
+// Change the memory type of the sections covering [addr, addr+len),
+// e.g. write-through for the framebuffer
+void mmu_set_region(unsigned int addr, unsigned int len, int type) {
+    pte_t attrs = SECT_NORMAL;
+    if (type == MMU_WRITETHROUGH) attrs = SECT_WRITETHROUGH;
+    if (type == MMU_DEVICE) attrs = SECT_DEVICE;
+    
+    mmu_clean_dcache((const void*)(unsigned long)addr, len);
+    
+    unsigned int first = addr >> SECT_SHIFT;
+    unsigned int last = (addr + len - 1) >> SECT_SHIFT;
+    for (unsigned int i = first; i <= last && i < SECT_COUNT; i++) {
+        page_table[i] = ((pte_t)i << SECT_SHIFT) | attrs;
+    }
+    mmu_clean_dcache(&page_table[first], (last - first + 1) * sizeof(pte_t));
+    
+    // Invalidate TLBs on all cores (inner shareable)
+#ifdef __aarch64__
+    asm volatile("tlbi vmalle1is" ::: "memory");
+#else
+    asm volatile("mcr p15, 0, %0, c8, c3, 0" :: "r"(0));
+#endif
+    asm volatile("dsb sy\n\tisb" ::: "memory");
+}
+
+// Translation table entry for a page in a reserved part of the window
+static pte_t* view_pte(unsigned long addr) {
+#ifdef __aarch64__
+    pte_t* table = (pte_t*)(view_dir[(addr >> 21) & 511] & ~0xFFFUL);
+    return &table[(addr >> 12) & 511];
+#else
+    pte_t* table = (pte_t*)(unsigned long)(page_table[addr >> 20] & ~0x3FF);
+    return &table[(addr >> 12) & 255];
+#endif
+}
+
+static pte_t* view_table_alloc(void) {
+    pte_t* table = (pte_t*)page_alloc();
+    if (table) {
+        memset(table, 0, PAGE_SIZE);
+        mmu_clean_dcache(table, PAGE_SIZE);
+    }
+    return table;
+}
+
+// Make sure page tables exist for [addr, addr+len) in the view window.
+// They are kept for later views once allocated. Callers serialize.
+int mmu_view_reserve(unsigned long addr, unsigned int len) {
+    unsigned long end = addr + len;
+    
+#ifdef __aarch64__
+    if (!view_dir) {
+        pte_t* dir = view_table_alloc();
+        if (!dir) return -1;
+        view_dir = dir;
+        page_dir[MMU_VIEW_BASE >> 30] = (unsigned long)dir | PT_TABLE;
+        mmu_clean_dcache(&page_dir[MMU_VIEW_BASE >> 30], sizeof(pte_t));
+    }
+    for (unsigned long a = addr & ~0x1FFFFFUL; a < end; a += 0x200000) {
+        pte_t* entry = &view_dir[(a >> 21) & 511];
+        if (*entry) continue;
+    
+        pte_t* table = view_table_alloc();
+        if (!table) return -1;
+        *entry = (unsigned long)table | PT_TABLE;
+        mmu_clean_dcache(entry, sizeof(pte_t));
+    }
+#else
+    // One page holds the coarse tables of four consecutive sections
+    for (unsigned long a = addr & ~0x3FFFFFUL; a < end; a += 0x400000) {
+        unsigned int sect = a >> 20;
+        if (page_table[sect]) continue;
+    
+        pte_t* tables = view_table_alloc();
+        if (!tables) return -1;
+        for (unsigned int i = 0; i < 4; i++) {
+            page_table[sect + i] = ((unsigned long)tables + i * 1024) | COARSE;
+        }
+        mmu_clean_dcache(&page_table[sect], 4 * sizeof(pte_t));
+    }
+#endif
+    
+    asm volatile("isb" ::: "memory");
+    return 0;
+}
+
+// Map one physical page read-only at a reserved, unmapped view address
+void mmu_view_map(unsigned long addr, const void* page) {
+    pte_t* pte = view_pte(addr);
+    *pte = (unsigned long)page | PAGE_VIEW;
+    mmu_clean_dcache(pte, sizeof(pte_t));
+    asm volatile("isb" ::: "memory");
+}
+
+// Unmap a view page on all cores; accesses through the old mapping have
+// completed when this returns, so the page can be reused
+void mmu_view_unmap(unsigned long addr) {
+    pte_t* pte = view_pte(addr);
+    *pte = 0;
+    mmu_clean_dcache(pte, sizeof(pte_t));
+#ifdef __aarch64__
+    asm volatile("tlbi vaae1is, %0" :: "r"(addr >> 12) : "memory");
+#else
+    asm volatile("mcr p15, 0, %0, c8, c3, 3" :: "r"(addr & ~0xFFFUL) : "memory");
+#endif
+    asm volatile("dsb sy\n\tisb" ::: "memory");
+}
+
+void mmu_set_view_fault(mmu_fault_t handler) {
+    view_fault = handler;
+}
+
+// Called from the abort vector in boot.S with the faulting address, the
+// fault status (DFSR, or ESR_EL1 on AArch64) and the interrupted CPSR or
+// SPSR. Returning retries the access. Reads of unmapped view pages are
+// handed to the view fault handler with interrupts on, since it sleeps
+// on the card; anything else stops the core.
+void mmu_data_abort(unsigned long addr, unsigned long status, unsigned long flags) {
+#ifdef __aarch64__
+    int data = (status >> 26) == 0x25;
+    int translation = data && (status & 0x3C) == 0x04;
+    int write = (status >> 6) & 1;
+#else
+    unsigned int fs = (status & 0xF) | ((status >> 6) & 0x10);
+    int data = 1;
+    int translation = fs == 0x5 || fs == 0x7;
+    int write = (status >> 11) & 1;
+#endif
+    
+    if (translation && !write && view_fault && addr - MMU_VIEW_BASE < MMU_VIEW_SIZE &&
+        !(flags & (1 << 7))) {
+        irq_enable();
+        int result = view_fault(addr);
+        irq_disable();
+        if (result == 0) return;
+    }
+    
+    uart_puts(data ? "\nData abort at " : "\nException at ");
+    uart_hex(addr);
+    uart_puts(", status ");
+    uart_hex(status);
+    uart_puts(" on core ");
+    uart_dec(smp_core_id());
+    uart_puts(", halted\n");
+    while (1) {
+        asm volatile("wfe");
+    }
+}
@@ -0,0 +1,32 @@
+/*
+ * mmu.h - MMU and cache setup header
+ */
+
+#ifndef MMU_H
+#define MMU_H
+
+// Memory types for mmu_set_region()
+#define MMU_NORMAL          0
+#define MMU_WRITETHROUGH    1
+#define MMU_DEVICE          2
+
+// Virtual window above RAM for demand-paged file views (fat32_mmap)
+#define MMU_VIEW_BASE       0x80000000UL
+#define MMU_VIEW_SIZE       0x10000000UL    // 256MB
+
+// Maps the page containing addr; returns 0 to retry the access
+typedef int (*mmu_fault_t)(unsigned long addr);
+
+void mmu_init(void);
+void mmu_enable(void);
+void mmu_clean_dcache(const void* addr, unsigned int len);
+void mmu_invalidate_dcache(const void* addr, unsigned int len);
+void mmu_set_region(unsigned int addr, unsigned int len, int type);
+
+int mmu_view_reserve(unsigned long addr, unsigned int len);
+void mmu_view_map(unsigned long addr, const void* page);
+void mmu_view_unmap(unsigned long addr);
+void mmu_set_view_fault(mmu_fault_t handler);
+void mmu_data_abort(unsigned long addr, unsigned long status, unsigned long flags);
+
+#endif
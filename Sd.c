@@ -4,6 +4,9 @@
 
 #include "sd.h"
 #include "uart.h"
+#include "irq.h"
+#include "timer.h"
+#include "blk.h"
 
 // EMMC registers (Raspberry Pi 2/3)
 #define EMMC_BASE       0x3F300000
@@ -26,11 +29,41 @@
 #define EMMC_CONTROL2   ((volatile unsigned int*)(EMMC_BASE + 0x3C))
 #define EMMC_SLOTISR_VER ((volatile unsigned int*)(EMMC_BASE + 0xFC))
 
+// EMMC_INTERRUPT bits
+#define INT_CMD_DONE        (1 << 0)
+#define INT_DATA_DONE       (1 << 1)
+#define INT_WRITE_RDY       (1 << 4)
+#define INT_READ_RDY        (1 << 5)
+#define INT_ERR             (1 << 15)
+#define INT_CTO_ERR         (1 << 16)
+#define INT_CCRC_ERR        (1 << 17)
+#define INT_CEND_ERR        (1 << 18)
+#define INT_CBAD_ERR        (1 << 19)
+#define INT_DTO_ERR         (1 << 20)
+#define INT_DCRC_ERR        (1 << 21)
+#define INT_DEND_ERR        (1 << 22)
+#define INT_ACMD_ERR        (1 << 24)
+#define INT_ERROR_MASK      0x017F8000
+#define INT_ENABLE_MASK     (INT_ERROR_MASK | INT_READ_RDY | INT_WRITE_RDY | \
+                             INT_DATA_DONE | INT_CMD_DONE)
+
+// Command timeout in microseconds; data transfers rely on the
+// controller's own data timeout (DTO_ERR)
+#define SD_CMD_TIMEOUT_US   100000
+#define C1_DATA_TOUNIT_MAX  (0xE << 16)
+
 // Command flags
 #define CMD_NEED_APP        0x80000000
 #define CMD_RSPNS_48        0x00020000
 #define CMD_ERRORS_MASK     0xfff9c004
 #define CMD_RCA_MASK        0xffff0000
+#define TM_AUTO_CMD12       0x00000004
+
+// EMMC_STATUS / EMMC_CONTROL1 bits
+#define SR_CMD_INHIBIT      (1 << 0)
+#define SR_DAT_INHIBIT      (1 << 1)
+#define C1_SRST_CMD         (1 << 25)
+#define C1_SRST_DATA        (1 << 26)
 
 // SD card commands
 #define CMD_GO_IDLE         0x00000000
@@ -48,7 +81,7 @@
 #define CMD_READ_MULTI      0x12220032
 #define CMD_SET_BLOCKCNT    0x17020000
 #define CMD_WRITE_SINGLE    0x18220000
-#define CMD_WRITE_MULTI     0x19220032
+#define CMD_WRITE_MULTI     0x19220022
 #define CMD_APP_CMD         0x37000000
 #define CMD_SET_BUS_WIDTH   (0x06020000|CMD_NEED_APP)
 #define CMD_SEND_OP_COND    (0x29020000|CMD_NEED_APP)
@@ -58,7 +91,17 @@ static unsigned int sd_rca = 0;
 static unsigned int sd_scr[2];
 static int sd_initialized = 0;
 
-extern void delay_cycles(unsigned int count);
+// Interrupt status latched by sd_irq() and consumed by sd_wait_irq()
+static volatile unsigned int sd_irq_flags = 0;
+
+// Asynchronous data transfer, owned by sd_irq() while xfer_active is set
+static volatile int xfer_active = 0;
+static unsigned char** xfer_buffers;
+static unsigned int xfer_count;
+static unsigned int xfer_index;
+static int xfer_write;
+static sd_done_t xfer_done;
+static void* xfer_ctx;
 
 static void sd_delay(int count) {
     volatile int i;
@@ -76,36 +119,136 @@ static int sd_wait_for_cmd(void) {
     return SD_OK;
 }
 
+// Map error interrupt bits to a specific error code
+static int sd_decode_error(unsigned int flags) {
+    if (flags & INT_CTO_ERR)  return SD_CMD_TIMEOUT;
+    if (flags & INT_CCRC_ERR) return SD_CMD_CRC;
+    if (flags & INT_CEND_ERR) return SD_CMD_END_BIT;
+    if (flags & INT_CBAD_ERR) return SD_CMD_INDEX;
+    if (flags & INT_DTO_ERR)  return SD_DATA_TIMEOUT;
+    if (flags & INT_DCRC_ERR) return SD_DATA_CRC;
+    if (flags & INT_DEND_ERR) return SD_DATA_END_BIT;
+    if (flags & INT_ACMD_ERR) return SD_ACMD_ERROR;
+    return SD_ERROR;
+}
+
+static void sd_xfer_finish(int status) {
+    xfer_active = 0;
+    
+    if (status != SD_OK) {
+        // Reset the command and data lines so the next request starts clean
+        *EMMC_CONTROL1 |= C1_SRST_CMD | C1_SRST_DATA;
+        int timeout = 100000;
+        while ((*EMMC_CONTROL1 & (C1_SRST_CMD | C1_SRST_DATA)) && timeout--) { }
+    }
+    
+    xfer_done(status, xfer_ctx);
+}
+
+// Move one block per READ_RDY/WRITE_RDY event; DATA_DONE ends the
+// transfer (after the automatic CMD12 for multi-block commands)
+static void sd_xfer_irq(unsigned int flags) {
+    if (flags & INT_ERROR_MASK) {
+        sd_xfer_finish(sd_decode_error(flags));
+        return;
+    }
+    
+    if ((flags & INT_READ_RDY) && !xfer_write && xfer_index < xfer_count) {
+        unsigned int* buffer = (unsigned int*)xfer_buffers[xfer_index++];
+        for (int i = 0; i < 128; i++) {
+            buffer[i] = *EMMC_DATA;
+        }
+    }
+    
+    if ((flags & INT_WRITE_RDY) && xfer_write && xfer_index < xfer_count) {
+        const unsigned int* buffer = (const unsigned int*)xfer_buffers[xfer_index++];
+        for (int i = 0; i < 128; i++) {
+            *EMMC_DATA = buffer[i];
+        }
+    }
+    
+    if (flags & INT_DATA_DONE) {
+        sd_xfer_finish(xfer_index == xfer_count ? SD_OK : SD_ERROR);
+    }
+}
+
+static void sd_irq(void) {
+    unsigned int flags = *EMMC_INTERRUPT;
+    *EMMC_INTERRUPT = flags;
+    
+    if (xfer_active) {
+        sd_xfer_irq(flags);
+    } else {
+        sd_irq_flags |= flags;
+    }
+}
+
+// Sleep in WFI until one of 'mask' is signalled, an error interrupt
+// arrives or the timeout expires
+static int sd_wait_irq(unsigned int mask, unsigned int timeout_us) {
+    unsigned int flags = irq_save();
+    unsigned int start = timer_ticks();
+    int result = SD_OK;
+    
+    timer_alarm(timeout_us);
+    
+    while (1) {
+        unsigned int pending = sd_irq_flags;
+        
+        if (pending & INT_ERROR_MASK) {
+            sd_irq_flags = 0;
+            result = sd_decode_error(pending);
+            break;
+        }
+        if (pending & mask) {
+            sd_irq_flags = pending & ~mask;
+            break;
+        }
+        if (timer_ticks() - start >= timeout_us) {
+            result = SD_TIMEOUT;
+            break;
+        }
+        
+        irq_wait();
+    }
+    
+    irq_restore(flags);
+    return result;
+}
+
 static int sd_send_cmd(unsigned int cmd, unsigned int arg) {
     // Wait for command line to be ready
     if (sd_wait_for_cmd() != SD_OK) {
-        return SD_ERROR;
+        return SD_TIMEOUT;
     }
     
-    // Clear interrupt flags
+    // Drop stale status from the previous command
+    unsigned int flags = irq_save();
     *EMMC_INTERRUPT = *EMMC_INTERRUPT;
+    sd_irq_flags = 0;
+    irq_restore(flags);
     
     // Send command
     *EMMC_ARG1 = arg;
-    *EMMC_CMDTM = cmd;
+    *EMMC_CMDTM = cmd & ~CMD_NEED_APP;
     
-    // Wait for command complete
-    int timeout = 1000000;
-    while (!(*EMMC_INTERRUPT & 1) && timeout--) {
-        sd_delay(1);
-    }
-    
-    if (timeout <= 0) {
-        return SD_TIMEOUT;
-    }
-    
-    // Check for errors
-    unsigned int resp = *EMMC_INTERRUPT;
-    if (resp & CMD_ERRORS_MASK) {
-        return SD_ERROR;
+    return sd_wait_irq(INT_CMD_DONE, SD_CMD_TIMEOUT_US);
+}
+
+const char* sd_strerror(int err) {
+    switch (err) {
+        case SD_OK:           return "ok";
+        case SD_TIMEOUT:      return "timeout";
+        case SD_CMD_TIMEOUT:  return "command timeout";
+        case SD_CMD_CRC:      return "command CRC error";
+        case SD_CMD_END_BIT:  return "command end bit error";
+        case SD_CMD_INDEX:    return "command index error";
+        case SD_DATA_TIMEOUT: return "data timeout";
+        case SD_DATA_CRC:     return "data CRC error";
+        case SD_DATA_END_BIT: return "data end bit error";
+        case SD_ACMD_ERROR:   return "auto CMD12 error";
+        default:              return "error";
     }
-    
-    return SD_OK;
 }
 
 int sd_init(void) {
@@ -115,12 +258,18 @@ int sd_init(void) {
     *EMMC_CONTROL1 = 0;
     *EMMC_CONTROL2 = 0;
     
+    // Report completion and error status, and route it to the ARM
+    *EMMC_INTERRUPT = 0xFFFFFFFF;
+    *EMMC_IRPT_MASK = 0xFFFFFFFF;
+    *EMMC_IRPT_EN = INT_ENABLE_MASK;
+    irq_register(IRQ_EMMC, sd_irq);
+    
     // Enable internal clock
     *EMMC_CONTROL1 |= (1 << 0);
     sd_delay(10000);
     
     // Set clock to 400kHz (identification mode)
-    *EMMC_CONTROL1 = (0xF9 << 8) | (1 << 0);
+    *EMMC_CONTROL1 = C1_DATA_TOUNIT_MAX | (0xF9 << 8) | (1 << 0);
     sd_delay(10000);
     
     // Enable SD clock
@@ -128,15 +277,21 @@ int sd_init(void) {
     sd_delay(10000);
     
     // CMD0: GO_IDLE_STATE
-    if (sd_send_cmd(CMD_GO_IDLE, 0) != SD_OK) {
-        uart_puts("SD: CMD0 failed\n");
-        return SD_ERROR;
+    int status = sd_send_cmd(CMD_GO_IDLE, 0);
+    if (status != SD_OK) {
+        uart_puts("SD: CMD0 failed: ");
+        uart_puts(sd_strerror(status));
+        uart_puts("\n");
+        return status;
     }
     
     // CMD8: SEND_IF_COND (check voltage)
-    if (sd_send_cmd(CMD_SEND_IF_COND, 0x1AA) != SD_OK) {
-        uart_puts("SD: CMD8 failed\n");
-        return SD_ERROR;
+    status = sd_send_cmd(CMD_SEND_IF_COND, 0x1AA);
+    if (status != SD_OK) {
+        uart_puts("SD: CMD8 failed: ");
+        uart_puts(sd_strerror(status));
+        uart_puts("\n");
+        return status;
     }
     
     // ACMD41: SD_SEND_OP_COND (initialize card)
@@ -185,48 +340,51 @@ int sd_init(void) {
     return SD_OK;
 }
 
-int sd_read_block(unsigned int block, unsigned char* buffer) {
-    if (!sd_initialized) return SD_ERROR;
-    
-    // Set block size and count
-    *EMMC_BLKSIZECNT = (1 << 16) | 512;
-    
-    // Send read command
-    if (sd_send_cmd(CMD_READ_SINGLE, block) != SD_OK) {
-        return SD_ERROR;
-    }
+// Start a transfer of 'count' consecutive blocks. Block i moves to or
+// from buffers[i]. 'done' is called from interrupt context.
+int sd_transfer_async(unsigned int block, unsigned int count, int write,
+                      unsigned char** buffers, sd_done_t done, void* ctx) {
+    if (!sd_initialized || xfer_active) return SD_ERROR;
+    if (count == 0 || count > 0xFFFF) return SD_ERROR;
     
-    // Read data
     int timeout = 1000000;
-    for (int i = 0; i < 128; i++) {
-        while (!(*EMMC_STATUS & (1 << 5)) && timeout--) {
-            if (timeout <= 0) return SD_TIMEOUT;
-        }
-        ((unsigned int*)buffer)[i] = *EMMC_DATA;
+    while ((*EMMC_STATUS & (SR_CMD_INHIBIT | SR_DAT_INHIBIT)) && timeout--) { }
+    if (timeout <= 0) return SD_TIMEOUT;
+    
+    unsigned int cmd;
+    if (count == 1) {
+        cmd = write ? CMD_WRITE_SINGLE : CMD_READ_SINGLE;
+    } else {
+        cmd = (write ? CMD_WRITE_MULTI : CMD_READ_MULTI) | TM_AUTO_CMD12;
     }
     
-    return SD_OK;
-}
-
-int sd_write_block(unsigned int block, const unsigned char* buffer) {
-    if (!sd_initialized) return SD_ERROR;
+    unsigned int flags = irq_save();
     
-    // Set block size and count
-    *EMMC_BLKSIZECNT = (1 << 16) | 512;
+    xfer_buffers = buffers;
+    xfer_count = count;
+    xfer_index = 0;
+    xfer_write = write;
+    xfer_done = done;
+    xfer_ctx = ctx;
+    xfer_active = 1;
     
-    // Send write command
-    if (sd_send_cmd(CMD_WRITE_SINGLE, block) != SD_OK) {
-        return SD_ERROR;
-    }
+    *EMMC_INTERRUPT = *EMMC_INTERRUPT;
+    *EMMC_BLKSIZECNT = (count << 16) | 512;
+    *EMMC_ARG1 = block;
     
-    // Write data
-    int timeout = 1000000;
-    for (int i = 0; i < 128; i++) {
-        while (!(*EMMC_STATUS & (1 << 4)) && timeout--) {
-            if (timeout <= 0) return SD_TIMEOUT;
-        }
-        *EMMC_DATA = ((unsigned int*)buffer)[i];
-    }
+    // The transfer state must be visible to core 0's handler first
+    asm volatile("dsb sy" ::: "memory");
+    *EMMC_CMDTM = cmd;
     
+    irq_restore(flags);
     return SD_OK;
 }
+
+// Synchronous wrappers, queued through the block layer
+int sd_read_block(unsigned int block, unsigned char* buffer) {
+    return blk_read(block, 1, buffer);
+}
+
+int sd_write_block(unsigned int block, const unsigned char* buffer) {
+    return blk_write(block, 1, buffer);
+}
@@ -5,12 +5,25 @@
 #ifndef SD_H
 #define SD_H
 
-#define SD_OK       0
-#define SD_ERROR   -1
-#define SD_TIMEOUT -2
+#define SD_OK              0
+#define SD_ERROR          -1
+#define SD_TIMEOUT        -2
+#define SD_CMD_TIMEOUT    -3
+#define SD_CMD_CRC        -4
+#define SD_CMD_END_BIT    -5
+#define SD_CMD_INDEX      -6
+#define SD_DATA_TIMEOUT   -7
+#define SD_DATA_CRC       -8
+#define SD_DATA_END_BIT   -9
+#define SD_ACMD_ERROR     -10
+
+typedef void (*sd_done_t)(int status, void* ctx);
 
 int sd_init(void);
 int sd_read_block(unsigned int block, unsigned char* buffer);
 int sd_write_block(unsigned int block, const unsigned char* buffer);
+int sd_transfer_async(unsigned int block, unsigned int count, int write,
+                      unsigned char** buffers, sd_done_t done, void* ctx);
+const char* sd_strerror(int err);
 
 #endif
@@ -0,0 +1,190 @@
+/*
+ * smp.c - Multi-core bring-up and spinlocks
+ *
+ * Spinlocks use LDREX/STREX (LDAXR/STXR on AArch64), which only work on
+ * normal cacheable memory: every core must have run mmu_enable() before
+ * taking a lock.
+ */
+
+#include "smp.h"
+#include "mmu.h"
+#include "irq.h"
+#include "timer.h"
+#include "thread.h"
+#include "uart.h"
+
+// Local peripherals: per-core mailbox interrupt control, mailbox 0 (used
+// as an IPI) and mailbox 3 (boot entry address)
+#define LOCAL_BASE          0x40000000UL
+#define LOCAL_MBOX_CNTL(c)  ((volatile unsigned int*)(LOCAL_BASE + 0x50 + 4 * (c)))
+#define LOCAL_MBOX0_SET(c)  ((volatile unsigned int*)(LOCAL_BASE + 0x80 + 0x10 * (c)))
+#define LOCAL_MBOX0_RDCLR(c) ((volatile unsigned int*)(LOCAL_BASE + 0xC0 + 0x10 * (c)))
+#define LOCAL_MBOX3_SET(c)  ((volatile unsigned int*)(LOCAL_BASE + 0x8C + 0x10 * (c)))
+
+extern void secondary_start(void);
+
+#ifdef __aarch64__
+// The 64-bit firmware stub parks secondary cores polling a spin table
+// of entry addresses (linker64.ld places it at 0xD8), with caches off
+extern volatile unsigned long spin_table[SMP_MAX_CORES];
+#endif
+
+static volatile unsigned int online_mask = 1;
+
+unsigned int smp_core_id(void) {
+    unsigned long mpidr;
+#ifdef __aarch64__
+    asm volatile("mrs %0, mpidr_el1" : "=r"(mpidr));
+#else
+    asm volatile("mrc p15, 0, %0, c0, c0, 5" : "=r"(mpidr));
+#endif
+    return mpidr & 3;
+}
+
+int smp_core_online(unsigned int core) {
+    return (online_mask >> core) & 1;
+}
+
+unsigned int smp_cores_online(void) {
+    unsigned int count = 0;
+    for (unsigned int core = 0; core < SMP_MAX_CORES; core++) {
+        count += smp_core_online(core);
+    }
+    return count;
+}
+
+// Wake cores idling in WFE
+void smp_signal(void) {
+    asm volatile("dsb sy\n\tsev" ::: "memory");
+}
+
+// Mailbox 0 carries the address of a function for this core to call
+static void smp_mbox_irq(void) {
+    unsigned int core = smp_core_id();
+    unsigned int fn = *LOCAL_MBOX0_RDCLR(core);
+    *LOCAL_MBOX0_RDCLR(core) = fn;
+    if (fn) {
+        ((void (*)(void))(unsigned long)fn)();
+    }
+}
+
+// Release a core still waiting in boot.S to entry
+static void smp_start_core(unsigned int core, void (*entry)(void)) {
+#ifdef __aarch64__
+    spin_table[core] = (unsigned long)entry;
+    mmu_clean_dcache((const void*)&spin_table[core], sizeof(spin_table[core]));
+#else
+    *LOCAL_MBOX3_SET(core) = (unsigned int)entry;
+#endif
+}
+
+// Send every other core to entry, which must not return: online cores
+// call it from their mailbox interrupt, cores still waiting in boot.S
+// jump to it with the MMU off. Returns the mask of cores sent.
+unsigned int smp_park_others(void (*entry)(void)) {
+    unsigned int self = smp_core_id();
+    unsigned int mask = 0;
+    
+    for (unsigned int core = 0; core < SMP_MAX_CORES; core++) {
+        if (core == self) continue;
+        if (smp_core_online(core)) {
+            *LOCAL_MBOX0_SET(core) = (unsigned long)entry;
+        } else {
+            smp_start_core(core, entry);
+        }
+        mask |= 1 << core;
+    }
+    smp_signal();
+    return mask;
+}
+
+// Called on each secondary core from boot.S with its boot stack set up
+void secondary_main(unsigned int core) {
+    mmu_enable();
+    thread_init_cpu(core);
+    timer_tick_start();
+    *LOCAL_MBOX_CNTL(core) = 1;             // Mailbox 0 interrupt
+    
+    __atomic_or_fetch(&online_mask, 1 << core, __ATOMIC_SEQ_CST);
+    irq_enable();
+    
+    // The boot flow becomes this core's idle thread
+    thread_idle();
+}
+
+void smp_init(void) {
+    irq_register_local(IRQ_LOCAL_MBOX0, smp_mbox_irq);
+    *LOCAL_MBOX_CNTL(0) = 1;
+    
+    for (unsigned int core = 1; core < SMP_MAX_CORES; core++) {
+        smp_start_core(core, secondary_start);
+    }
+    smp_signal();
+    
+    // Give the cores a moment to come up
+    unsigned int start = timer_ticks();
+    while (smp_cores_online() < SMP_MAX_CORES && timer_ticks() - start < 100000) { }
+    
+    uart_puts("SMP: ");
+    uart_dec(smp_cores_online());
+    uart_puts(" cores online\n");
+}
+
+void spin_lock(spinlock_t* lock) {
+    unsigned int tmp;
+#ifdef __aarch64__
+    asm volatile(
+        "   sevl\n"
+        "1: wfe\n"
+        "2: ldaxr   %w0, [%1]\n"
+        "   cbnz    %w0, 1b\n"
+        "   stxr    %w0, %w2, [%1]\n"
+        "   cbnz    %w0, 2b\n"
+        : "=&r"(tmp)
+        : "r"(lock), "r"(1)
+        : "memory");
+#else
+    asm volatile(
+        "1: ldrex   %0, [%1]\n"
+        "   teq     %0, #0\n"
+        "   wfene\n"
+        "   strexeq %0, %2, [%1]\n"
+        "   teqeq   %0, #0\n"
+        "   bne     1b\n"
+        "   dmb\n"
+        : "=&r"(tmp)
+        : "r"(lock), "r"(1)
+        : "cc", "memory");
+#endif
+}
+
+int spin_trylock(spinlock_t* lock) {
+    unsigned int tmp;
+#ifdef __aarch64__
+    asm volatile(
+        "   ldaxr   %w0, [%1]\n"
+        "   cbnz    %w0, 1f\n"
+        "   stxr    %w0, %w2, [%1]\n"
+        "1:\n"
+        : "=&r"(tmp)
+        : "r"(lock), "r"(1)
+        : "memory");
+#else
+    asm volatile(
+        "   ldrex   %0, [%1]\n"
+        "   teq     %0, #0\n"
+        "   strexeq %0, %2, [%1]\n"
+        "   movne   %0, #1\n"
+        "   dmb\n"
+        : "=&r"(tmp)
+        : "r"(lock), "r"(1)
+        : "cc", "memory");
+#endif
+    return tmp == 0;
+}
+
+void spin_unlock(spinlock_t* lock) {
+    asm volatile("dmb sy" ::: "memory");
+    *lock = 0;
+    smp_signal();
+}
@@ -0,0 +1,23 @@
+/*
+ * smp.h - Multi-core support header
+ */
+
+#ifndef SMP_H
+#define SMP_H
+
+#define SMP_MAX_CORES 4
+
+typedef volatile unsigned int spinlock_t;
+
+void smp_init(void);
+unsigned int smp_core_id(void);
+unsigned int smp_cores_online(void);
+int smp_core_online(unsigned int core);
+void smp_signal(void);
+unsigned int smp_park_others(void (*entry)(void));
+
+void spin_lock(spinlock_t* lock);
+int spin_trylock(spinlock_t* lock);
+void spin_unlock(spinlock_t* lock);
+
+#endif
@@ -0,0 +1,651 @@
+/*
+ * thread.c - Preemptive kernel threads
+ *
+ * Every core has its own run queues, one per priority level, guarded by
+ * a per-core spinlock; a thread's state is guarded by the lock of the
+ * core it is queued on (thread->cpu). The per-core generic timer tick
+ * expires time slices and wakes sleepers, and the switch happens on the
+ * way out of the interrupt (thread_preempt). Idle cores steal ready
+ * threads from busy ones. The register and FP context switch lives in
+ * boot.S (thread_switch).
+ *
+ * thread_wait() may return spuriously, at the latest one tick after it
+ * blocked, so a wakeup raced from another core is never lost for long.
+ * Callers re-check their condition in a loop.
+ */
+
+#include "thread.h"
+#include "memory.h"
+#include "irq.h"
+#include "timer.h"
+#include "uart.h"
+
+#define THREAD_SLICE_TICKS  2
+#define TICK_US             (1000000 / TIMER_TICK_HZ)
+
+enum {
+    THREAD_FREE = 0,
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_SLEEPING,
+    THREAD_WAITING,
+    THREAD_DEAD
+};
+
+typedef struct thread {
+    unsigned long sp;               // Saved stack pointer, used by thread_switch
+    int id;
+    int state;
+    int prio;
+    int affinity;                   // Core it is pinned to, or THREAD_ANY_CORE
+    volatile int cpu;               // Core whose lock guards this thread
+    volatile int on_cpu;            // Context not saved yet; cannot migrate
+    int idle;
+    char name[16];
+    unsigned char* stack;
+    thread_fn_t fn;
+    void* arg;
+    unsigned int wake_time;         // Sleep deadline / wait timeout tick
+    void* event;                    // THREAD_WAITING: event to wake on
+    unsigned int cpu_ms;            // Accumulated CPU time
+    unsigned int cpu_us;            // Sub-millisecond remainder
+    unsigned int switched_in;       // Tick when it last got the CPU
+    struct thread* next;            // Run queue link
+} thread_t;
+
+typedef struct {
+    spinlock_t lock;
+    thread_t* head[THREAD_PRIO_LEVELS];
+    thread_t* tail[THREAD_PRIO_LEVELS];
+    unsigned int nr_ready;
+    thread_t* current;
+    thread_t* idle;
+    thread_t* prev;                 // Thread switched away from, until saved
+    int slice;
+    volatile int need_resched;
+    unsigned int switches;
+    unsigned int steals;
+} cpu_t;
+
+// Context switch in boot.S: saves callee-saved registers, d8-d15 and
+// the FP control/status on the current stack, stores sp to *old_sp and
+// resumes new_sp
+extern void thread_switch(unsigned long* old_sp, unsigned long new_sp);
+
+static thread_t threads[THREAD_MAX];
+static cpu_t cpus[SMP_MAX_CORES];
+static spinlock_t threads_lock = 0;         // Slot allocation
+static int next_id = 0;
+
+static cpu_t* this_cpu(void) {
+    return &cpus[smp_core_id()];
+}
+
+static void thread_account(thread_t* t, unsigned int now) {
+    unsigned int delta = now - t->switched_in;
+    t->cpu_us += delta % 1000;
+    t->cpu_ms += delta / 1000 + t->cpu_us / 1000;
+    t->cpu_us %= 1000;
+    t->switched_in = now;
+}
+
+// Lock the core that owns t, following it if it migrates meanwhile
+static cpu_t* lock_thread_cpu(thread_t* t) {
+    while (1) {
+        int core = t->cpu;
+        spin_lock(&cpus[core].lock);
+        if (t->cpu == core) return &cpus[core];
+        spin_unlock(&cpus[core].lock);
+    }
+}
+
+// Queue t on core c. c->lock must be held.
+static void run_push(cpu_t* c, thread_t* t) {
+    t->state = THREAD_READY;
+    t->cpu = c - cpus;
+    t->next = 0;
+    if (c->tail[t->prio]) {
+        c->tail[t->prio]->next = t;
+    } else {
+        c->head[t->prio] = t;
+    }
+    c->tail[t->prio] = t;
+    c->nr_ready++;
+    
+    if (c->current && (c->current->idle || t->prio < c->current->prio)) {
+        c->need_resched = 1;
+    }
+    if (c != this_cpu()) {
+        smp_signal();
+    }
+}
+
+static void run_unlink(cpu_t* c, thread_t* t) {
+    thread_t** link = &c->head[t->prio];
+    thread_t* prev = 0;
+    while (*link != t) {
+        prev = *link;
+        link = &(*link)->next;
+    }
+    *link = t->next;
+    if (c->tail[t->prio] == t) c->tail[t->prio] = prev;
+    t->next = 0;
+    c->nr_ready--;
+}
+
+static thread_t* run_pop(cpu_t* c) {
+    for (int p = 0; p < THREAD_PRIO_LEVELS; p++) {
+        thread_t* t = c->head[p];
+        if (t) {
+            run_unlink(c, t);
+            return t;
+        }
+    }
+    return 0;
+}
+
+// Runs on the new thread right after a switch: the previous thread's
+// context is saved now, so other cores may pick it up
+static void finish_switch(void) {
+    cpu_t* c = this_cpu();
+    asm volatile("dmb sy" ::: "memory");
+    c->prev->on_cpu = 0;
+}
+
+// Pick the next thread and switch to it. Interrupts must be masked and
+// the calling core's lock held; it is released here.
+static void schedule_locked(cpu_t* c) {
+    thread_t* prev = c->current;
+    unsigned int now = timer_ticks();
+    
+    thread_account(prev, now);
+    if (prev->state == THREAD_RUNNING) {
+        if (prev->idle) {
+            prev->state = THREAD_READY;     // Idle threads are never queued
+        } else {
+            run_push(c, prev);
+        }
+    }
+    
+    thread_t* next = run_pop(c);
+    if (!next) next = c->idle;
+    
+    next->state = THREAD_RUNNING;
+    next->switched_in = now;
+    c->current = next;
+    c->slice = THREAD_SLICE_TICKS;
+    c->need_resched = 0;
+    
+    if (next == prev) {
+        spin_unlock(&c->lock);
+        return;
+    }
+    
+    next->on_cpu = 1;
+    c->prev = prev;
+    c->switches++;
+    spin_unlock(&c->lock);
+    
+    thread_switch(&prev->sp, next->sp);
+    finish_switch();
+}
+
+// First code run by a new thread, entered from thread_switch
+static void thread_bootstrap(void) {
+    finish_switch();
+    irq_enable();
+    
+    thread_t* self = this_cpu()->current;
+    self->fn(self->arg);
+    thread_exit();
+}
+
+static void thread_set_name(thread_t* t, const char* name) {
+    int i = 0;
+    for (; name[i] && i < 15; i++) {
+        t->name[i] = name[i];
+    }
+    t->name[i] = '\0';
+}
+
+// Claim a slot, reusing the stack of an exited thread since the heap
+// cannot free it
+static thread_t* thread_alloc(void) {
+    thread_t* t = 0;
+    
+    spin_lock(&threads_lock);
+    for (int i = 0; i < THREAD_MAX && !t; i++) {
+        if (threads[i].state == THREAD_DEAD && !threads[i].on_cpu && threads[i].stack) {
+            t = &threads[i];
+        }
+    }
+    for (int i = 0; i < THREAD_MAX && !t; i++) {
+        if (threads[i].state == THREAD_FREE) {
+            t = &threads[i];
+        }
+    }
+    if (t) {
+        t->state = THREAD_READY;
+        t->id = next_id++;
+    }
+    spin_unlock(&threads_lock);
+    
+    if (t) {
+        t->cpu_ms = 0;
+        t->cpu_us = 0;
+        t->event = 0;
+        t->idle = 0;
+        t->on_cpu = 0;
+        t->next = 0;
+    }
+    return t;
+}
+
+#ifdef __aarch64__
+
+// Build the frame thread_switch pops: x19-x30, d8-d15, fpcr, fpsr
+static void thread_build_frame(thread_t* t, void (*entry)(void)) {
+    unsigned long* sp = (unsigned long*)(((unsigned long)t->stack + THREAD_STACK_SIZE) & ~15UL);
+    sp -= 22;
+    for (int i = 0; i < 22; i++) {
+        sp[i] = 0;
+    }
+    sp[11] = (unsigned long)entry;              // x30
+    t->sp = (unsigned long)sp;
+}
+
+#else
+
+// Build the frame thread_switch pops: {fpscr, pad}, d8-d15, r3-r11, lr
+static void thread_build_frame(thread_t* t, void (*entry)(void)) {
+    unsigned int* sp = (unsigned int*)(((unsigned long)t->stack + THREAD_STACK_SIZE) & ~7);
+    *--sp = (unsigned int)entry;                // lr
+    for (int r = 0; r < 9; r++) {
+        *--sp = 0;                              // r11 .. r3
+    }
+    for (int d = 0; d < 16; d++) {
+        *--sp = 0;                              // d15 .. d8
+    }
+    *--sp = 0;                                  // pad
+    *--sp = 0;                                  // fpscr
+    t->sp = (unsigned long)sp;
+}
+
+#endif
+
+static void idle_main(void* arg) {
+    (void)arg;
+    thread_idle();
+}
+
+// Adopt the calling flow of control as 'main' on the boot core and
+// give the core an idle thread
+void thread_init(void) {
+    cpu_t* c = &cpus[0];
+    
+    thread_t* t = thread_alloc();
+    thread_set_name(t, "main");
+    t->prio = THREAD_PRIO_INTERACTIVE;
+    t->affinity = 0;
+    t->cpu = 0;
+    t->state = THREAD_RUNNING;
+    t->on_cpu = 1;
+    t->switched_in = timer_ticks();
+    c->current = t;
+    c->slice = THREAD_SLICE_TICKS;
+    
+    thread_t* idle = thread_alloc();
+    thread_set_name(idle, "idle0");
+    idle->stack = (unsigned char*)malloc(THREAD_STACK_SIZE);
+    idle->fn = idle_main;
+    idle->arg = 0;
+    idle->prio = THREAD_PRIO_LEVELS;
+    idle->affinity = 0;
+    idle->cpu = 0;
+    idle->idle = 1;
+    thread_build_frame(idle, thread_bootstrap);
+    c->idle = idle;
+}
+
+// Adopt a secondary core's boot flow as its idle thread
+void thread_init_cpu(unsigned int core) {
+    cpu_t* c = &cpus[core];
+    
+    thread_t* idle = thread_alloc();
+    char name[] = "idle0";
+    name[4] = '0' + core;
+    thread_set_name(idle, name);
+    idle->prio = THREAD_PRIO_LEVELS;
+    idle->affinity = core;
+    idle->cpu = core;
+    idle->idle = 1;
+    idle->state = THREAD_RUNNING;
+    idle->on_cpu = 1;
+    idle->switched_in = timer_ticks();
+    c->idle = idle;
+    c->current = idle;
+}
+
+int thread_create_on(const char* name, thread_fn_t fn, void* arg, int prio, int core) {
+    if (prio < 0 || prio >= THREAD_PRIO_LEVELS) return -1;
+    if (core >= SMP_MAX_CORES) return -1;
+    
+    thread_t* t = thread_alloc();
+    if (!t) {
+        uart_puts("ERROR: Too many threads!\n");
+        return -1;
+    }
+    
+    if (!t->stack) {
+        t->stack = (unsigned char*)malloc(THREAD_STACK_SIZE);
+        if (!t->stack) {
+            t->state = THREAD_FREE;
+            return -1;
+        }
+    }
+    
+    thread_set_name(t, name);
+    t->fn = fn;
+    t->arg = arg;
+    t->prio = prio;
+    t->affinity = core;
+    thread_build_frame(t, thread_bootstrap);
+    
+    int id = t->id;
+    unsigned int flags = irq_save();
+    cpu_t* c = core == THREAD_ANY_CORE ? this_cpu() : &cpus[core];
+    spin_lock(&c->lock);
+    run_push(c, t);
+    spin_unlock(&c->lock);
+    irq_restore(flags);
+    
+    return id;
+}
+
+int thread_create(const char* name, thread_fn_t fn, void* arg) {
+    return thread_create_on(name, fn, arg, THREAD_PRIO_NORMAL, THREAD_ANY_CORE);
+}
+
+int thread_set_priority(int id, int prio) {
+    if (prio < 0 || prio >= THREAD_PRIO_LEVELS) return -1;
+    
+    for (int i = 0; i < THREAD_MAX; i++) {
+        thread_t* t = &threads[i];
+        if (t->id != id || t->idle || t->state == THREAD_FREE || t->state == THREAD_DEAD) {
+            continue;
+        }
+        
+        unsigned int flags = irq_save();
+        cpu_t* c = lock_thread_cpu(t);
+        if (t->state == THREAD_READY) {
+            run_unlink(c, t);
+            t->prio = prio;
+            run_push(c, t);
+        } else {
+            t->prio = prio;
+        }
+        spin_unlock(&c->lock);
+        irq_restore(flags);
+        return 0;
+    }
+    return -1;
+}
+
+void thread_yield(void) {
+    unsigned int flags = irq_save();
+    cpu_t* c = this_cpu();
+    
+    // Never switch from interrupt context or a masked critical section
+    if (c->current && !(flags & (1 << 7))) {
+        spin_lock(&c->lock);
+        schedule_locked(c);
+    }
+    
+    irq_restore(flags);
+}
+
+void thread_sleep(unsigned int ms) {
+    unsigned int flags = irq_save();
+    cpu_t* c = this_cpu();
+    spin_lock(&c->lock);
+    c->current->wake_time = timer_ticks() + ms * 1000;
+    c->current->state = THREAD_SLEEPING;
+    schedule_locked(c);
+    irq_restore(flags);
+}
+
+// Block until thread_wake(event) or the next tick. Must be called with
+// interrupts masked, after checking the wake condition.
+void thread_wait(void* event) {
+    cpu_t* c = this_cpu();
+    if (!c->current) {
+        irq_wait();
+        return;
+    }
+    
+    spin_lock(&c->lock);
+    c->current->event = event;
+    c->current->wake_time = timer_ticks() + TICK_US;
+    c->current->state = THREAD_WAITING;
+    schedule_locked(c);
+}
+
+// Safe to call from interrupt handlers and from any core
+void thread_wake(void* event) {
+    unsigned int flags = irq_save();
+    for (int i = 0; i < THREAD_MAX; i++) {
+        thread_t* t = &threads[i];
+        if (t->state != THREAD_WAITING || t->event != event) continue;
+        
+        cpu_t* c = lock_thread_cpu(t);
+        if (t->state == THREAD_WAITING && t->event == event) {
+            t->event = 0;
+            run_push(c, t);
+        }
+        spin_unlock(&c->lock);
+    }
+    irq_restore(flags);
+}
+
+void thread_exit(void) {
+    irq_disable();
+    cpu_t* c = this_cpu();
+    spin_lock(&c->lock);
+    c->current->state = THREAD_DEAD;
+    schedule_locked(c);
+    
+    // A dead thread is never scheduled again
+    while (1) { }
+}
+
+int thread_id(void) {
+    thread_t* t = this_cpu()->current;
+    return t ? t->id : 0;
+}
+
+// Timer tick on the calling core: wake due sleepers and expire the slice
+void thread_tick(void) {
+    cpu_t* c = this_cpu();
+    int core = c - cpus;
+    unsigned int now = timer_ticks();
+    
+    spin_lock(&c->lock);
+    
+    for (int i = 0; i < THREAD_MAX; i++) {
+        thread_t* t = &threads[i];
+        if (t->cpu != core) continue;
+        if (t->state != THREAD_SLEEPING && t->state != THREAD_WAITING) continue;
+        if ((int)(t->wake_time - now) <= 0) {
+            t->event = 0;
+            run_push(c, t);
+        }
+    }
+    
+    if (--c->slice <= 0 && c->nr_ready) {
+        c->need_resched = 1;
+    }
+    
+    spin_unlock(&c->lock);
+}
+
+// Called on the way out of every interrupt
+void thread_preempt(void) {
+    cpu_t* c = this_cpu();
+    if (c->need_resched && c->current) {
+        spin_lock(&c->lock);
+        schedule_locked(c);
+    }
+}
+
+// Take a ready thread from another core's queue
+static int thread_steal(cpu_t* c) {
+    int core = c - cpus;
+    
+    for (int i = 1; i < SMP_MAX_CORES; i++) {
+        int v = core + i;
+        if (v >= SMP_MAX_CORES) v -= SMP_MAX_CORES;
+        cpu_t* victim = &cpus[v];
+        if (!victim->nr_ready || !spin_trylock(&victim->lock)) continue;
+        
+        thread_t* found = 0;
+        for (int p = 0; p < THREAD_PRIO_LEVELS && !found; p++) {
+            for (thread_t* t = victim->head[p]; t; t = t->next) {
+                if (t->affinity == THREAD_ANY_CORE && !t->on_cpu) {
+                    found = t;
+                    break;
+                }
+            }
+        }
+        if (found) {
+            run_unlink(victim, found);
+        }
+        spin_unlock(&victim->lock);
+        
+        if (found) {
+            spin_lock(&c->lock);
+            run_push(c, found);
+            c->steals++;
+            spin_unlock(&c->lock);
+            return 1;
+        }
+    }
+    
+    return 0;
+}
+
+// Idle loop of each core: steal work, otherwise wait for an interrupt
+// or a wakeup signalled from another core
+void thread_idle(void) {
+    while (1) {
+        cpu_t* c = this_cpu();
+        
+        unsigned int flags = irq_save();
+        if (!c->nr_ready) {
+            thread_steal(c);
+        }
+        irq_restore(flags);
+        
+        if (c->nr_ready) {
+            thread_yield();
+        } else {
+            asm volatile("wfe");
+        }
+    }
+}
+
+// Sleeping mutex; waiters block instead of spinning
+void mutex_lock(mutex_t* m) {
+    unsigned int flags = irq_save();
+    void* self = this_cpu()->current;
+    
+    while (1) {
+        spin_lock(&m->lock);
+        if (!m->owner) {
+            m->owner = self;
+            spin_unlock(&m->lock);
+            break;
+        }
+        spin_unlock(&m->lock);
+        thread_wait(m);
+    }
+    
+    irq_restore(flags);
+}
+
+void mutex_unlock(mutex_t* m) {
+    unsigned int flags = irq_save();
+    spin_lock(&m->lock);
+    m->owner = 0;
+    spin_unlock(&m->lock);
+    irq_restore(flags);
+    thread_wake(m);
+}
+
+static const char* thread_state_name(int state) {
+    switch (state) {
+        case THREAD_READY:    return "ready   ";
+        case THREAD_RUNNING:  return "running ";
+        case THREAD_SLEEPING: return "sleeping";
+        case THREAD_WAITING:  return "waiting ";
+        default:              return "dead    ";
+    }
+}
+
+// Milliseconds a core has spent in its idle thread, including the
+// current stretch, for load estimates
+unsigned int thread_idle_ms(unsigned int core) {
+    cpu_t* c = &cpus[core];
+    unsigned int ms = 0;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&c->lock);
+    if (c->idle) {
+        ms = c->idle->cpu_ms;
+        if (c->current == c->idle) ms += (timer_ticks() - c->idle->switched_in) / 1000;
+    }
+    spin_unlock(&c->lock);
+    irq_restore(flags);
+    
+    return ms;
+}
+
+void thread_list(void) {
+    unsigned int flags = irq_save();
+    thread_account(this_cpu()->current, timer_ticks());
+    irq_restore(flags);
+    
+    uart_puts("  ID  CORE PRI STATE     CPU(ms)   NAME\n");
+    for (int i = 0; i < THREAD_MAX; i++) {
+        thread_t* t = &threads[i];
+        if (t->state == THREAD_FREE || t->state == THREAD_DEAD) continue;
+        
+        uart_puts("  ");
+        uart_dec(t->id);
+        uart_puts(t->id < 10 ? "   " : "  ");
+        uart_dec(t->cpu);
+        uart_puts("    ");
+        if (t->idle) {
+            uart_puts("-");
+        } else {
+            uart_dec(t->prio);
+        }
+        uart_puts("   ");
+        uart_puts(thread_state_name(t->state));
+        uart_puts("  ");
+        uart_dec(t->cpu_ms);
+        uart_puts("\t    ");
+        uart_puts(t->name);
+        uart_puts("\n");
+    }
+    
+    for (int core = 0; core < SMP_MAX_CORES; core++) {
+        if (!smp_core_online(core)) continue;
+        uart_puts("  Core ");
+        uart_dec(core);
+        uart_puts(": ");
+        uart_dec(cpus[core].switches);
+        uart_puts(" switches, ");
+        uart_dec(cpus[core].steals);
+        uart_puts(" steals\n");
+    }
+}
@@ -0,0 +1,52 @@
+/*
+ * thread.h - Preemptive kernel threads header
+ */
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#include "smp.h"
+
+#define THREAD_MAX          24
+#define THREAD_STACK_SIZE   0x4000      // 16KB per thread
+
+// Priorities, highest first
+#define THREAD_PRIO_HIGH        0
+#define THREAD_PRIO_INTERACTIVE 1
+#define THREAD_PRIO_NORMAL      2
+#define THREAD_PRIO_LOW         3
+#define THREAD_PRIO_LEVELS      4
+
+#define THREAD_ANY_CORE     -1
+
+typedef void (*thread_fn_t)(void* arg);
+
+// Sleeping lock for data shared across blocking calls
+typedef struct {
+    spinlock_t lock;
+    void* owner;
+} mutex_t;
+
+void thread_init(void);
+void thread_init_cpu(unsigned int core);
+int thread_create(const char* name, thread_fn_t fn, void* arg);
+int thread_create_on(const char* name, thread_fn_t fn, void* arg, int prio, int core);
+int thread_set_priority(int id, int prio);
+void thread_yield(void);
+void thread_sleep(unsigned int ms);
+void thread_wait(void* event);
+void thread_wake(void* event);
+void thread_exit(void);
+int thread_id(void);
+void thread_list(void);
+unsigned int thread_idle_ms(unsigned int core);
+
+// Scheduler hooks for the timer, interrupt and SMP code
+void thread_tick(void);
+void thread_preempt(void);
+void thread_idle(void);
+
+void mutex_lock(mutex_t* m);
+void mutex_unlock(mutex_t* m);
+
+#endif
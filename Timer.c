@@ -0,0 +1,80 @@
+/*
+ * timer.c - BCM2835 system timer (free-running 1MHz counter) and the
+ * per-core ARM generic timer used for the scheduler tick
+ */
+
+#include "timer.h"
+#include "irq.h"
+#include "smp.h"
+#include "thread.h"
+
+// System timer registers (Raspberry Pi 2/3)
+#define SYSTIMER_BASE   0x3F003000
+#define SYSTIMER_CS     ((volatile unsigned int*)(SYSTIMER_BASE + 0x00))
+#define SYSTIMER_CLO    ((volatile unsigned int*)(SYSTIMER_BASE + 0x04))
+#define SYSTIMER_C3     ((volatile unsigned int*)(SYSTIMER_BASE + 0x18))
+
+// Compare channels 0 and 2 belong to the GPU, channel 3 is ours
+#define TIMER_ALARM_IRQ 3
+
+// Local peripherals: per-core timer interrupt control
+#define LOCAL_TIMER_CNTL(c) ((volatile unsigned int*)(0x40000040UL + 4 * (c)))
+#define CNTV_IRQ_ENABLE     (1 << 3)
+
+static unsigned int tick_interval;
+
+static void timer_alarm_irq(void) {
+    // Acknowledge the match; waking the core from WFI is all we need
+    *SYSTIMER_CS = (1 << 3);
+}
+
+// Per-core virtual timer interrupt: rearm and drive the scheduler
+static void timer_tick_irq(void) {
+#ifdef __aarch64__
+    asm volatile("msr cntv_tval_el0, %0" :: "r"((unsigned long)tick_interval));
+#else
+    asm volatile("mcr p15, 0, %0, c14, c3, 0" :: "r"(tick_interval));
+#endif
+    thread_tick();
+}
+
+void timer_init(void) {
+    unsigned long freq;
+#ifdef __aarch64__
+    asm volatile("mrs %0, cntfrq_el0" : "=r"(freq));
+#else
+    asm volatile("mrc p15, 0, %0, c14, c0, 0" : "=r"(freq));
+#endif
+    tick_interval = freq / TIMER_TICK_HZ;
+    
+    *SYSTIMER_CS = (1 << 3);
+    irq_register(TIMER_ALARM_IRQ, timer_alarm_irq);
+    irq_register_local(IRQ_LOCAL_CNTV, timer_tick_irq);
+}
+
+// Start the scheduler tick on the calling core
+void timer_tick_start(void) {
+#ifdef __aarch64__
+    asm volatile("msr cntv_tval_el0, %0" :: "r"((unsigned long)tick_interval));
+    asm volatile("msr cntv_ctl_el0, %0" :: "r"(1UL));        // Enable, unmasked
+#else
+    asm volatile("mcr p15, 0, %0, c14, c3, 0" :: "r"(tick_interval));
+    asm volatile("mcr p15, 0, %0, c14, c3, 1" :: "r"(1));    // Enable, unmasked
+#endif
+    *LOCAL_TIMER_CNTL(smp_core_id()) = CNTV_IRQ_ENABLE;
+}
+
+unsigned int timer_ticks(void) {
+    return *SYSTIMER_CLO;
+}
+
+void timer_wait_us(unsigned int us) {
+    unsigned int start = timer_ticks();
+    while (timer_ticks() - start < us) { }
+}
+
+// Raise an interrupt in 'us' microseconds, used to bound WFI sleeps
+void timer_alarm(unsigned int us) {
+    *SYSTIMER_C3 = timer_ticks() + us;
+    *SYSTIMER_CS = (1 << 3);
+}
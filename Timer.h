@@ -0,0 +1,17 @@
+/*
+ * timer.h - System timer header
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+void timer_init(void);
+unsigned int timer_ticks(void);
+void timer_wait_us(unsigned int us);
+void timer_alarm(unsigned int us);
+void timer_tick_start(void);
+
+// Scheduler tick rate of the per-core generic timer
+#define TIMER_TICK_HZ 100
+
+#endif
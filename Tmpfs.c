@@ -0,0 +1,335 @@
+/*
+ * tmpfs.c - RAM file system for scratch files (mounted at /tmp)
+ *
+ * File data lives in 4KB pages from page_alloc(). Each file keeps a chain
+ * of index pages holding its data page pointers, plus a pointer to the
+ * last index page, so appending never walks the chain and sequential
+ * access near the end is O(1). Names are found through a small hash table.
+ * Unlinking returns every page to the pool; a file that is still open goes
+ * away on its last close.
+ */
+
+#include "tmpfs.h"
+#include "memory.h"
+#include "thread.h"
+#include "uart.h"
+#include "timer.h"
+
+#define TMPFS_BUCKETS   64
+
+// Data page pointers per index page; the last slot links the next one
+#define TMPFS_SLOTS     (PAGE_SIZE / sizeof(unsigned char*) - 1)
+
+struct tmpfs_node {
+    char name[TMPFS_NAME_MAX];
+    unsigned int size;
+    unsigned int mtime;             // timer_ticks() at the last change
+    unsigned int pages;             // Data pages in use
+    unsigned char** head;           // First index page
+    unsigned char** tail;           // Last index page
+    unsigned int tail_base;         // Data page number of tail[0]
+    unsigned int refs;
+    int used;
+    int unlinked;
+    tmpfs_node_t* next;             // Hash chain
+};
+
+static tmpfs_node_t nodes[TMPFS_MAX_FILES];
+static tmpfs_node_t* buckets[TMPFS_BUCKETS];
+static unsigned int tmpfs_pages = 0;    // Data and index pages
+
+// Serializes all tmpfs metadata and data access
+static mutex_t tmpfs_mutex;
+
+void tmpfs_init(void) {
+    memset(nodes, 0, sizeof(nodes));
+    memset(buckets, 0, sizeof(buckets));
+    tmpfs_pages = 0;
+    uart_puts("tmpfs: mounted at /tmp\n");
+}
+
+// FNV-1a
+static unsigned int tmpfs_hash(const char* name) {
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h % TMPFS_BUCKETS;
+}
+
+static int tmpfs_name_eq(const char* a, const char* b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static int tmpfs_name_valid(const char* name) {
+    int len = 0;
+    while (name[len]) {
+        if (name[len] == '/') return 0;
+        len++;
+    }
+    return len > 0 && len < TMPFS_NAME_MAX;
+}
+
+static tmpfs_node_t* tmpfs_find(const char* name) {
+    tmpfs_node_t* node = buckets[tmpfs_hash(name)];
+    while (node && !tmpfs_name_eq(node->name, name)) {
+        node = node->next;
+    }
+    return node;
+}
+
+// Returns data page n, which must already exist
+static unsigned char* tmpfs_page(tmpfs_node_t* node, unsigned int n) {
+    unsigned char** index = node->tail;
+    
+    if (n >= node->tail_base) {
+        n -= node->tail_base;
+    } else {
+        index = node->head;
+        while (n >= TMPFS_SLOTS) {
+            index = (unsigned char**)index[TMPFS_SLOTS];
+            n -= TMPFS_SLOTS;
+        }
+    }
+    return index[n];
+}
+
+// Adds one data page at the end of the file
+static unsigned char* tmpfs_append_page(tmpfs_node_t* node) {
+    unsigned int slot = node->pages - node->tail_base;
+    
+    if (!node->tail || slot == TMPFS_SLOTS) {
+        unsigned char** index = (unsigned char**)page_alloc();
+        if (!index) return 0;
+        index[TMPFS_SLOTS] = 0;
+        tmpfs_pages++;
+        
+        if (node->tail) {
+            node->tail[TMPFS_SLOTS] = (unsigned char*)index;
+            node->tail_base += TMPFS_SLOTS;
+        } else {
+            node->head = index;
+        }
+        node->tail = index;
+        slot = 0;
+    }
+    
+    unsigned char* page = (unsigned char*)page_alloc();
+    if (!page) return 0;
+    tmpfs_pages++;
+    
+    node->tail[slot] = page;
+    node->pages++;
+    return page;
+}
+
+static void tmpfs_free_pages(tmpfs_node_t* node) {
+    unsigned char** index = node->head;
+    unsigned int left = node->pages;
+    
+    while (index) {
+        unsigned char** next = (unsigned char**)index[TMPFS_SLOTS];
+        unsigned int n = left < TMPFS_SLOTS ? left : TMPFS_SLOTS;
+        
+        for (unsigned int i = 0; i < n; i++) {
+            page_free(index[i]);
+        }
+        page_free(index);
+        tmpfs_pages -= n + 1;
+        left -= n;
+        index = next;
+    }
+    
+    node->size = 0;
+    node->pages = 0;
+    node->head = 0;
+    node->tail = 0;
+    node->tail_base = 0;
+}
+
+// Takes a reference on the named file, creating it if asked to
+tmpfs_node_t* tmpfs_open(const char* name, int create) {
+    if (!tmpfs_name_valid(name)) return 0;
+    
+    mutex_lock(&tmpfs_mutex);
+    
+    tmpfs_node_t* node = tmpfs_find(name);
+    if (!node && create) {
+        for (int i = 0; i < TMPFS_MAX_FILES; i++) {
+            if (!nodes[i].used) {
+                node = &nodes[i];
+                break;
+            }
+        }
+        
+        if (node) {
+            memset(node, 0, sizeof(*node));
+            for (int i = 0; name[i]; i++) node->name[i] = name[i];
+            node->used = 1;
+            
+            unsigned int b = tmpfs_hash(name);
+            node->next = buckets[b];
+            buckets[b] = node;
+        }
+    }
+    if (node) node->refs++;
+    
+    mutex_unlock(&tmpfs_mutex);
+    return node;
+}
+
+void tmpfs_close(tmpfs_node_t* node) {
+    mutex_lock(&tmpfs_mutex);
+    
+    if (--node->refs == 0 && node->unlinked) {
+        tmpfs_free_pages(node);
+        node->used = 0;
+    }
+    
+    mutex_unlock(&tmpfs_mutex);
+}
+
+int tmpfs_read(tmpfs_node_t* node, unsigned int offset, unsigned char* buffer, unsigned int len) {
+    mutex_lock(&tmpfs_mutex);
+    
+    if (offset >= node->size) {
+        len = 0;
+    } else if (len > node->size - offset) {
+        len = node->size - offset;
+    }
+    
+    unsigned int done = 0;
+    while (done < len) {
+        unsigned int pos = offset + done;
+        unsigned int in_page = pos % PAGE_SIZE;
+        unsigned int chunk = PAGE_SIZE - in_page;
+        if (chunk > len - done) chunk = len - done;
+        
+        memcpy(buffer + done, tmpfs_page(node, pos / PAGE_SIZE) + in_page, chunk);
+        done += chunk;
+    }
+    
+    mutex_unlock(&tmpfs_mutex);
+    return done;
+}
+
+// Writes at offset, growing the file as needed; a gap past the old end
+// reads back as zeros. Returns the bytes written, which is short only
+// when the page pool runs out.
+int tmpfs_write(tmpfs_node_t* node, unsigned int offset, const unsigned char* buffer, unsigned int len) {
+    if (offset + len < offset) return TMPFS_ERROR;
+    
+    mutex_lock(&tmpfs_mutex);
+    
+    unsigned int pos = node->size < offset ? node->size : offset;
+    unsigned int end = offset + len;
+    
+    while (pos < end) {
+        unsigned int n = pos / PAGE_SIZE;
+        unsigned int in_page = pos % PAGE_SIZE;
+        unsigned int chunk = PAGE_SIZE - in_page;
+        if (chunk > end - pos) chunk = end - pos;
+        
+        unsigned char* page;
+        if (n < node->pages) {
+            page = tmpfs_page(node, n);
+        } else {
+            page = tmpfs_append_page(node);
+            if (!page) break;
+        }
+        
+        if (pos < offset) {
+            if (chunk > offset - pos) chunk = offset - pos;
+            memset(page + in_page, 0, chunk);
+        } else {
+            memcpy(page + in_page, buffer + (pos - offset), chunk);
+        }
+        pos += chunk;
+        
+        if (pos > node->size) node->size = pos;
+    }
+    node->mtime = timer_ticks();
+    
+    mutex_unlock(&tmpfs_mutex);
+    
+    if (pos <= offset) return len ? TMPFS_NO_SPACE : 0;
+    return pos - offset;
+}
+
+unsigned int tmpfs_size(tmpfs_node_t* node) {
+    return node->size;
+}
+
+unsigned int tmpfs_mtime(tmpfs_node_t* node) {
+    return node->mtime;
+}
+
+void tmpfs_truncate(tmpfs_node_t* node) {
+    mutex_lock(&tmpfs_mutex);
+    tmpfs_free_pages(node);
+    node->mtime = timer_ticks();
+    mutex_unlock(&tmpfs_mutex);
+}
+
+int tmpfs_unlink(const char* name) {
+    mutex_lock(&tmpfs_mutex);
+    
+    tmpfs_node_t* node = tmpfs_find(name);
+    if (!node) {
+        mutex_unlock(&tmpfs_mutex);
+        return TMPFS_NOT_FOUND;
+    }
+    
+    tmpfs_node_t** link = &buckets[tmpfs_hash(name)];
+    while (*link != node) link = &(*link)->next;
+    *link = node->next;
+    
+    node->unlinked = 1;
+    if (node->refs == 0) {
+        tmpfs_free_pages(node);
+        node->used = 0;
+    }
+    
+    mutex_unlock(&tmpfs_mutex);
+    return TMPFS_OK;
+}
+
+void tmpfs_list(void) {
+    uart_puts("\nFiles in /tmp:\n");
+    uart_puts("========================\n");
+    
+    mutex_lock(&tmpfs_mutex);
+    for (int i = 0; i < TMPFS_MAX_FILES; i++) {
+        if (!nodes[i].used || nodes[i].unlinked) continue;
+        
+        uart_puts(nodes[i].name);
+        uart_puts("  (");
+        uart_dec(nodes[i].size);
+        uart_puts(" bytes)\n");
+    }
+    mutex_unlock(&tmpfs_mutex);
+    
+    uart_puts("========================\n");
+}
+
+void tmpfs_stats(unsigned int* files, unsigned int* bytes, unsigned int* pages) {
+    unsigned int f = 0;
+    unsigned int b = 0;
+    
+    mutex_lock(&tmpfs_mutex);
+    for (int i = 0; i < TMPFS_MAX_FILES; i++) {
+        if (!nodes[i].used || nodes[i].unlinked) continue;
+        f++;
+        b += nodes[i].size;
+    }
+    *pages = tmpfs_pages;
+    mutex_unlock(&tmpfs_mutex);
+    
+    *files = f;
+    *bytes = b;
+}
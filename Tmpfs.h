@@ -0,0 +1,30 @@
+/*
+ * tmpfs.h - RAM file system for scratch files (mounted at /tmp)
+ */
+
+#ifndef TMPFS_H
+#define TMPFS_H
+
+#define TMPFS_OK         0
+#define TMPFS_ERROR     -1
+#define TMPFS_NOT_FOUND -2
+#define TMPFS_NO_SPACE  -3
+
+#define TMPFS_NAME_MAX   32     // Including the terminating NUL
+#define TMPFS_MAX_FILES  128
+
+typedef struct tmpfs_node tmpfs_node_t;
+
+void tmpfs_init(void);
+tmpfs_node_t* tmpfs_open(const char* name, int create);
+void tmpfs_close(tmpfs_node_t* node);
+int tmpfs_read(tmpfs_node_t* node, unsigned int offset, unsigned char* buffer, unsigned int len);
+int tmpfs_write(tmpfs_node_t* node, unsigned int offset, const unsigned char* buffer, unsigned int len);
+unsigned int tmpfs_size(tmpfs_node_t* node);
+unsigned int tmpfs_mtime(tmpfs_node_t* node);
+void tmpfs_truncate(tmpfs_node_t* node);
+int tmpfs_unlink(const char* name);
+void tmpfs_list(void);
+void tmpfs_stats(unsigned int* files, unsigned int* bytes, unsigned int* pages);
+
+#endif
@@ -3,6 +3,11 @@
  */
 
 #include "uart.h"
+#include "irq.h"
+#include "thread.h"
+#include "timer.h"
+#include "mailbox.h"
+#include "fb.h"
 
 // GPIO registers (Raspberry Pi 3)
 #define GPIO_BASE       0x3F200000
@@ -18,8 +23,36 @@
 #define UART0_FBRD      ((volatile unsigned int*)(UART0_BASE + 0x28))
 #define UART0_LCRH      ((volatile unsigned int*)(UART0_BASE + 0x2C))
 #define UART0_CR        ((volatile unsigned int*)(UART0_BASE + 0x30))
+#define UART0_IMSC      ((volatile unsigned int*)(UART0_BASE + 0x38))
 #define UART0_ICR       ((volatile unsigned int*)(UART0_BASE + 0x44))
 
+#define UART_FR_BUSY    (1 << 3)
+#define UART_FR_RXFE    (1 << 4)
+#define UART_FR_TXFF    (1 << 5)
+
+// Reference clock set by init_uart_clock; rates above clock/16 need the
+// firmware to raise it first
+#define UART_CLOCK      3000000
+#define UART_CLOCK_FAST 48000000
+static unsigned int uart_clock = UART_CLOCK;
+
+// Receive ring buffer, filled by the RX interrupt
+#define UART_RX_SIZE    256
+static volatile unsigned char rx_buffer[UART_RX_SIZE];
+static volatile unsigned int rx_head = 0;
+static volatile unsigned int rx_tail = 0;
+static int rx_irq_enabled = 0;
+
+// Character handled at interrupt time instead of being queued (Ctrl-C)
+static int intr_char = -1;
+static void (*intr_handler)(void) = 0;
+
+// Where console output goes: serial, framebuffer or both
+static int outputs = UART_OUT_SERIAL;
+
+// Set while a binary transfer owns the line; console output skips serial
+static volatile int raw_mode = 0;
+
 // Simple delay function
 static void delay(int count) {
     volatile int i;
@@ -62,16 +95,149 @@ void uart_init(void) {
     *UART0_CR = (1 << 0) | (1 << 8) | (1 << 9);
 }
 
+static void uart_irq(void) {
+    // Drain the RX FIFO into the ring buffer (drop on overflow)
+    while (!(*UART0_FR & (1 << 4))) {
+        unsigned char c = (unsigned char)*UART0_DR;
+        if (c == intr_char && intr_handler) {
+            intr_handler();
+            continue;
+        }
+        unsigned int next = (rx_head + 1) % UART_RX_SIZE;
+        if (next != rx_tail) {
+            rx_buffer[rx_head] = c;
+            rx_head = next;
+        }
+    }
+    *UART0_ICR = (1 << 4) | (1 << 6);
+    thread_wake((void*)rx_buffer);
+}
+
+// Route one input character to handler, called from the interrupt;
+// pass -1 to deliver it normally again
+void uart_set_interrupt(int c, void (*handler)(void)) {
+    intr_handler = handler;
+    intr_char = c;
+}
+
+// Switch receive to interrupts so readers block instead of spinning
+void uart_irq_init(void) {
+    *UART0_ICR = 0x7FF;
+    *UART0_IMSC = (1 << 4) | (1 << 6);     // RX and RX timeout
+    irq_register(IRQ_UART0, uart_irq);
+    rx_irq_enabled = 1;
+}
+
+void uart_set_output(int mask) {
+    outputs = mask;
+}
+
+int uart_get_output(void) {
+    return outputs;
+}
+
 void uart_putc(char c) {
-    // Wait for UART to be ready to transmit
-    while (*UART0_FR & (1 << 5)) { }
+    if (outputs & UART_OUT_FB) {
+        fb_putc(c);
+    }
+    if (!(outputs & UART_OUT_SERIAL) || raw_mode) return;
+    
+    // Wait for UART to be ready to transmit, letting other threads run
+    while (*UART0_FR & (1 << 5)) {
+        thread_yield();
+    }
     *UART0_DR = c;
 }
 
 char uart_getc(void) {
-    // Wait for UART to have received something
-    while (*UART0_FR & (1 << 4)) { }
-    return (char)(*UART0_DR);
+    if (!rx_irq_enabled) {
+        // Wait for UART to have received something
+        while (*UART0_FR & (1 << 4)) { }
+        return (char)(*UART0_DR);
+    }
+    
+    unsigned int flags = irq_save();
+    while (rx_head == rx_tail) {
+        thread_wait((void*)rx_buffer);
+    }
+    char c = (char)rx_buffer[rx_tail];
+    rx_tail = (rx_tail + 1) % UART_RX_SIZE;
+    irq_restore(flags);
+    
+    return c;
+}
+
+// Change the line speed, asking the firmware for a faster reference clock
+// when the divisor would drop below 1 (and back again for slow rates)
+int uart_set_baud(unsigned int baud) {
+    if (baud == 0 || baud > UART_CLOCK_FAST / 16) return -1;
+    unsigned int clock = baud > UART_CLOCK / 16 ? UART_CLOCK_FAST : UART_CLOCK;
+    
+    // Let the transmitter finish before the line changes speed
+    while (*UART0_FR & UART_FR_BUSY) { }
+    
+    if (clock != uart_clock) {
+        unsigned int values[3] = { MBOX_CLOCK_UART, clock, 0 };
+        if (mbox_property(MBOX_TAG_SET_CLOCK_RATE, values, 3) != 0 || values[1] == 0) {
+            return -1;
+        }
+        uart_clock = values[1];
+    }
+    
+    // Divisor in 64ths: IBRD holds the integer part, FBRD the fraction
+    unsigned int divisor = (uart_clock * 4 + baud / 2) / baud;
+    unsigned int cr = *UART0_CR;
+    *UART0_CR = 0;
+    *UART0_IBRD = divisor >> 6;
+    *UART0_FBRD = divisor & 63;
+    *UART0_LCRH = (1 << 4) | (1 << 5) | (1 << 6);     // Latches the divisor
+    *UART0_CR = cr;
+    return 0;
+}
+
+// Take the line for a binary transfer. Received bytes stay in the FIFO
+// for uart_recv() and console output stops going to serial until
+// uart_raw_end().
+void uart_raw_begin(void) {
+    raw_mode = 1;
+    if (rx_irq_enabled) {
+        *UART0_IMSC = 0;
+    }
+    rx_tail = rx_head;      // Drop queued input
+}
+
+void uart_raw_end(void) {
+    while (!(*UART0_FR & UART_FR_RXFE)) {
+        (void)*UART0_DR;
+    }
+    if (rx_irq_enabled) {
+        *UART0_ICR = 0x7FF;
+        *UART0_IMSC = (1 << 4) | (1 << 6);
+    }
+    raw_mode = 0;
+}
+
+// Next received byte, or -1 after timeout_us without one
+int uart_recv(unsigned int timeout_us) {
+    unsigned int start = timer_ticks();
+    while (*UART0_FR & UART_FR_RXFE) {
+        if (timer_ticks() - start >= timeout_us) return -1;
+    }
+    return *UART0_DR & 0xFF;
+}
+
+// Send bytes as-is, bypassing the console mux
+void uart_send(const void* data, unsigned int len) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (unsigned int i = 0; i < len; i++) {
+        while (*UART0_FR & UART_FR_TXFF) { }
+        *UART0_DR = p[i];
+    }
+}
+
+// Wait until everything written so far has left the wire
+void uart_flush(void) {
+    while (*UART0_FR & UART_FR_BUSY) { }
 }
 
 void uart_puts(const char* str) {
@@ -5,11 +5,27 @@
 #ifndef UART_H
 #define UART_H
 
+// Console outputs for uart_set_output()
+#define UART_OUT_SERIAL 1
+#define UART_OUT_FB     2
+
 void uart_init(void);
+void uart_irq_init(void);
 void uart_putc(char c);
 char uart_getc(void);
 void uart_puts(const char* str);
 void uart_hex(unsigned int num);
 void uart_dec(unsigned int num);
+void uart_set_output(int outputs);
+int uart_get_output(void);
+void uart_set_interrupt(int c, void (*handler)(void));
+
+// Binary transfers (load.c): the caller owns the line between begin and end
+int uart_set_baud(unsigned int baud);
+void uart_raw_begin(void);
+void uart_raw_end(void);
+int uart_recv(unsigned int timeout_us);
+void uart_send(const void* data, unsigned int len);
+void uart_flush(void);
 
 #endif
@@ -0,0 +1,387 @@
+/*
+ * verify.c - Check SD card files against a CRC-32 manifest
+ *
+ * The manifest is in SFV format, as written by cksfv and similar tools:
+ * one "NAME CRC32" line per file, with the CRC in hex and ';' starting
+ * a comment. It may live anywhere vfs_load() can read.
+ *
+ * The calling thread streams each file from the card into a ring of
+ * VERIFY_CHUNK slots (fat32_read_file_ring) and hands every slot to a
+ * worker thread pinned to each other online core as soon as it has
+ * landed. Workers checksum slots independently; the reader folds the
+ * results together in file order with crc32_combine() and releases the
+ * slot for the next read. The files are checked as stored, so .lz4
+ * files are not decompressed first.
+ */
+
+#include "verify.h"
+#include "fat32.h"
+#include "vfs.h"
+#include "crc32.h"
+#include "memory.h"
+#include "thread.h"
+#include "timer.h"
+#include "irq.h"
+#include "smp.h"
+#include "uart.h"
+
+#define VERIFY_SLOTS    (VERIFY_RING / VERIFY_CHUNK)
+
+// Slot states
+#define SLOT_FREE       0
+#define SLOT_QUEUED     1
+#define SLOT_BUSY       2
+#define SLOT_DONE       3
+
+typedef struct {
+    volatile int state;
+    unsigned int len;
+    unsigned int crc;
+} verify_slot_t;
+
+// One verify at a time; the workers and the reader share everything
+// below under verify_lock. Offsets are into the current file.
+static mutex_t verify_mutex;
+static spinlock_t verify_lock = 0;
+static verify_slot_t slots[VERIFY_SLOTS];
+static unsigned char* ring;
+static unsigned int file_size;
+static unsigned int queued;         // Handed to the workers
+static unsigned int combined;       // Folded into crc, slot free again
+static unsigned int crc;
+static int workers;
+static volatile int workers_running;
+static volatile int stopping;
+
+static verify_slot_t* slot_at(unsigned int offset) {
+    return &slots[(offset / VERIFY_CHUNK) % VERIFY_SLOTS];
+}
+
+// Claim the oldest queued slot, returning its index or -1
+static int verify_claim(void) {
+    int found = -1;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&verify_lock);
+    for (unsigned int offset = combined; offset < queued; offset += VERIFY_CHUNK) {
+        verify_slot_t* slot = slot_at(offset);
+        if (slot->state == SLOT_QUEUED) {
+            slot->state = SLOT_BUSY;
+            found = slot - slots;
+            break;
+        }
+    }
+    spin_unlock(&verify_lock);
+    irq_restore(flags);
+    
+    return found;
+}
+
+static void verify_hash(int index) {
+    verify_slot_t* slot = &slots[index];
+    unsigned int result = crc32(0, ring + index * VERIFY_CHUNK, slot->len);
+    
+    unsigned int flags = irq_save();
+    spin_lock(&verify_lock);
+    slot->crc = result;
+    slot->state = SLOT_DONE;
+    spin_unlock(&verify_lock);
+    irq_restore(flags);
+    
+    thread_wake(&combined);
+}
+
+static void verify_worker(void* arg) {
+    (void)arg;
+    
+    while (!stopping) {
+        int index = verify_claim();
+        if (index >= 0) {
+            verify_hash(index);
+        } else {
+            unsigned int flags = irq_save();
+            thread_wait(slots);
+            irq_restore(flags);
+        }
+    }
+    
+    unsigned int flags = irq_save();
+    spin_lock(&verify_lock);
+    workers_running--;
+    spin_unlock(&verify_lock);
+    irq_restore(flags);
+}
+
+// fat32_read_file_ring callback: queue every slot that has fully landed,
+// fold finished slots into crc in order, and when the reader is out of
+// room, help hash or sleep until the oldest slot is done
+static unsigned int verify_ready(unsigned int ready, int wait, void* ctx) {
+    (void)ctx;
+    
+    while (1) {
+        int queued_any = 0;
+        int folded = 0;
+    
+        unsigned int flags = irq_save();
+        spin_lock(&verify_lock);
+        while (queued < file_size) {
+            unsigned int len = file_size - queued < VERIFY_CHUNK ? file_size - queued : VERIFY_CHUNK;
+            if (queued + len > ready) break;
+    
+            verify_slot_t* slot = slot_at(queued);
+            slot->len = len;
+            slot->state = SLOT_QUEUED;
+            queued += len;
+            queued_any = 1;
+        }
+        while (combined < queued && slot_at(combined)->state == SLOT_DONE) {
+            verify_slot_t* slot = slot_at(combined);
+            crc = crc32_combine(crc, slot->crc, slot->len);
+            combined += slot->len;
+            slot->state = SLOT_FREE;
+            folded = 1;
+        }
+        unsigned int released = combined;
+        spin_unlock(&verify_lock);
+        irq_restore(flags);
+    
+        if (queued_any) thread_wake(slots);
+        if (!wait || folded || released >= ready) return released;
+    
+        // The card is waiting on us: lend a hand, or wait for a worker
+        int index = verify_claim();
+        if (index >= 0) {
+            verify_hash(index);
+        } else {
+            flags = irq_save();
+            thread_wait(&combined);
+            irq_restore(flags);
+        }
+    }
+}
+
+// 64-by-32 bit division by shift and subtract, so ARMv7 needs no libgcc
+static unsigned long long verify_div(unsigned long long n, unsigned int d) {
+    unsigned long long q = 0;
+    unsigned long long r = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        r = (r << 1) | ((n >> bit) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= 1ull << bit;
+        }
+    }
+    return q;
+}
+
+// Parse an SFV line into name and crc; returns 0 for blanks and comments
+static int verify_parse(char* line, char** name, unsigned int* expected) {
+    while (*line == ' ' || *line == '\t') line++;
+    if (*line == '\0' || *line == ';') return 0;
+    
+    char* end = line;
+    while (*end) end++;
+    while (end > line && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r')) end--;
+    
+    // The CRC is the last word, the name everything before it
+    char* hex = end;
+    while (hex > line && hex[-1] != ' ' && hex[-1] != '\t') hex--;
+    if (hex == line || end - hex != 8) return -1;
+    
+    unsigned int value = 0;
+    for (char* p = hex; p < end; p++) {
+        char c = *p;
+        if (c >= '0' && c <= '9') value = value * 16 + (c - '0');
+        else if (c >= 'a' && c <= 'f') value = value * 16 + (c - 'a' + 10);
+        else if (c >= 'A' && c <= 'F') value = value * 16 + (c - 'A' + 10);
+        else return -1;
+    }
+    
+    char* name_end = hex;
+    while (name_end > line && (name_end[-1] == ' ' || name_end[-1] == '\t')) name_end--;
+    *name_end = '\0';
+    *name = line;
+    *expected = value;
+    return 1;
+}
+
+// Checksum one file; returns FAT32_OK with *result set, or an error
+static int verify_file(const char* name, unsigned int* result) {
+    unsigned int size, mtime;
+    int status = fat32_stat(name, &size, &mtime);
+    if (status != FAT32_OK) return status;
+    
+    unsigned int flags = irq_save();
+    spin_lock(&verify_lock);
+    for (int i = 0; i < VERIFY_SLOTS; i++) {
+        slots[i].state = SLOT_FREE;
+    }
+    file_size = size;
+    queued = 0;
+    combined = 0;
+    crc = 0;
+    spin_unlock(&verify_lock);
+    irq_restore(flags);
+    
+    status = fat32_read_file_ring(name, ring, VERIFY_RING, verify_ready, 0);
+    if (status < 0) {
+        // Let the workers finish with the ring before it is reused
+        while (1) {
+            flags = irq_save();
+            spin_lock(&verify_lock);
+            int busy = 0;
+            for (int i = 0; i < VERIFY_SLOTS; i++) {
+                if (slots[i].state == SLOT_BUSY) busy = 1;
+                slots[i].state = slots[i].state == SLOT_QUEUED ? SLOT_FREE : slots[i].state;
+            }
+            spin_unlock(&verify_lock);
+            if (!busy) {
+                irq_restore(flags);
+                break;
+            }
+            thread_wait(&combined);
+            irq_restore(flags);
+        }
+        return status;
+    }
+    
+    while (verify_ready(size, 1, 0) < size) { }
+    *result = crc;
+    return FAT32_OK;
+}
+
+int verify_manifest(const char* path) {
+    unsigned int len;
+    const unsigned char* manifest = vfs_load(path, &len);
+    if (!manifest) {
+        uart_puts("verify: cannot read ");
+        uart_puts(path);
+        uart_puts("\n");
+        return -1;
+    }
+    if (!fat32_mounted()) {
+        uart_puts("verify: SD card not mounted\n");
+        vfs_release(manifest);
+        return -1;
+    }
+    
+    // The ring and the workers are shared, so one manifest at a time
+    mutex_lock(&verify_mutex);
+    
+    // A private, terminated copy of each line is parsed in place
+    char* text = (char*)page_alloc_run(len / PAGE_SIZE + 1);
+    ring = (unsigned char*)page_alloc_run(VERIFY_RING / PAGE_SIZE);
+    if (!text || !ring) {
+        uart_puts("verify: out of memory\n");
+        page_free(text);
+        page_free(ring);
+        ring = 0;
+        mutex_unlock(&verify_mutex);
+        vfs_release(manifest);
+        return -1;
+    }
+    memcpy(text, manifest, len);
+    text[len] = '\0';
+    vfs_release(manifest);
+    
+    // One hashing thread on every other online core
+    stopping = 0;
+    workers = 0;
+    workers_running = 0;
+    unsigned int self = smp_core_id();
+    for (unsigned int core = 0; core < SMP_MAX_CORES; core++) {
+        if (core == self || !smp_core_online(core)) continue;
+        workers_running++;
+        if (thread_create_on("verify", verify_worker, 0, THREAD_PRIO_NORMAL, core) < 0) {
+            workers_running--;
+        } else {
+            workers++;
+        }
+    }
+    
+    unsigned int files = 0;
+    unsigned int bad = 0;
+    unsigned long long bytes = 0;     // 64-bit: a card holds more than 4GB,
+    unsigned long long elapsed = 0;   // and 2^32us is only 71 minutes
+    char* line = text;
+    
+    while (*line) {
+        char* next = line;
+        while (*next && *next != '\n') next++;
+        if (*next) *next++ = '\0';
+    
+        char* name;
+        unsigned int expected;
+        int parsed = verify_parse(line, &name, &expected);
+        if (parsed < 0) {
+            uart_puts("  BAD LINE ");
+            uart_puts(line);
+            uart_puts("\n");
+            bad++;
+        } else if (parsed > 0) {
+            unsigned int actual = 0;
+            unsigned int start = timer_ticks();
+            int status = verify_file(name, &actual);
+            elapsed += timer_ticks() - start;
+            files++;
+    
+            if (status != FAT32_OK) {
+                uart_puts(status == FAT32_NOT_FOUND ? "  MISSING  " : "  ERROR    ");
+                uart_puts(name);
+                uart_puts("\n");
+                bad++;
+            } else {
+                bytes += file_size;
+                if (actual != expected) {
+                    uart_puts("  MISMATCH ");
+                    uart_puts(name);
+                    uart_puts(": expected ");
+                    uart_hex(expected);
+                    uart_puts(", got ");
+                    uart_hex(actual);
+                    uart_puts("\n");
+                    bad++;
+                }
+            }
+        }
+        line = next;
+    }
+    
+    stopping = 1;
+    while (workers_running > 0) {
+        thread_wake(slots);
+        thread_sleep(1);
+    }
+    
+    page_free(ring);
+    ring = 0;
+    mutex_unlock(&verify_mutex);
+    page_free(text);
+    
+    // Bytes per millisecond over 100 is tenths of a MB/s
+    unsigned int ms = verify_div(elapsed, 1000);
+    unsigned int tenths = ms ? verify_div(verify_div(bytes, ms), 100) : 0;
+    unsigned int mb_tenths = verify_div(bytes, 100000);
+    uart_dec(files);
+    uart_puts(" files, ");
+    uart_dec(mb_tenths / 10);
+    uart_putc('.');
+    uart_dec(mb_tenths % 10);
+    uart_puts(" MB in ");
+    uart_dec(ms);
+    uart_puts("ms, ");
+    uart_dec(tenths / 10);
+    uart_putc('.');
+    uart_dec(tenths % 10);
+    uart_puts(" MB/s with ");
+    uart_dec(workers);
+    uart_puts(workers == 1 ? " hashing core; " : " hashing cores; ");
+    if (bad) {
+        uart_dec(bad);
+        uart_puts(" failed\n");
+    } else {
+        uart_puts("all OK\n");
+    }
+    
+    return bad;
+}
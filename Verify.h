@@ -0,0 +1,15 @@
+/*
+ * verify.h - Check SD card files against a CRC-32 manifest
+ */
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#define VERIFY_CHUNK    0x10000                 // Unit of work for one core
+#define VERIFY_RING     (16 * VERIFY_CHUNK)     // Read-ahead buffer
+
+// Returns the number of files that are missing or do not match, or -1
+// if the manifest cannot be read
+int verify_manifest(const char* path);
+
+#endif
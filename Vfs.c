@@ -0,0 +1,308 @@
+/*
+ * vfs.c - Unified file namespace over initramfs, tmpfs and FAT32
+ *
+ * Paths under /tmp/ go to the RAM tmpfs. Everything else is looked up in
+ * the built-in initramfs first, so its files are always there even when
+ * the SD card is missing, then on the FAT32 volume. Only tmpfs is
+ * writable; read-only files are held whole while open.
+ *
+ * Read-only files named *.lz4 or starting with an LZ4 frame header are
+ * decompressed on load. For FAT32 files the decoder runs as clusters
+ * land, while the following reads are still in flight.
+ */
+
+#include "vfs.h"
+#include "initramfs.h"
+#include "tmpfs.h"
+#include "fat32.h"
+#include "lz4.h"
+#include "memory.h"
+#include "irq.h"
+#include "smp.h"
+#include "uart.h"
+
+typedef struct {
+    int used;
+    int flags;
+    unsigned int pos;
+    tmpfs_node_t* node;             // tmpfs files
+    const unsigned char* data;      // Read-only files, loaded whole
+    unsigned int size;
+} vfs_file_t;
+
+static vfs_file_t vfs_files[VFS_MAX_OPEN];
+static spinlock_t vfs_lock = 0;
+
+// Returns the tmpfs name for a /tmp/ path, or 0 for other paths
+static const char* vfs_tmp_name(const char* path) {
+    const char* prefix = "/tmp/";
+    while (*prefix && *path == *prefix) {
+        path++;
+        prefix++;
+    }
+    return *prefix ? 0 : path;
+}
+
+static vfs_file_t* vfs_file(int fd) {
+    if (fd < 0 || fd >= VFS_MAX_OPEN || !vfs_files[fd].used) return 0;
+    return &vfs_files[fd];
+}
+
+typedef struct {
+    int named;                      // Path ends in .lz4
+    int checked;
+    int active;
+    int status;
+    lz4_frame_t frame;
+} vfs_lz4_t;
+
+static int vfs_lz4_named(const char* path) {
+    int len = 0;
+    while (path[len]) len++;
+    if (len < 4) return 0;
+    
+    const char* ext = path + len - 4;
+    return ext[0] == '.' && (ext[1] | 0x20) == 'l' && (ext[2] | 0x20) == 'z' && ext[3] == '4';
+}
+
+// Runs on each batch of FAT32 data; the first batch decides whether the
+// file is compressed
+static void vfs_lz4_progress(const unsigned char* buffer, unsigned int ready, void* ctx) {
+    vfs_lz4_t* z = (vfs_lz4_t*)ctx;
+    
+    if (!z->checked) {
+        z->checked = 1;
+        z->active = z->named || lz4_is_frame(buffer, ready);
+    }
+    if (z->active && z->status == LZ4_OK) {
+        z->status = lz4_frame_feed(&z->frame, buffer, ready);
+    }
+}
+
+static int vfs_lz4_finish(vfs_lz4_t* z, unsigned int total, const unsigned char** data, unsigned int* size) {
+    if (z->status == LZ4_OK && !lz4_frame_done(&z->frame, total)) z->status = LZ4_ERROR;
+    if (z->status != LZ4_OK) {
+        lz4_frame_discard(&z->frame);
+        return z->status == LZ4_NO_MEM ? VFS_NO_SPACE : VFS_CORRUPT;
+    }
+    
+    z->frame.out[z->frame.out_len] = '\0';
+    *data = z->frame.out;
+    *size = z->frame.out_len;
+    return VFS_OK;
+}
+
+// Loads a read-only file: in place from initramfs unless it needs
+// decompressing, else into a page run
+static int vfs_load_ro(const char* path, const unsigned char** data, unsigned int* size) {
+    vfs_lz4_t z;
+    memset(&z, 0, sizeof(z));
+    z.named = vfs_lz4_named(path);
+    lz4_frame_init(&z.frame);
+    
+    unsigned int len;
+    const unsigned char* file = initramfs_lookup(path, &len);
+    if (file) {
+        vfs_lz4_progress(file, len, &z);
+        if (z.active) return vfs_lz4_finish(&z, len, data, size);
+        
+        *data = file;
+        *size = len;
+        return VFS_OK;
+    }
+    
+    while (*path == '/') path++;
+    
+    int file_size = fat32_file_size(path);
+    if (file_size < 0) return VFS_NOT_FOUND;
+    
+    unsigned char* buffer = (unsigned char*)page_alloc_run(file_size / PAGE_SIZE + 1);
+    if (!buffer) return VFS_NO_SPACE;
+    
+    int result = fat32_read_file_progress(path, buffer, file_size, vfs_lz4_progress, &z);
+    if (result < 0) {
+        lz4_frame_discard(&z.frame);
+        page_free(buffer);
+        return VFS_ERROR;
+    }
+    
+    if (z.active) {
+        page_free(buffer);
+        return vfs_lz4_finish(&z, result, data, size);
+    }
+    
+    buffer[result] = '\0';
+    *data = buffer;
+    *size = result;
+    return VFS_OK;
+}
+
+int vfs_open(const char* path, int flags) {
+    vfs_file_t f;
+    memset(&f, 0, sizeof(f));
+    f.used = 1;
+    f.flags = flags;
+    
+    const char* tmp_name = vfs_tmp_name(path);
+    if (tmp_name) {
+        f.node = tmpfs_open(tmp_name, flags & VFS_O_CREATE);
+        if (!f.node) return (flags & VFS_O_CREATE) ? VFS_ERROR : VFS_NOT_FOUND;
+        if (flags & VFS_O_TRUNC) tmpfs_truncate(f.node);
+    } else {
+        int result = vfs_load_ro(path, &f.data, &f.size);
+        if (result != VFS_OK) return result;
+        if (flags & (VFS_O_WRITE | VFS_O_TRUNC | VFS_O_APPEND)) {
+            vfs_release(f.data);
+            return VFS_READ_ONLY;
+        }
+    }
+    
+    unsigned int irq = irq_save();
+    spin_lock(&vfs_lock);
+    
+    int fd = 0;
+    while (fd < VFS_MAX_OPEN && vfs_files[fd].used) fd++;
+    if (fd < VFS_MAX_OPEN) vfs_files[fd] = f;
+    
+    spin_unlock(&vfs_lock);
+    irq_restore(irq);
+    
+    if (fd == VFS_MAX_OPEN) {
+        if (f.node) tmpfs_close(f.node);
+        vfs_release(f.data);
+        return VFS_ERROR;
+    }
+    return fd;
+}
+
+int vfs_read(int fd, void* buffer, unsigned int len) {
+    vfs_file_t* f = vfs_file(fd);
+    if (!f) return VFS_ERROR;
+    
+    int n;
+    if (f->node) {
+        n = tmpfs_read(f->node, f->pos, (unsigned char*)buffer, len);
+    } else {
+        if (f->pos >= f->size) return 0;
+        if (len > f->size - f->pos) len = f->size - f->pos;
+        memcpy(buffer, f->data + f->pos, len);
+        n = len;
+    }
+    
+    if (n > 0) f->pos += n;
+    return n;
+}
+
+int vfs_write(int fd, const void* buffer, unsigned int len) {
+    vfs_file_t* f = vfs_file(fd);
+    if (!f) return VFS_ERROR;
+    if (!f->node || !(f->flags & (VFS_O_WRITE | VFS_O_APPEND))) return VFS_READ_ONLY;
+    
+    if (f->flags & VFS_O_APPEND) f->pos = tmpfs_size(f->node);
+    
+    int n = tmpfs_write(f->node, f->pos, (const unsigned char*)buffer, len);
+    if (n == TMPFS_NO_SPACE) return VFS_NO_SPACE;
+    if (n > 0) f->pos += n;
+    return n;
+}
+
+int vfs_close(int fd) {
+    vfs_file_t* f = vfs_file(fd);
+    if (!f) return VFS_ERROR;
+    
+    if (f->node) tmpfs_close(f->node);
+    vfs_release(f->data);
+    f->used = 0;
+    return VFS_OK;
+}
+
+int vfs_unlink(const char* path) {
+    const char* tmp_name = vfs_tmp_name(path);
+    if (tmp_name) {
+        return tmpfs_unlink(tmp_name) == TMPFS_OK ? VFS_OK : VFS_NOT_FOUND;
+    }
+    
+    const unsigned char* data;
+    unsigned int size;
+    int result = vfs_load_ro(path, &data, &size);
+    if (result != VFS_OK) return result;
+    vfs_release(data);
+    return VFS_READ_ONLY;
+}
+
+// Size and modification stamp, for callers that cache file contents
+int vfs_stat(const char* path, unsigned int* size, unsigned int* mtime) {
+    const char* tmp_name = vfs_tmp_name(path);
+    if (tmp_name) {
+        tmpfs_node_t* node = tmpfs_open(tmp_name, 0);
+        if (!node) return VFS_NOT_FOUND;
+        *size = tmpfs_size(node);
+        *mtime = tmpfs_mtime(node);
+        tmpfs_close(node);
+        return VFS_OK;
+    }
+    
+    // Built-in files only change with the kernel image
+    if (initramfs_lookup(path, size)) {
+        *mtime = 0;
+        return VFS_OK;
+    }
+    
+    while (*path == '/') path++;
+    return fat32_stat(path, size, mtime) == FAT32_OK ? VFS_OK : VFS_NOT_FOUND;
+}
+
+const char* vfs_strerror(int error) {
+    switch (error) {
+        case VFS_OK:        return "OK";
+        case VFS_NOT_FOUND: return "file not found";
+        case VFS_READ_ONLY: return "read-only file system";
+        case VFS_NO_SPACE:  return "out of space";
+        case VFS_CORRUPT:   return "corrupt compressed data";
+        default:            return "I/O error";
+    }
+}
+
+// Returns the whole file, NUL terminated. Uncompressed initramfs files
+// are returned in place; others are copied into a page run. Pass the
+// result to vfs_release() when done.
+const unsigned char* vfs_load(const char* path, unsigned int* size) {
+    const char* tmp_name = vfs_tmp_name(path);
+    if (!tmp_name) {
+        const unsigned char* data;
+        return vfs_load_ro(path, &data, size) == VFS_OK ? data : 0;
+    }
+    
+    tmpfs_node_t* node = tmpfs_open(tmp_name, 0);
+    if (!node) return 0;
+    
+    unsigned int len = tmpfs_size(node);
+    unsigned char* buffer = (unsigned char*)page_alloc_run(len / PAGE_SIZE + 1);
+    if (buffer) {
+        len = tmpfs_read(node, 0, buffer, len);
+        buffer[len] = '\0';
+        *size = len;
+    }
+    
+    tmpfs_close(node);
+    return buffer;
+}
+
+void vfs_release(const unsigned char* data) {
+    if (page_owned(data)) {
+        page_free((void*)data);
+    } else if (data && !initramfs_contains(data)) {
+        free((void*)data);
+    }
+}
+
+void vfs_list(void) {
+    initramfs_list();
+    tmpfs_list();
+    
+    if (fat32_mounted()) {
+        fat32_list_files();
+    } else {
+        uart_puts("\nSD card not mounted\n");
+    }
+}
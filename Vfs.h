@@ -0,0 +1,36 @@
+/*
+ * vfs.h - Unified file namespace over initramfs, tmpfs and FAT32
+ */
+
+#ifndef VFS_H
+#define VFS_H
+
+#define VFS_OK          0
+#define VFS_ERROR      -1
+#define VFS_NOT_FOUND  -2
+#define VFS_READ_ONLY  -3
+#define VFS_NO_SPACE   -4
+#define VFS_CORRUPT    -5
+
+// vfs_open() flags
+#define VFS_O_READ     0x01
+#define VFS_O_WRITE    0x02
+#define VFS_O_CREATE   0x04
+#define VFS_O_TRUNC    0x08
+#define VFS_O_APPEND   0x10
+
+#define VFS_MAX_OPEN   16
+
+int vfs_open(const char* path, int flags);
+int vfs_read(int fd, void* buffer, unsigned int len);
+int vfs_write(int fd, const void* buffer, unsigned int len);
+int vfs_close(int fd);
+int vfs_unlink(const char* path);
+int vfs_stat(const char* path, unsigned int* size, unsigned int* mtime);
+const char* vfs_strerror(int error);
+
+const unsigned char* vfs_load(const char* path, unsigned int* size);
+void vfs_release(const unsigned char* data);
+void vfs_list(void);
+
+#endif
@@ -0,0 +1,8 @@
+# hello.py - Simple hello world
+print("Hello from MicroPython on Nib OS!")
+print("Python is running!")
+print("")
+print("System info:")
+print("- Direct hardware access")
+print("- Lightweight and fast")
+print("- Python powered!")
@@ -0,0 +1,58 @@
+/*
+ * libc.c - C library routines MicroPython needs beyond the kernel's own
+ *
+ * memcpy, memset, memmove, strlen, strcmp, strncmp and strcpy come from
+ * the kernel (memory.c, kernel.c).
+ */
+
+#include <stddef.h>
+
+int memcmp(const void* a, const void* b, size_t len) {
+    const unsigned char* p = (const unsigned char*)a;
+    const unsigned char* q = (const unsigned char*)b;
+    
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] != q[i]) return p[i] - q[i];
+    }
+    return 0;
+}
+
+void* memchr(const void* s, int c, size_t len) {
+    const unsigned char* p = (const unsigned char*)s;
+    
+    for (size_t i = 0; i < len; i++) {
+        if (p[i] == (unsigned char)c) return (void*)(p + i);
+    }
+    return NULL;
+}
+
+char* strchr(const char* s, int c) {
+    while (*s != (char)c) {
+        if (*s == '\0') return NULL;
+        s++;
+    }
+    return (char*)s;
+}
+
+char* strrchr(const char* s, int c) {
+    const char* last = NULL;
+    do {
+        if (*s == (char)c) last = s;
+    } while (*s++);
+    return (char*)last;
+}
+
+char* strstr(const char* haystack, const char* needle) {
+    if (*needle == '\0') return (char*)haystack;
+    
+    for (; *haystack; haystack++) {
+        const char* h = haystack;
+        const char* n = needle;
+        while (*n && *h == *n) {
+            h++;
+            n++;
+        }
+        if (*n == '\0') return (char*)haystack;
+    }
+    return NULL;
+}
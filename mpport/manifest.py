@@ -0,0 +1,9 @@
+# Modules frozen into kernel.img as bytecode; they import without any
+# file system access. Needs lib/micropython-lib in the MicroPython tree.
+
+require("functools")
+require("bisect")
+require("copy")
+require("string")
+
+freeze("$(PORT_DIR)/modules")
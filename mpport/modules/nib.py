@@ -0,0 +1,18 @@
+# nib.py - Helpers for scripts running on Nib OS (frozen into the kernel)
+
+import time
+import nibos
+
+
+def timed(fn, *args):
+    """Call fn(*args) and print how long it took."""
+    start = time.ticks_us()
+    result = fn(*args)
+    elapsed = time.ticks_diff(time.ticks_us(), start)
+    print("{}: {} us".format(getattr(fn, "__name__", "call"), elapsed))
+    return result
+
+
+def lines(path):
+    """Return the lines of a text file from initramfs, /tmp or the SD card."""
+    return nibos.read(path).decode().split("\n")
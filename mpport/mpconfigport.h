@@ -0,0 +1,42 @@
+/*
+ * mpconfigport.h - MicroPython configuration for Nib OS
+ */
+
+#include <stdint.h>
+
+// Start from the basic feature set and add what the shell relies on
+#define MICROPY_CONFIG_ROM_LEVEL            (MICROPY_CONFIG_ROM_LEVEL_BASIC_FEATURES)
+
+#define MICROPY_ENABLE_COMPILER             (1)
+#define MICROPY_ENABLE_GC                   (1)
+#define MICROPY_STACK_CHECK                 (1)
+#define MICROPY_HELPER_REPL                 (1)
+#define MICROPY_REPL_AUTO_INDENT            (1)
+#define MICROPY_KBD_EXCEPTION               (1)
+#define MICROPY_ENABLE_EXTERNAL_IMPORT      (1)
+#define MICROPY_ALLOC_PATH_MAX              (64)
+
+// Compiled scripts are kept as .mpy images between runs
+#define MICROPY_PERSISTENT_CODE_LOAD        (1)
+#define MICROPY_PERSISTENT_CODE_SAVE        (1)
+
+// Single precision maps onto the VFP unit the kernel already enables
+#define MICROPY_FLOAT_IMPL                  (MICROPY_FLOAT_IMPL_FLOAT)
+#define MICROPY_LONGINT_IMPL                (MICROPY_LONGINT_IMPL_MPZ)
+
+#define MICROPY_PY_SYS                      (1)
+#define MICROPY_PY_MATH                     (1)
+#define MICROPY_PY_TIME                     (1)
+#define MICROPY_PY_IO                       (0)
+
+#define MICROPY_HW_BOARD_NAME               "Raspberry Pi 2/3"
+#define MICROPY_HW_MCU_NAME                 "BCM2836/7"
+
+// Pointer sized, as MicroPython requires: 32 bits on ARM, 64 on AArch64
+typedef intptr_t mp_int_t;
+typedef uintptr_t mp_uint_t;
+typedef long mp_off_t;
+
+#define MP_STATE_PORT MP_STATE_VM
+
+#include <alloca.h>
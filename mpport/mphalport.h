@@ -0,0 +1,8 @@
+/*
+ * mphalport.h - MicroPython hardware abstraction for Nib OS
+ *
+ * Console, tick and delay hooks are implemented in mpport.c on top of
+ * the kernel's UART, system timer and scheduler.
+ */
+
+void mp_hal_set_interrupt_char(int c);
@@ -0,0 +1,336 @@
+/*
+ * mpport.c - MicroPython port glue for Nib OS
+ *
+ * The interpreter gets its own GC heap from the page pool at boot, so the
+ * first script pays no setup cost. Scripts started with run are compiled
+ * once and kept as .mpy images in a small cache outside the GC heap,
+ * keyed on path, size and modification time; a repeat run loads the
+ * bytecode without parsing or compiling. One script or REPL runs at a
+ * time; callers on other threads wait for it.
+ */
+
+#include <string.h>
+
+#include "py/compile.h"
+#include "py/runtime.h"
+#include "py/gc.h"
+#include "py/stackctrl.h"
+#include "py/persistentcode.h"
+#include "py/mphal.h"
+#include "py/mperrno.h"
+#include "shared/runtime/pyexec.h"
+#include "shared/readline/readline.h"
+
+#include "memory.h"
+#include "uart.h"
+#include "timer.h"
+#include "thread.h"
+#include "vfs.h"
+
+#define MPY_HEAP_PAGES      512                         // 2MB GC heap
+#define MPY_STACK_LIMIT     (THREAD_STACK_SIZE - 4096)  // Leave room below
+#define MPY_CACHE_SIZE      16
+#define MPY_PATH_MAX        64
+
+typedef struct {
+    char path[MPY_PATH_MAX];
+    unsigned int size;              // Source size and mtime at compile time
+    unsigned int mtime;
+    unsigned char* mpy;             // Page run holding the .mpy image
+    unsigned int len;
+    unsigned int last_used;
+} mpy_cache_t;
+
+static mpy_cache_t mpy_cache[MPY_CACHE_SIZE];
+static unsigned int mpy_clock = 0;
+static unsigned char* mpy_heap = 0;
+static mutex_t mpy_mutex;
+
+int micropython_init(void) {
+    mpy_heap = (unsigned char*)page_alloc_run(MPY_HEAP_PAGES);
+    if (!mpy_heap) {
+        uart_puts("MicroPython: no memory for the GC heap\n");
+        return -1;
+    }
+
+    mp_stack_ctrl_init();
+    mp_stack_set_limit(MPY_STACK_LIMIT);
+    gc_init(mpy_heap, mpy_heap + MPY_HEAP_PAGES * PAGE_SIZE);
+    mp_init();
+
+    uart_puts("MicroPython: ");
+    uart_dec(MPY_HEAP_PAGES * PAGE_SIZE / 1024);
+    uart_puts("KB GC heap\n");
+    return 0;
+}
+
+// Bytecode cache
+
+static mpy_cache_t* mpy_cache_find(const char* path, unsigned int size, unsigned int mtime) {
+    for (int i = 0; i < MPY_CACHE_SIZE; i++) {
+        mpy_cache_t* e = &mpy_cache[i];
+        if (e->mpy && e->size == size && e->mtime == mtime && strcmp(e->path, path) == 0) {
+            e->last_used = ++mpy_clock;
+            return e;
+        }
+    }
+    return 0;
+}
+
+static void mpy_cache_store(const char* path, unsigned int size, unsigned int mtime,
+                            const unsigned char* mpy, unsigned int len) {
+    if (strlen(path) >= MPY_PATH_MAX) return;
+
+    // Replace a stale entry for the same path, else the least recently used
+    mpy_cache_t* slot = &mpy_cache[0];
+    for (int i = 0; i < MPY_CACHE_SIZE; i++) {
+        mpy_cache_t* e = &mpy_cache[i];
+        if (e->mpy && strcmp(e->path, path) == 0) {
+            slot = e;
+            break;
+        }
+        if (!e->mpy || e->last_used < slot->last_used) slot = e;
+    }
+
+    page_free(slot->mpy);
+    slot->mpy = (unsigned char*)page_alloc_run((len + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!slot->mpy) return;
+
+    memcpy(slot->mpy, mpy, len);
+    strcpy(slot->path, path);
+    slot->size = size;
+    slot->mtime = mtime;
+    slot->len = len;
+    slot->last_used = ++mpy_clock;
+}
+
+// Turns compiled or loaded code into a function running in __main__
+static mp_obj_t mpy_make_function(mp_compiled_module_t* cm) {
+    return mp_make_function_from_proto_fun(cm->rc, cm->context, NULL);
+}
+
+static mp_module_context_t* mpy_new_context(void) {
+    mp_module_context_t* ctx = m_new_obj(mp_module_context_t);
+    ctx->module.globals = mp_globals_get();
+    return ctx;
+}
+
+static mp_obj_t mpy_load_cached(mpy_cache_t* e) {
+    mp_compiled_module_t cm;
+    memset(&cm, 0, sizeof(cm));
+    cm.context = mpy_new_context();
+    mp_raw_code_load_mem(e->mpy, e->len, &cm);
+    return mpy_make_function(&cm);
+}
+
+static mp_obj_t mpy_compile(const char* path, unsigned int size, unsigned int mtime) {
+    unsigned int len;
+    const unsigned char* src = vfs_load(path, &len);
+    if (!src) mp_raise_OSError(MP_ENOENT);
+
+    mp_compiled_module_t cm;
+    memset(&cm, 0, sizeof(cm));
+    cm.context = mpy_new_context();
+
+    // The source buffer lives outside the GC heap; release it on errors too
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0) {
+        qstr name = qstr_from_str(path);
+        mp_lexer_t* lex = mp_lexer_new_from_str_len(name, (const char*)src, len, 0);
+        mp_parse_tree_t tree = mp_parse(lex, MP_PARSE_FILE_INPUT);
+        mp_compile_to_raw_code(&tree, name, false, &cm);
+        nlr_pop();
+    } else {
+        vfs_release(src);
+        nlr_jump(nlr.ret_val);
+    }
+    vfs_release(src);
+
+    vstr_t vstr;
+    mp_print_t print;
+    vstr_init_print(&vstr, 256, &print);
+    mp_raw_code_save(&cm, &print);
+    mpy_cache_store(path, size, mtime, (const unsigned char*)vstr.buf, vstr.len);
+    vstr_clear(&vstr);
+
+    return mpy_make_function(&cm);
+}
+
+int micropython_run_file(const char* path) {
+    unsigned int size, mtime;
+    if (!mpy_heap || vfs_stat(path, &size, &mtime) != VFS_OK) {
+        uart_puts("run: file not found\n");
+        return -1;
+    }
+
+    mutex_lock(&mpy_mutex);
+    mp_stack_ctrl_init();
+
+    int result = 0;
+    nlr_buf_t nlr;
+    if (nlr_push(&nlr) == 0) {
+        mp_hal_set_interrupt_char(CHAR_CTRL_C);
+
+        mpy_cache_t* cached = mpy_cache_find(path, size, mtime);
+        mp_obj_t fun = cached ? mpy_load_cached(cached) : mpy_compile(path, size, mtime);
+        mp_call_function_0(fun);
+
+        mp_hal_set_interrupt_char(-1);
+        mp_handle_pending(true);
+        nlr_pop();
+    } else {
+        mp_hal_set_interrupt_char(-1);
+        mp_handle_pending(false);
+        mp_obj_print_exception(&mp_plat_print, MP_OBJ_FROM_PTR(nlr.ret_val));
+        result = -1;
+    }
+
+    mutex_unlock(&mpy_mutex);
+    return result;
+}
+
+void micropython_repl(void) {
+    if (!mpy_heap) {
+        uart_puts("python: MicroPython failed to start\n");
+        return;
+    }
+
+    mutex_lock(&mpy_mutex);
+    mp_stack_ctrl_init();
+    uart_puts("Ctrl-D returns to the Nib OS shell\n");
+    pyexec_friendly_repl();
+    mutex_unlock(&mpy_mutex);
+}
+
+// nibos module: file access for scripts
+
+static mp_obj_t nibos_read(mp_obj_t path_in) {
+    const char* path = mp_obj_str_get_str(path_in);
+    unsigned int len;
+    const unsigned char* data = vfs_load(path, &len);
+    if (!data) mp_raise_OSError(MP_ENOENT);
+
+    mp_obj_t bytes = mp_obj_new_bytes(data, len);
+    vfs_release(data);
+    return bytes;
+}
+static MP_DEFINE_CONST_FUN_OBJ_1(nibos_read_obj, nibos_read);
+
+static mp_obj_t nibos_write(mp_obj_t path_in, mp_obj_t data_in) {
+    const char* path = mp_obj_str_get_str(path_in);
+    mp_buffer_info_t buf;
+    mp_get_buffer_raise(data_in, &buf, MP_BUFFER_READ);
+
+    int fd = vfs_open(path, VFS_O_WRITE | VFS_O_CREATE | VFS_O_TRUNC);
+    if (fd < 0) mp_raise_OSError(fd == VFS_READ_ONLY ? MP_EROFS : MP_EIO);
+
+    int n = vfs_write(fd, buf.buf, buf.len);
+    vfs_close(fd);
+    if (n != (int)buf.len) mp_raise_OSError(MP_ENOSPC);
+    return MP_OBJ_NEW_SMALL_INT(n);
+}
+static MP_DEFINE_CONST_FUN_OBJ_2(nibos_write_obj, nibos_write);
+
+static const mp_rom_map_elem_t nibos_globals_table[] = {
+    { MP_ROM_QSTR(MP_QSTR___name__), MP_ROM_QSTR(MP_QSTR_nibos) },
+    { MP_ROM_QSTR(MP_QSTR_read), MP_ROM_PTR(&nibos_read_obj) },
+    { MP_ROM_QSTR(MP_QSTR_write), MP_ROM_PTR(&nibos_write_obj) },
+};
+static MP_DEFINE_CONST_DICT(nibos_globals, nibos_globals_table);
+
+const mp_obj_module_t nibos_module = {
+    .base = { &mp_type_module },
+    .globals = (mp_obj_dict_t*)&nibos_globals,
+};
+MP_REGISTER_MODULE(MP_QSTR_nibos, nibos_module);
+
+// Imports of .py files go through the same namespace as the shell
+
+mp_import_stat_t mp_import_stat(const char* path) {
+    unsigned int size, mtime;
+    return vfs_stat(path, &size, &mtime) == VFS_OK ? MP_IMPORT_STAT_FILE : MP_IMPORT_STAT_NO_EXIST;
+}
+
+mp_lexer_t* mp_lexer_new_from_file(qstr filename) {
+    unsigned int len;
+    const unsigned char* data = vfs_load(qstr_str(filename), &len);
+    if (!data) mp_raise_OSError(MP_ENOENT);
+
+    // Copy into the GC heap so the lexer frees it when done
+    char* src = m_new(char, len);
+    memcpy(src, data, len);
+    vfs_release(data);
+    return mp_lexer_new_from_str_len(filename, src, len, len);
+}
+
+// Console, time and interrupts
+
+static void mpy_keyboard_interrupt(void) {
+    mp_sched_keyboard_interrupt();
+}
+
+void mp_hal_set_interrupt_char(int c) {
+    uart_set_interrupt(c, c >= 0 ? mpy_keyboard_interrupt : 0);
+}
+
+int mp_hal_stdin_rx_chr(void) {
+    return (unsigned char)uart_getc();
+}
+
+mp_uint_t mp_hal_stdout_tx_strn(const char* str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        uart_putc(str[i]);
+    }
+    return len;
+}
+
+mp_uint_t mp_hal_ticks_ms(void) {
+    return timer_ticks() / 1000;
+}
+
+mp_uint_t mp_hal_ticks_us(void) {
+    return timer_ticks();
+}
+
+mp_uint_t mp_hal_ticks_cpu(void) {
+    return timer_ticks();
+}
+
+void mp_hal_delay_ms(mp_uint_t ms) {
+    thread_sleep(ms);
+}
+
+void mp_hal_delay_us(mp_uint_t us) {
+    timer_wait_us(us);
+}
+
+// Runtime hooks
+
+void gc_collect(void) {
+    gc_collect_start();
+
+    // Spill callee-saved registers to the stack, then scan from sp to the
+    // top recorded when the interpreter was entered
+    unsigned long sp;
+#ifdef __aarch64__
+    unsigned long regs[10];
+    asm volatile("stp x19, x20, [%1]\n\tstp x21, x22, [%1, #16]\n\t"
+                 "stp x23, x24, [%1, #32]\n\tstp x25, x26, [%1, #48]\n\t"
+                 "stp x27, x28, [%1, #64]\n\tmov %0, sp"
+                 : "=r"(sp) : "r"(regs) : "memory");
+#else
+    unsigned int regs[8];
+    asm volatile("stmia %1, {r4-r11}\n\tmov %0, sp" : "=r"(sp) : "r"(regs) : "memory");
+#endif
+    gc_collect_root((void**)sp, ((unsigned long)MP_STATE_THREAD(stack_top) - sp) / sizeof(void*));
+
+    gc_collect_end();
+}
+
+void nlr_jump_fail(void* val) {
+    (void)val;
+    uart_puts("MicroPython: uncaught exception outside any handler, halting\n");
+    while (1) {
+        asm volatile("wfe");
+    }
+}
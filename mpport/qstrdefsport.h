@@ -0,0 +1 @@
+// qstrs specific to the Nib OS port
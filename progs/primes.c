@@ -0,0 +1,71 @@
+/*
+ * primes.c - Sample native program: count primes with a sieve
+ *
+ * Build with make progs/primes.elf, copy it to the card (or send it with
+ * tools/nibload -f) and run exec primes.elf 10000000.
+ */
+
+#define EXEC_PROGRAM
+#include "exec.h"
+
+static const exec_sys_t* sys;
+
+static void put_dec(unsigned int n) {
+    char buffer[12];
+    int i = 0;
+    
+    do {
+        buffer[i++] = '0' + n % 10;
+        n /= 10;
+    } while (n);
+    while (i > 0) sys->putc(buffer[--i]);
+}
+
+static unsigned int parse_dec(const char* s) {
+    unsigned int n = 0;
+    while (*s >= '0' && *s <= '9') n = n * 10 + (*s++ - '0');
+    return n;
+}
+
+int _start(const exec_sys_t* table, int argc, char** argv) {
+    sys = table;
+    if (sys->version != EXEC_ABI_VERSION) return 1;
+    
+    unsigned int limit = argc > 1 ? parse_dec(argv[1]) : 1000000;
+    if (limit < 2) {
+        sys->puts("usage: primes <limit>\n");
+        return 1;
+    }
+    
+    // One bit per odd number
+    unsigned int words = (limit / 2 + 32) / 32;
+    unsigned int* composite = (unsigned int*)sys->alloc(words * 4);
+    if (!composite) {
+        sys->puts("primes: out of memory\n");
+        return 2;
+    }
+    for (unsigned int i = 0; i < words; i++) composite[i] = 0;
+    
+    unsigned int start = sys->ticks();
+    unsigned int count = 1;             // 2
+    for (unsigned int n = 3; n <= limit; n += 2) {
+        unsigned int bit = n / 2;
+        if (composite[bit / 32] & (1u << (bit % 32))) continue;
+        count++;
+        if (n > limit / n) continue;
+        for (unsigned int m = n * n; m <= limit && m >= n; m += 2 * n) {
+            composite[(m / 2) / 32] |= 1u << ((m / 2) % 32);
+        }
+    }
+    unsigned int elapsed = sys->ticks() - start;
+    
+    put_dec(count);
+    sys->puts(" primes up to ");
+    put_dec(limit);
+    sys->puts(" in ");
+    put_dec(elapsed / 1000);
+    sys->puts("ms\n");
+    
+    sys->free(composite);
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * lz4test.c - Host round trip check for the kernel's LZ4 decoder
+ *
+ * Usage: lz4test <input> <input.lz4>
+ *
+ * Runs on the build host (make lz4test). Decodes the frame with lz4.c
+ * itself, whole and fed a few bytes at a time as the card would deliver
+ * it, checks the output against the original file and reports how fast
+ * the frame decodes in MB/s of output.
+ */
+
+/* lz4.c is kernel code: keep its memory.h names away from libc's */
+#define malloc  kernel_malloc
+#define free    kernel_free
+#define memset  kernel_memset
+#define memcpy  kernel_memcpy
+#define memmove kernel_memmove
+#include "../lz4.c"
+#undef malloc
+#undef free
+#undef memset
+#undef memcpy
+#undef memmove
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define MIN_SECONDS     0.25    /* Timing runs at least this long */
+
+void* kernel_memset(void* dest, int val, unsigned int len) {
+    return memset(dest, val, len);
+}
+
+void* kernel_memcpy(void* dest, const void* src, unsigned int len) {
+    return memcpy(dest, src, len);
+}
+
+void* page_alloc_run(unsigned int count) {
+    return malloc((size_t)count * PAGE_SIZE);
+}
+
+void page_free(void* page) {
+    free(page);
+}
+
+static unsigned char* load(const char* path, long* size) {
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return NULL;
+    }
+    fseek(f, 0, SEEK_END);
+    *size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    
+    unsigned char* data = malloc(*size + 1);
+    if (!data || fread(data, 1, *size, f) != (size_t)*size) {
+        perror(path);
+        return NULL;
+    }
+    fclose(f);
+    return data;
+}
+
+/* Decodes the frame handing it over step bytes at a time (0: all at once) */
+static int decode(lz4_frame_t* f, const unsigned char* in, unsigned int size, unsigned int step) {
+    lz4_frame_init(f);
+    if (step == 0) step = size;
+    
+    for (unsigned int ready = 0; ready < size; ) {
+        ready = size - ready < step ? size : ready + step;
+        int status = lz4_frame_feed(f, in, ready);
+        if (status != LZ4_OK) return status;
+    }
+    return lz4_frame_done(f, size) ? LZ4_OK : LZ4_ERROR;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <input> <input.lz4>\n", argv[0]);
+        return 1;
+    }
+    
+    long size, packed;
+    unsigned char* original = load(argv[1], &size);
+    unsigned char* frame = load(argv[2], &packed);
+    if (!original || !frame) return 1;
+    
+    static const unsigned int steps[] = { 0, 1, 7, 1000 };
+    lz4_frame_t f;
+    
+    for (unsigned int i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+        int status = decode(&f, frame, packed, steps[i]);
+        if (status != LZ4_OK || f.out_len != (unsigned long)size ||
+            memcmp(f.out, original, size) != 0) {
+            fprintf(stderr, "%s: round trip FAILED (status %d, %u of %ld bytes, step %u)\n",
+                    argv[1], status, f.out_len, size, steps[i]);
+            return 1;
+        }
+        lz4_frame_discard(&f);
+    }
+    
+    /* Whole-frame decode speed, output allocation included */
+    unsigned long runs = 0;
+    double start = now(), elapsed;
+    do {
+        decode(&f, frame, packed, 0);
+        lz4_frame_discard(&f);
+        runs++;
+        elapsed = now() - start;
+    } while (elapsed < MIN_SECONDS);
+    
+    printf("%-24s %8ld -> %8ld bytes (%5.1f%%)  round trip OK  %6.0f MB/s\n",
+           argv[1], size, packed, size ? 100.0 * packed / size : 0.0,
+           size * (double)runs / elapsed / 1e6);
+    
+    free(original);
+    free(frame);
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ * mkinitramfs.c - Pack a directory into a Nib OS initramfs archive
+ *
+ * Usage: mkinitramfs <output.img> <directory>
+ *
+ * Runs on the build host. Regular files in the top level of the directory
+ * are stored under their lowercased names; the index is sorted so the
+ * kernel can binary search it. The layout must match initramfs.h.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define INITRAMFS_MAGIC     0x5242494E  /* "NIBR" */
+#define INITRAMFS_NAME_MAX  24
+#define INITRAMFS_ALIGN     16
+#define MAX_FILES           256
+
+struct file {
+    char name[INITRAMFS_NAME_MAX];
+    char path[4096];
+    uint32_t offset;
+    uint32_t size;
+};
+
+static struct file files[MAX_FILES];
+
+static int by_name(const void* a, const void* b) {
+    return strcmp(((const struct file*)a)->name, ((const struct file*)b)->name);
+}
+
+static void put32(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <output.img> <directory>\n", argv[0]);
+        return 1;
+    }
+    
+    DIR* dir = opendir(argv[2]);
+    if (!dir) {
+        perror(argv[2]);
+        return 1;
+    }
+    
+    unsigned int count = 0;
+    struct dirent* de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        
+        char path[sizeof(files[0].path)];
+        snprintf(path, sizeof(path), "%s/%s", argv[2], de->d_name);
+        
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        
+        if (strlen(de->d_name) >= INITRAMFS_NAME_MAX) {
+            fprintf(stderr, "%s: name longer than %d characters\n",
+                    de->d_name, INITRAMFS_NAME_MAX - 1);
+            return 1;
+        }
+        if (count == MAX_FILES) {
+            fprintf(stderr, "too many files (max %d)\n", MAX_FILES);
+            return 1;
+        }
+        
+        struct file* f = &files[count];
+        memcpy(f->path, path, sizeof(f->path));
+        memset(f->name, 0, sizeof(f->name));
+        for (size_t i = 0; de->d_name[i]; i++) {
+            f->name[i] = tolower((unsigned char)de->d_name[i]);
+        }
+        f->size = st.st_size;
+        count++;
+    }
+    closedir(dir);
+    
+    qsort(files, count, sizeof(files[0]), by_name);
+    
+    for (unsigned int i = 1; i < count; i++) {
+        if (strcmp(files[i - 1].name, files[i].name) == 0) {
+            fprintf(stderr, "%s: duplicate name after lowercasing\n", files[i].name);
+            return 1;
+        }
+    }
+    
+    /* Lay out the data: every file is NUL terminated and 16-byte aligned */
+    uint32_t offset = 16 + count * (INITRAMFS_NAME_MAX + 8);
+    offset = (offset + INITRAMFS_ALIGN - 1) & ~(INITRAMFS_ALIGN - 1);
+    for (unsigned int i = 0; i < count; i++) {
+        files[i].offset = offset;
+        offset += files[i].size + 1;
+        offset = (offset + INITRAMFS_ALIGN - 1) & ~(INITRAMFS_ALIGN - 1);
+    }
+    
+    unsigned char* image = calloc(1, offset);
+    if (!image) {
+        perror("calloc");
+        return 1;
+    }
+    
+    put32(image + 0, INITRAMFS_MAGIC);
+    put32(image + 4, count);
+    put32(image + 8, offset);
+    
+    for (unsigned int i = 0; i < count; i++) {
+        unsigned char* e = image + 16 + i * (INITRAMFS_NAME_MAX + 8);
+        memcpy(e, files[i].name, INITRAMFS_NAME_MAX);
+        put32(e + INITRAMFS_NAME_MAX, files[i].offset);
+        put32(e + INITRAMFS_NAME_MAX + 4, files[i].size);
+        
+        FILE* in = fopen(files[i].path, "rb");
+        if (!in || fread(image + files[i].offset, 1, files[i].size, in) != files[i].size) {
+            perror(files[i].path);
+            return 1;
+        }
+        fclose(in);
+    }
+    
+    FILE* out = fopen(argv[1], "wb");
+    if (!out || fwrite(image, 1, offset, out) != offset || fclose(out) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    
+    printf("initramfs: %u files, %u bytes\n", count, offset);
+    free(image);
+    return 0;
+}
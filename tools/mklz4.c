@@ -0,0 +1,188 @@
+/*
+ * mklz4.c - Compress a file into an LZ4 frame for Nib OS
+ *
+ * Usage: mklz4 <input> <output.lz4>
+ *
+ * Runs on the build host, for systems without the lz4 command. Writes a
+ * standard frame (64KB independent blocks, content size recorded) that
+ * both the kernel and the reference lz4 tool can decode. Matching is a
+ * simple greedy hash search, so ratios are a little below lz4 -1.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE      (64 * 1024)
+#define HASH_BITS       14
+#define MIN_MATCH       4
+#define LAST_LITERALS   5       /* A block must end with this many literals */
+#define MFLIMIT         12      /* No match may start this close to the end */
+
+static uint32_t read32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* xxHash32, for the frame header checksum */
+static uint32_t rotl(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static uint32_t xxh32(const uint8_t* p, size_t len, uint32_t seed) {
+    const uint32_t P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u;
+    const uint32_t P4 = 668265263u, P5 = 374761393u;
+    const uint8_t* end = p + len;
+    uint32_t h;
+    
+    if (len >= 16) {
+        uint32_t v[4] = { seed + P1 + P2, seed + P2, seed, seed - P1 };
+        while (end - p >= 16) {
+            for (int i = 0; i < 4; i++, p += 4) {
+                v[i] = rotl(v[i] + read32(p) * P2, 13) * P1;
+            }
+        }
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+    } else {
+        h = seed + P5;
+    }
+    h += len;
+    
+    for (; end - p >= 4; p += 4) h = rotl(h + read32(p) * P3, 17) * P4;
+    for (; p < end; p++) h = rotl(h + *p * P5, 11) * P1;
+    
+    h ^= h >> 15;
+    h *= P2;
+    h ^= h >> 13;
+    h *= P3;
+    h ^= h >> 16;
+    return h;
+}
+
+static uint8_t* put_length(uint8_t* op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+static uint8_t* put_sequence(uint8_t* op, const uint8_t* lit, size_t lit_len,
+                             size_t offset, size_t match_len) {
+    uint8_t* token = op++;
+    *token = (lit_len >= 15 ? 15 : lit_len) << 4;
+    if (lit_len >= 15) op = put_length(op, lit_len - 15);
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    
+    if (match_len) {
+        *op++ = offset;
+        *op++ = offset >> 8;
+        match_len -= MIN_MATCH;
+        *token |= match_len >= 15 ? 15 : match_len;
+        if (match_len >= 15) op = put_length(op, match_len - 15);
+    }
+    return op;
+}
+
+/* Compresses one independent block; dst must hold n + n / 255 + 16 bytes */
+static size_t compress_block(const uint8_t* src, size_t n, uint8_t* dst) {
+    static int32_t table[1 << HASH_BITS];
+    uint8_t* op = dst;
+    size_t anchor = 0;
+    size_t ip = 0;
+    
+    memset(table, 0xFF, sizeof(table));
+    
+    while (n > MFLIMIT && ip < n - MFLIMIT) {
+        uint32_t seq = read32(src + ip);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        int32_t ref = table[h];
+        table[h] = ip;
+        
+        if (ref < 0 || ip - ref > 65535 || read32(src + ref) != seq) {
+            ip++;
+            continue;
+        }
+        
+        size_t len = MIN_MATCH;
+        while (ip + len < n - LAST_LITERALS && src[ref + len] == src[ip + len]) len++;
+        
+        op = put_sequence(op, src + anchor, ip - anchor, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+    
+    return put_sequence(op, src + anchor, n - anchor, 0, 0) - dst;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s <input> <output.lz4>\n", argv[0]);
+        return 1;
+    }
+    
+    FILE* in = fopen(argv[1], "rb");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if (size < 0 || size > 0x7FFFFFFF) {
+        fprintf(stderr, "%s: bad size\n", argv[1]);
+        return 1;
+    }
+    
+    uint8_t* src = malloc(size + 1);
+    uint8_t* dst = malloc(19 + size + size / 255 + (size / BLOCK_SIZE + 1) * 24);
+    if (!src || !dst || fread(src, 1, size, in) != (size_t)size) {
+        perror(argv[1]);
+        return 1;
+    }
+    fclose(in);
+    
+    /* Frame header: version 01, independent blocks, content size; 64KB blocks */
+    uint8_t* op = dst;
+    put32(op, 0x184D2204);
+    op[4] = 0x68;
+    op[5] = 0x40;
+    put32(op + 6, size);
+    put32(op + 10, 0);
+    op[14] = xxh32(op + 4, 10, 0) >> 8;
+    op += 15;
+    
+    for (long pos = 0; pos < size; pos += BLOCK_SIZE) {
+        size_t n = size - pos < BLOCK_SIZE ? size - pos : BLOCK_SIZE;
+        size_t c = compress_block(src + pos, n, op + 4);
+        
+        if (c >= n) {
+            memcpy(op + 4, src + pos, n);
+            put32(op, 0x80000000 | n);
+            op += 4 + n;
+        } else {
+            put32(op, c);
+            op += 4 + c;
+        }
+    }
+    put32(op, 0);
+    op += 4;
+    
+    FILE* out = fopen(argv[2], "wb");
+    if (!out || fwrite(dst, 1, op - dst, out) != (size_t)(op - dst) || fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    
+    printf("%s: %ld -> %ld bytes\n", argv[2], size, (long)(op - dst));
+    return 0;
+}
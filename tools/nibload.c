@@ -0,0 +1,476 @@
+/*
+ * nibload.c - Send a kernel or a file to Nib OS over a serial line
+ *
+ * Usage: nibload [-b baud] [-f name] [-m] <tty> <file>
+ *
+ *   -b baud   speed for the transfer itself (default 921600); the
+ *             handshake always runs at 115200
+ *   -f name   push an ordinary file, saved as /tmp/<name>, instead of
+ *             replacing the kernel
+ *   -m        stay attached afterwards and print what the board sends
+ *
+ * Start it, then reset the board: the kernel listens for a moment at
+ * boot (kernels only). A running shell is asked with "load" first, so a
+ * reset is not needed while Nib OS is up. The protocol is described in
+ * load.h.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOAD_SYNC       0x5A
+#define LOAD_BLOCK      1024
+#define LOAD_BAUD       115200
+
+#define LOAD_HELLO      0x01
+#define LOAD_START      0x02
+#define LOAD_DATA       0x03
+#define LOAD_END        0x04
+#define LOAD_ACK        0x80
+#define LOAD_READY      0x81
+#define LOAD_NAK        0x82
+#define LOAD_DONE       0x83
+#define LOAD_ERR        0x84
+
+#define LOAD_KERNEL     0x01
+
+#define HEADER_SIZE     12
+#define NONE            -1      /* Timeout */
+#define BAD             -2      /* Damaged frame */
+
+#define MAX_RETRIES     20
+
+typedef struct {
+    int type;
+    unsigned int seq;
+    unsigned int len;
+    uint8_t payload[LOAD_BLOCK];
+} frame_t;
+
+static int tty;
+
+static uint32_t crc32(uint32_t crc, const uint8_t* p, size_t len) {
+    static uint32_t table[256];
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++) c = (c & 1) ? (c >> 1) ^ 0xEDB88320 : c >> 1;
+            table[i] = c;
+        }
+    }
+    crc = ~crc;
+    while (len--) crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t read32(const uint8_t* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static unsigned long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* Serial line */
+
+static speed_t speed_code(unsigned int baud) {
+    switch (baud) {
+        case 115200: return B115200;
+        case 230400: return B230400;
+#ifdef B460800
+        case 460800: return B460800;
+#endif
+#ifdef B500000
+        case 500000: return B500000;
+#endif
+#ifdef B576000
+        case 576000: return B576000;
+#endif
+#ifdef B921600
+        case 921600: return B921600;
+#endif
+#ifdef B1000000
+        case 1000000: return B1000000;
+#endif
+#ifdef B1152000
+        case 1152000: return B1152000;
+#endif
+#ifdef B1500000
+        case 1500000: return B1500000;
+#endif
+#ifdef B2000000
+        case 2000000: return B2000000;
+#endif
+#ifdef B2500000
+        case 2500000: return B2500000;
+#endif
+#ifdef B3000000
+        case 3000000: return B3000000;
+#endif
+        default: return 0;
+    }
+}
+
+static int set_baud(unsigned int baud) {
+    struct termios t;
+    speed_t code = speed_code(baud);
+    if (!code || tcgetattr(tty, &t) != 0) return -1;
+
+    tcdrain(tty);
+    cfsetispeed(&t, code);
+    cfsetospeed(&t, code);
+    return tcsetattr(tty, TCSANOW, &t);
+}
+
+static int open_tty(const char* path) {
+    struct termios t;
+
+    tty = open(path, O_RDWR | O_NOCTTY);
+    if (tty < 0 || tcgetattr(tty, &t) != 0) return -1;
+
+    cfmakeraw(&t);
+    t.c_cflag |= CLOCAL | CREAD;
+    t.c_cflag &= ~(CSTOPB | PARENB);
+#ifdef CRTSCTS
+    t.c_cflag &= ~CRTSCTS;
+#endif
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    if (tcsetattr(tty, TCSANOW, &t) != 0) return -1;
+    return set_baud(LOAD_BAUD);
+}
+
+static void write_all(const void* data, size_t len) {
+    const uint8_t* p = data;
+    while (len > 0) {
+        ssize_t n = write(tty, p, len);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            perror("write");
+            exit(1);
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* Buffered reads with a deadline */
+static uint8_t rx_buf[4096];
+static size_t rx_pos, rx_len;
+
+static int read_byte(unsigned long deadline) {
+    while (rx_pos == rx_len) {
+        long wait = (long)(deadline - now_ms());
+        if (wait < 0) return NONE;
+
+        struct pollfd pfd = { tty, POLLIN, 0 };
+        if (poll(&pfd, 1, wait) <= 0) continue;
+
+        ssize_t n = read(tty, rx_buf, sizeof(rx_buf));
+        if (n > 0) {
+            rx_pos = 0;
+            rx_len = n;
+        }
+    }
+    return rx_buf[rx_pos++];
+}
+
+static void discard_input(void) {
+    tcflush(tty, TCIFLUSH);
+    rx_pos = rx_len = 0;
+}
+
+/* Frames */
+
+static void send_frame(int type, unsigned int seq, const void* payload, unsigned int len) {
+    uint8_t frame[HEADER_SIZE + LOAD_BLOCK];
+
+    frame[0] = LOAD_SYNC;
+    frame[1] = type;
+    frame[2] = seq;
+    frame[3] = seq >> 8;
+    frame[4] = len;
+    frame[5] = len >> 8;
+    uint32_t check = crc32(0, frame, 6);
+    frame[6] = check;
+    frame[7] = check >> 8;
+    put32(frame + 8, 0);
+    if (len) memcpy(frame + HEADER_SIZE, payload, len);
+    put32(frame + 8, crc32(0, frame, HEADER_SIZE + len));
+
+    write_all(frame, HEADER_SIZE + len);
+}
+
+/* Wait up to timeout_ms for a frame; returns its type, NONE or BAD */
+static int recv_frame(frame_t* f, unsigned int timeout_ms) {
+    unsigned long deadline = now_ms() + timeout_ms;
+    uint8_t header[HEADER_SIZE];
+    int c;
+
+    do {
+        if ((c = read_byte(deadline)) < 0) return NONE;
+    } while (c != LOAD_SYNC);
+
+    /* Once a frame has started, allow it time to finish */
+    deadline = now_ms() + 100;
+    header[0] = LOAD_SYNC;
+    for (int i = 1; i < HEADER_SIZE; i++) {
+        if ((c = read_byte(deadline)) < 0) return BAD;
+        header[i] = c;
+    }
+
+    f->type = header[1];
+    f->seq = header[2] | (header[3] << 8);
+    f->len = header[4] | (header[5] << 8);
+    uint32_t check = crc32(0, header, 6);
+    if (header[6] != (check & 0xFF) || header[7] != ((check >> 8) & 0xFF) || f->len > LOAD_BLOCK) {
+        return BAD;
+    }
+
+    for (unsigned int i = 0; i < f->len; i++) {
+        if ((c = read_byte(deadline)) < 0) return BAD;
+        f->payload[i] = c;
+    }
+
+    uint32_t crc = read32(header + 8);
+    put32(header + 8, 0);
+    if (crc32(crc32(0, header, HEADER_SIZE), f->payload, f->len) != crc) return BAD;
+    return f->type;
+}
+
+static const char* error_text(uint32_t code) {
+    switch (code) {
+        case 1: return "image too large";
+        case 2: return "board is out of memory";
+        case 3: return "CRC mismatch";
+        case 4: return "board timed out";
+        case 5: return "the boot stage only takes kernels; send files from the shell";
+        default: return "transfer refused";
+    }
+}
+
+static void fail_frame(const frame_t* f, const char* what) {
+    if (f->type == LOAD_ERR && f->len >= 4) {
+        fprintf(stderr, "nibload: %s\n", error_text(read32(f->payload)));
+    } else {
+        fprintf(stderr, "nibload: no response %s\n", what);
+    }
+    exit(1);
+}
+
+/* HELLO until READY; returns the advertised window and max size */
+static int hello(frame_t* f, unsigned long timeout_ms, int ask_shell) {
+    unsigned long start = now_ms();
+    unsigned long asked = 0;
+
+    while (now_ms() - start < timeout_ms) {
+        if (ask_shell && now_ms() - asked >= 5000) {
+            write_all("\rload\r", 6);
+            asked = now_ms();
+        }
+        send_frame(LOAD_HELLO, 0, 0, 0);
+
+        int type;
+        unsigned long until = now_ms() + 100;
+        while ((type = recv_frame(f, 100)) != NONE && type != LOAD_READY && now_ms() < until) { }
+        if (type == LOAD_READY && f->len >= 16) return 0;
+    }
+    return -1;
+}
+
+static void progress(unsigned int done, unsigned int total, unsigned long start) {
+    unsigned long ms = now_ms() - start;
+    fprintf(stderr, "\r  %u/%u KB  %lu KB/s ", done / 1024, total / 1024,
+            ms ? (unsigned long)done / ms : 0);
+}
+
+int main(int argc, char** argv) {
+    unsigned int baud = 921600;
+    const char* name = 0;
+    int monitor = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:f:m")) != -1) {
+        switch (opt) {
+            case 'b': baud = strtoul(optarg, 0, 10); break;
+            case 'f': name = optarg; break;
+            case 'm': monitor = 1; break;
+            default: goto usage;
+        }
+    }
+    if (argc - optind != 2) {
+usage:
+        fprintf(stderr, "usage: %s [-b baud] [-f name] [-m] <tty> <file>\n", argv[0]);
+        return 1;
+    }
+    const char* tty_path = argv[optind];
+    const char* path = argv[optind + 1];
+
+    if (!speed_code(baud)) {
+        fprintf(stderr, "nibload: %u baud is not supported here\n", baud);
+        return 1;
+    }
+
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    uint8_t* data = malloc(size > 0 ? size : 1);
+    if (size <= 0 || !data || fread(data, 1, size, in) != (size_t)size) {
+        fprintf(stderr, "%s: cannot read\n", path);
+        return 1;
+    }
+    fclose(in);
+
+    if (open_tty(tty_path) != 0) {
+        perror(tty_path);
+        return 1;
+    }
+
+    frame_t f;
+    fprintf(stderr, "nibload: waiting for Nib OS on %s (reset the board if it is not at the shell)\n",
+            tty_path);
+    discard_input();
+    if (hello(&f, (unsigned long)-1, 1) != 0) return 1;
+
+    unsigned int window = read32(f.payload + 8);
+    unsigned int max_size = read32(f.payload + 12);
+    if (window == 0) window = 1;
+    if ((unsigned long)size > max_size) {
+        fprintf(stderr, "nibload: %ld bytes do not fit, the board has %u free\n", size, max_size);
+        return 1;
+    }
+
+    /* START: size, CRC, speed, flags, name */
+    uint8_t start[48];
+    memset(start, 0, sizeof(start));
+    put32(start, size);
+    put32(start + 4, crc32(0, data, size));
+    put32(start + 8, baud);
+    put32(start + 12, name ? 0 : LOAD_KERNEL);
+    if (!name) {
+        name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+    }
+    strncpy((char*)start + 16, name, 31);
+
+    int type;
+    discard_input();
+    send_frame(LOAD_START, 0, start, sizeof(start));
+    while ((type = recv_frame(&f, 1000)) == LOAD_READY || type == BAD) { }
+    if (type != LOAD_ACK || f.len < 4) fail_frame(&f, "to START");
+
+    /* Both ends switch to the speed named in the ACK */
+    unsigned int speed = read32(f.payload);
+    if (set_baud(speed) != 0) {
+        fprintf(stderr, "nibload: cannot switch to %u baud\n", speed);
+        return 1;
+    }
+    usleep(20000);
+    discard_input();
+    if (hello(&f, 2000, 0) != 0) {
+        fprintf(stderr, "nibload: lost the board after switching to %u baud\n", speed);
+        return 1;
+    }
+
+    fprintf(stderr, "nibload: sending %s, %ld bytes at %u baud\n", name, size, speed);
+
+    /* Time for a full window to cross the line (10 bits per byte) */
+    unsigned long window_ms = window * (LOAD_BLOCK + HEADER_SIZE) * 10000UL / speed + 20;
+
+    unsigned int blocks = (size + LOAD_BLOCK - 1) / LOAD_BLOCK;
+    unsigned int base = 0, next = 0, retries = 0;
+    unsigned int nak_seq = (unsigned int)-1;
+    unsigned long nak_time = 0;
+    unsigned long t0 = now_ms(), shown = 0;
+
+    while (base < blocks) {
+        while (next < blocks && next < base + window) {
+            unsigned int offset = next * LOAD_BLOCK;
+            unsigned int len = size - offset < LOAD_BLOCK ? size - offset : LOAD_BLOCK;
+            send_frame(LOAD_DATA, next, data + offset, len);
+            next++;
+        }
+
+        type = recv_frame(&f, 2 * window_ms + 100);
+        /* Sequence numbers are 16 bits: take them relative to base */
+        unsigned int seq = base + (uint16_t)(f.seq - base);
+
+        if ((type == LOAD_ACK || type == LOAD_NAK) && seq <= blocks) {
+            if (seq > base) {
+                base = seq;
+                retries = 0;
+            }
+            /* Frames sent before a rewind draw more NAKs for the same
+               block; only go back again once the resent ones had time */
+            if (type == LOAD_NAK && (seq != nak_seq || now_ms() - nak_time >= window_ms)) {
+                next = seq;
+                nak_seq = seq;
+                nak_time = now_ms();
+                retries++;
+            }
+        } else if (type == LOAD_ERR) {
+            fprintf(stderr, "\n");
+            fail_frame(&f, "");
+        } else if (type == NONE) {
+            next = base;
+            retries++;
+        }
+        if (retries > MAX_RETRIES) {
+            fprintf(stderr, "\nnibload: too many errors at block %u\n", base);
+            return 1;
+        }
+
+        if (now_ms() - shown >= 100) {
+            progress(base * LOAD_BLOCK, size, t0);
+            shown = now_ms();
+        }
+    }
+    progress(size, size, t0);
+    fprintf(stderr, "\n");
+
+    for (int i = 0; i < 3; i++) {
+        send_frame(LOAD_END, 0, 0, 0);
+        while ((type = recv_frame(&f, 1000)) == LOAD_ACK || type == LOAD_NAK || type == BAD) { }
+        if (type == LOAD_DONE || type == LOAD_ERR) break;
+    }
+    set_baud(LOAD_BAUD);
+    if (type != LOAD_DONE) fail_frame(&f, "to END");
+
+    fprintf(stderr, "nibload: done in %.1f s\n", (now_ms() - t0) / 1000.0);
+
+    if (monitor) {
+        uint8_t buf[256];
+        while (1) {
+            ssize_t n = read(tty, buf, sizeof(buf));
+            if (n > 0) {
+                fwrite(buf, 1, n, stdout);
+                fflush(stdout);
+            } else {
+                struct pollfd pfd = { tty, POLLIN, 0 };
+                poll(&pfd, 1, -1);
+            }
+        }
+    }
+    return 0;
+}